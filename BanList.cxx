@@ -0,0 +1,355 @@
+/* bzflag
+ * Copyright (c) 1993-2023 Tim Riker
+ *
+ * This package is free software;  you can redistribute it and/or
+ * modify it under the terms of the license found in the file
+ * named COPYING that should have accompanied this file.
+ *
+ * THIS PACKAGE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* interface header */
+#include "BanList.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+const uint64_t BanList::offlineFlag;
+const int BanList::maxReaders;
+
+// Bits taken per trie step, 64 children a node
+static const unsigned stride = 6;
+
+// Trie node while the tables are being built, with every slot spelled out
+struct BuildNode
+{
+    uint8_t value[1 << stride];
+    BuildNode *child[1 << stride];
+
+    explicit BuildNode(uint8_t fill)
+    {
+        memset(value, fill, sizeof value);
+        memset(child, 0, sizeof child);
+    }
+
+    ~BuildNode()
+    {
+        for (BuildNode *node : child)
+            delete node;
+    }
+};
+
+// The stride bits of a 128 bit key at offset, counting from the top; bits past the end read as 0
+static unsigned chunk(uint64_t high, uint64_t low, unsigned offset)
+{
+    const uint64_t mask = (1 << stride) - 1;
+    if (offset + stride <= 64)
+        return (high >> (64 - stride - offset)) & mask;
+    if (offset < 64)
+        return ((high << (offset + stride - 64)) | (low >> (128 - stride - offset))) & mask;
+    if (offset + stride <= 128)
+        return (low >> (128 - stride - offset)) & mask;
+    return (low << (offset + stride - 128)) & mask;
+}
+
+bool BanList::Prefix::operator<(const Prefix &other) const
+{
+    if (ipv4 != other.ipv4)
+        return ipv4;
+    if (high != other.high)
+        return high < other.high;
+    if (low != other.low)
+        return low < other.low;
+    return length < other.length;
+}
+
+BanList::BanList() : current(nullptr), epoch(1), readerCount(0)
+{
+    for (int i = 0; i < maxReaders; ++i)
+        readers[i].store(offlineFlag);
+
+    // Start out with tables that ban nothing
+    std::vector<const Prefix *> none;
+    Tables *tables = new Tables;
+    build(none, tables->ipv4);
+    build(none, tables->ipv6);
+    current.store(tables);
+}
+
+BanList::~BanList()
+{
+    delete current.load();
+}
+
+bool BanList::parse(const char *cidr, Prefix &prefix)
+{
+    std::string address(cidr);
+    int length = -1;
+
+    const size_t slash = address.find('/');
+    if (slash != std::string::npos)
+    {
+        char *end;
+        length = (int)strtol(address.c_str() + slash + 1, &end, 10);
+        if (*end != '\0' || end == address.c_str() + slash + 1)
+            return false;
+        address.resize(slash);
+    }
+
+    struct in_addr in4;
+    struct in6_addr in6;
+    if (inet_pton(AF_INET, address.c_str(), &in4) == 1)
+    {
+        if (length == -1)
+            length = 32;
+        if (length < 0 || length > 32)
+            return false;
+
+        prefix.ipv4 = true;
+        prefix.high = (uint64_t)ntohl(in4.s_addr) << 32;
+        prefix.low = 0;
+    }
+    else if (inet_pton(AF_INET6, address.c_str(), &in6) == 1)
+    {
+        if (length == -1)
+            length = 128;
+        if (length < 0 || length > 128)
+            return false;
+
+        prefix.ipv4 = false;
+        prefix.high = 0;
+        prefix.low = 0;
+        for (int i = 0; i < 8; ++i)
+        {
+            prefix.high = (prefix.high << 8) | in6.s6_addr[i];
+            prefix.low = (prefix.low << 8) | in6.s6_addr[i + 8];
+        }
+
+        // A v4-mapped range is an IPv4 one
+        if (IN6_IS_ADDR_V4MAPPED(&in6) && length >= 96)
+        {
+            prefix.ipv4 = true;
+            prefix.high = prefix.low << 32;
+            prefix.low = 0;
+            length -= 96;
+        }
+    }
+    else
+        return false;
+
+    // Clear the host bits, so the same range always compares equal
+    if (length < 64)
+    {
+        prefix.high &= length == 0 ? 0 : ~0ULL << (64 - length);
+        prefix.low = 0;
+    }
+    else if (length < 128)
+        prefix.low &= length == 64 ? 0 : ~0ULL << (128 - length);
+    prefix.length = length;
+
+    return true;
+}
+
+bool BanList::add(const char *cidr)
+{
+    Prefix prefix;
+    if (!parse(cidr, prefix))
+        return false;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    prefixes.insert(prefix);
+    return true;
+}
+
+bool BanList::remove(const char *cidr)
+{
+    Prefix prefix;
+    if (!parse(cidr, prefix))
+        return false;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    prefixes.erase(prefix);
+    return true;
+}
+
+void BanList::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    prefixes.clear();
+}
+
+size_t BanList::size() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return prefixes.size();
+}
+
+void BanList::build(const std::vector<const Prefix *> &list, Trie &trie)
+{
+    // Shorter prefixes go in first, so a child made for a longer one starts out with the value
+    // of the slot it hangs off (leaf pushing)
+    std::vector<const Prefix *> sorted(list);
+    std::stable_sort(sorted.begin(), sorted.end(), [](const Prefix *a, const Prefix *b)
+    {
+        return a->length < b->length;
+    });
+
+    BuildNode root(0);
+    for (const Prefix *prefix : sorted)
+    {
+        BuildNode *node = &root;
+        unsigned offset = 0;
+        while ((unsigned)prefix->length > offset + stride)
+        {
+            const unsigned slot = chunk(prefix->high, prefix->low, offset);
+            if (node->child[slot] == nullptr)
+                node->child[slot] = new BuildNode(node->value[slot]);
+            node = node->child[slot];
+            offset += stride;
+        }
+
+        // The prefix ends in this node, covering a run of its slots
+        const unsigned span = 1 << (offset + stride - prefix->length);
+        const unsigned first = chunk(prefix->high, prefix->low, offset) & ~(span - 1);
+        memset(node->value + first, 1, span);
+    }
+
+    // Lay the nodes out breadth first, so the children of a node are next to each other
+    trie.nodes.clear();
+    trie.leaves.clear();
+    std::vector<const BuildNode *> queue(1, &root);
+    for (size_t i = 0; i < queue.size(); ++i)
+    {
+        const BuildNode *node = queue[i];
+        Node packed;
+        packed.vector = 0;
+        packed.leafvec = 0;
+        packed.childBase = (uint32_t)queue.size();
+        packed.leafBase = (uint32_t)trie.leaves.size();
+
+        bool first = true;
+        uint8_t last = 0;
+        for (unsigned slot = 0; slot < (1 << stride); ++slot)
+        {
+            if (node->child[slot] != nullptr)
+            {
+                packed.vector |= 1ULL << slot;
+                queue.push_back(node->child[slot]);
+            }
+            else if (first || node->value[slot] != last)
+            {
+                packed.leafvec |= 1ULL << slot;
+                trie.leaves.push_back(node->value[slot]);
+                last = node->value[slot];
+                first = false;
+            }
+        }
+
+        trie.nodes.push_back(packed);
+    }
+}
+
+bool BanList::Trie::lookup(uint64_t high, uint64_t low) const
+{
+    uint32_t index = 0;
+    unsigned offset = 0;
+
+    while (true)
+    {
+        const Node &node = nodes[index];
+        const unsigned slot = chunk(high, low, offset);
+
+        // Everything up to and including slot, 2 << 63 wraps around to all of them
+        const uint64_t upTo = (2ULL << slot) - 1;
+
+        if ((node.vector >> slot) & 1)
+        {
+            index = node.childBase + __builtin_popcountll(node.vector & upTo) - 1;
+            offset += stride;
+            continue;
+        }
+
+        return leaves[node.leafBase + __builtin_popcountll(node.leafvec & upTo) - 1] != 0;
+    }
+}
+
+void BanList::publish()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    std::vector<const Prefix *> ipv4, ipv6;
+    for (const Prefix &prefix : prefixes)
+        (prefix.ipv4 ? ipv4 : ipv6).push_back(&prefix);
+
+    Tables *tables = new Tables;
+    build(ipv4, tables->ipv4);
+    build(ipv6, tables->ipv6);
+
+    const Tables *old = current.exchange(tables);
+    const uint64_t swapped = epoch.fetch_add(1) + 1;
+
+    // A reader online since before the swap may still be in the old tables
+    const int count = readerCount.load();
+    for (int i = 0; i < count; ++i)
+    {
+        while (true)
+        {
+            const uint64_t state = readers[i].load();
+            if ((state & offlineFlag) || state >= swapped)
+                break;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    delete old;
+}
+
+int BanList::addReader()
+{
+    const int reader = readerCount.fetch_add(1);
+    if (reader >= maxReaders)
+    {
+        readerCount.fetch_sub(1);
+        return -1;
+    }
+    return reader;
+}
+
+void BanList::online(int reader)
+{
+    readers[reader].store(epoch.load());
+}
+
+void BanList::offline(int reader)
+{
+    readers[reader].store(offlineFlag);
+}
+
+bool BanList::banned(const PeerAddress &peer) const
+{
+    const Tables *tables = current.load();
+
+    if (peer.isIPv4())
+        return tables->ipv4.lookup(peer.low() << 32, 0);
+    if (!peer.valid())
+        return false;
+    return tables->ipv6.lookup(peer.high(), peer.low());
+}
+
+
+/* Local Variables: ***
+ * mode: C++ ***
+ * tab-width: 8 ***
+ * c-basic-offset: 2 ***
+ * indent-tabs-mode: t ***
+ * End: ***
+ * ex: shiftwidth=2 tabstop=8
+ */
@@ -0,0 +1,121 @@
+/* bzflag
+ * Copyright (c) 1993-2023 Tim Riker
+ *
+ * This package is free software;  you can redistribute it and/or
+ * modify it under the terms of the license found in the file
+ * named COPYING that should have accompanied this file.
+ *
+ * THIS PACKAGE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __BANLIST_H__
+#define __BANLIST_H__
+
+/* common header */
+#include "common.h"
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <vector>
+
+#include "PeerAddress.h"
+
+// IPv4 and IPv6 addresses and CIDR ranges that may not connect.  Lookups
+// are longest prefix matches in a poptrie (a multibit trie taking 6 bits a
+// step, with children and leaves packed by bitmap and popcount), so an IPv4
+// address takes at most 6 steps and an IPv6 one 22, however long the list.
+// v4-mapped IPv6 addresses are looked up as the IPv4 address they carry.
+//
+// The tables are never changed in place: publish() builds new ones and swaps
+// them in, so event loops keep looking up while the list changes.  The old
+// tables are freed once every reader has been offline (between passes of its
+// event loop) since the swap.
+class BanList {
+    public:
+        BanList();
+        ~BanList();
+
+        // Any thread.  An address, or an address and prefix length ("10.0.0.0/8", "2001:db8::/32").
+        // Changes take effect on publish(), false if the text doesn't parse.
+        bool add(const char *cidr);
+        bool remove(const char *cidr);
+        void clear();
+        size_t size() const;
+
+        // Swap in tables built from the current list, returning once no reader can be using the
+        // old ones any more
+        void publish();
+
+        // Readers are the threads running lookups, each registered once up front.  A reader is
+        // online while it may look up, and should go offline whenever it could block for a while.
+        int addReader();
+        void online(int reader);
+        void offline(int reader);
+
+        // Only between online() and offline()
+        bool banned(const PeerAddress &peer) const;
+    private:
+        struct Prefix
+        {
+            uint64_t high;
+            uint64_t low;
+            int length;
+            bool ipv4;
+
+            bool operator<(const Prefix &other) const;
+        };
+        static bool parse(const char *cidr, Prefix &prefix);
+
+        // One poptrie node: a bit per 6 bit chunk value, set in vector for a child and in leafvec
+        // where a run of equal leaves starts
+        struct Node
+        {
+            uint64_t vector;
+            uint64_t leafvec;
+            uint32_t leafBase;
+            uint32_t childBase;
+        };
+
+        struct Trie
+        {
+            std::vector<Node> nodes;
+            std::vector<uint8_t> leaves;
+
+            // Keys are 128 bits starting at the top of high, IPv4 addresses use the first 32
+            bool lookup(uint64_t high, uint64_t low) const;
+        };
+
+        struct Tables
+        {
+            Trie ipv4;
+            Trie ipv6;
+        };
+
+        static void build(const std::vector<const Prefix *> &prefixes, Trie &trie);
+
+        // Set in a reader's state while it is offline
+        static const uint64_t offlineFlag = 1ULL << 63;
+        static const int maxReaders = 64;
+
+        mutable std::mutex mutex;
+        std::set<Prefix> prefixes;
+
+        std::atomic<const Tables *> current;
+        std::atomic<uint64_t> epoch;
+        std::atomic<int> readerCount;
+        std::atomic<uint64_t> readers[maxReaders];
+};
+
+#endif
+
+// Local Variables: ***
+// mode: C++ ***
+// tab-width: 4 ***
+// c-basic-offset: 4 ***
+// indent-tabs-mode: nil ***
+// End: ***
+// ex: shiftwidth=4 tabstop=4
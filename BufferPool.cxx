@@ -0,0 +1,149 @@
+/* bzflag
+ * Copyright (c) 1993-2023 Tim Riker
+ *
+ * This package is free software;  you can redistribute it and/or
+ * modify it under the terms of the license found in the file
+ * named COPYING that should have accompanied this file.
+ *
+ * THIS PACKAGE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* interface header */
+#include "BufferPool.h"
+
+#include <sys/mman.h>
+
+#include "network.h"
+
+// Memory is mapped this much at a time, the size of an x86 huge page
+const size_t chunkBytes = 2 * 1024 * 1024;
+
+BufferPool::BufferPool() : bufferSize(4096), hugePages(false), hugeTlb(false), inUse(0), highWater(0), reserved(0)
+{
+}
+
+BufferPool::~BufferPool()
+{
+    for (auto &chunk : chunks)
+        munmap(chunk.base, chunk.bytes);
+}
+
+bool BufferPool::setBufferSize(size_t size)
+{
+    if (!chunks.empty())
+        return size == bufferSize;
+
+    bufferSize = size;
+    return true;
+}
+
+void BufferPool::setHugePages(bool enable)
+{
+    if (chunks.empty())
+        hugePages = hugeTlb = enable;
+}
+
+size_t BufferPool::getBufferSize() const
+{
+    return bufferSize;
+}
+
+char *BufferPool::acquire()
+{
+    if (freeBuffers.empty() && !grow())
+        return nullptr;
+
+    // Last released is handed out first, it is the most likely to still be cached
+    char *buffer = freeBuffers.back();
+    freeBuffers.pop_back();
+
+    const uint64_t used = inUse.load(std::memory_order_relaxed) + 1;
+    inUse.store(used, std::memory_order_relaxed);
+    if (used > highWater.load(std::memory_order_relaxed))
+        highWater.store(used, std::memory_order_relaxed);
+
+    return buffer;
+}
+
+void BufferPool::release(char *buffer)
+{
+    freeBuffers.push_back(buffer);
+    inUse.store(inUse.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+}
+
+uint64_t BufferPool::getInUse() const
+{
+    return inUse.load(std::memory_order_relaxed);
+}
+
+uint64_t BufferPool::getHighWater() const
+{
+    return highWater.load(std::memory_order_relaxed);
+}
+
+uint64_t BufferPool::getReserved() const
+{
+    return reserved.load(std::memory_order_relaxed);
+}
+
+bool BufferPool::grow()
+{
+    // Whole huge pages, holding at least one buffer
+    const size_t bytes = (bufferSize + chunkBytes - 1) / chunkBytes * chunkBytes;
+
+    void *base = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (hugeTlb)
+    {
+        base = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+        // None reserved, don't keep asking
+        if (base == MAP_FAILED)
+        {
+            nerror("couldn't map huge pages for receive buffers, using normal pages");
+            hugeTlb = false;
+        }
+    }
+#endif
+
+    if (base == MAP_FAILED)
+    {
+        base = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED)
+        {
+            nerror("couldn't map receive buffers");
+            return false;
+        }
+
+#ifdef MADV_HUGEPAGE
+        // Transparent huge pages are the next best thing
+        if (hugePages)
+            madvise(base, bytes, MADV_HUGEPAGE);
+#endif
+    }
+
+    Chunk chunk;
+    chunk.base = (char *)base;
+    chunk.bytes = bytes;
+    chunks.push_back(chunk);
+
+    const size_t count = bytes / bufferSize;
+    freeBuffers.reserve(freeBuffers.size() + count);
+    for (size_t i = count; i > 0; --i)
+        freeBuffers.push_back(chunk.base + (i - 1) * bufferSize);
+
+    reserved.store(reserved.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+    return true;
+}
+
+
+/* Local Variables: ***
+ * mode: C++ ***
+ * tab-width: 8 ***
+ * c-basic-offset: 2 ***
+ * indent-tabs-mode: t ***
+ * End: ***
+ * ex: shiftwidth=2 tabstop=8
+ */
@@ -0,0 +1,77 @@
+/* bzflag
+ * Copyright (c) 1993-2023 Tim Riker
+ *
+ * This package is free software;  you can redistribute it and/or
+ * modify it under the terms of the license found in the file
+ * named COPYING that should have accompanied this file.
+ *
+ * THIS PACKAGE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __BUFFERPOOL_H__
+#define __BUFFERPOOL_H__
+
+/* common header */
+#include "common.h"
+
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+
+// Fixed size buffers carved out of large mmap()ed chunks and handed out
+// from a free list.  Chunks are never given back, so memory use follows the
+// high-water mark of buffers in use at once.  Only the owning thread may
+// acquire and release; the counters can be read from anywhere.
+class BufferPool {
+    public:
+        BufferPool();
+        ~BufferPool();
+
+        // Both only take effect while nothing has been allocated yet, the size returns false if
+        // it can't
+        bool setBufferSize(size_t size);
+        void setHugePages(bool enable);
+
+        size_t getBufferSize() const;
+
+        // Null if no memory could be mapped
+        char *acquire();
+        void release(char *buffer);
+
+        uint64_t getInUse() const;
+        uint64_t getHighWater() const;
+        uint64_t getReserved() const;
+    private:
+        bool grow();
+
+        size_t bufferSize;
+        bool hugePages;
+
+        // Cleared once MAP_HUGETLB fails, transparent huge pages are asked for instead
+        bool hugeTlb;
+
+        struct Chunk
+        {
+            char *base;
+            size_t bytes;
+        };
+        std::vector<Chunk> chunks;
+        std::vector<char *> freeBuffers;
+
+        // Written by the owning thread only
+        std::atomic<uint64_t> inUse;
+        std::atomic<uint64_t> highWater;
+        std::atomic<uint64_t> reserved;
+};
+
+#endif
+
+// Local Variables: ***
+// mode: C++ ***
+// tab-width: 4 ***
+// c-basic-offset: 4 ***
+// indent-tabs-mode: nil ***
+// End: ***
+// ex: shiftwidth=4 tabstop=4
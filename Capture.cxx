@@ -0,0 +1,330 @@
+/* bzflag
+ * Copyright (c) 1993-2023 Tim Riker
+ *
+ * This package is free software;  you can redistribute it and/or
+ * modify it under the terms of the license found in the file
+ * named COPYING that should have accompanied this file.
+ *
+ * THIS PACKAGE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* interface header */
+#include "Capture.h"
+
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include "Logger.h"
+
+static const char captureMagic[8] = { 'N', 'E', 'T', 'C', 'A', 'P', 0, 0 };
+static const uint32_t captureVersion = 1;
+
+const size_t CaptureWriter::windowSize;
+
+static size_t padded(size_t length)
+{
+    return (length + 7) & ~(size_t)7;
+}
+
+static size_t addressLengthOf(const struct sockaddr_storage &address)
+{
+    return address.ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+
+CaptureWriter::CaptureWriter() : fd(-1), window(nullptr), windowOffset(0), used(0), bytes(0)
+{
+}
+
+CaptureWriter::~CaptureWriter()
+{
+    close();
+}
+
+bool CaptureWriter::open(const char *path)
+{
+    close();
+
+    fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        logErrno(LogError, "couldn't open capture file {1}", path);
+        return false;
+    }
+
+    if (!mapWindow(0))
+    {
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    CaptureHeader *header = (CaptureHeader *)window;
+    memcpy(header->magic, captureMagic, sizeof header->magic);
+    header->version = captureVersion;
+    header->windowSize = windowSize;
+    header->startTime = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+    used = sizeof(CaptureHeader);
+    bytes = 0;
+    return true;
+}
+
+void CaptureWriter::close()
+{
+    if (fd == -1)
+        return;
+
+    // Trim the unused end of the last window
+    munmap(window, windowSize);
+    if (ftruncate(fd, windowOffset + used) == -1)
+        logErrno(LogError, "couldn't trim capture file");
+    ::close(fd);
+
+    fd = -1;
+    window = nullptr;
+    windowOffset = 0;
+    used = 0;
+}
+
+bool CaptureWriter::isOpen() const
+{
+    return fd != -1;
+}
+
+uint64_t CaptureWriter::getBytes() const
+{
+    return bytes;
+}
+
+bool CaptureWriter::mapWindow(uint64_t offset)
+{
+    // The file grows a window at a time, whatever isn't written reads back as zeros
+    if (ftruncate(fd, offset + windowSize) == -1)
+    {
+        logErrno(LogError, "couldn't grow capture file");
+        return false;
+    }
+
+    void *memory = mmap(nullptr, windowSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+    if (memory == MAP_FAILED)
+    {
+        logErrno(LogError, "couldn't map capture file");
+        return false;
+    }
+
+    window = (char *)memory;
+    windowOffset = offset;
+    used = 0;
+    return true;
+}
+
+CaptureRecord *CaptureWriter::reserve(CaptureType type, uint64_t time, uint64_t connection, size_t addressLength,
+                                      size_t payload)
+{
+    if (fd == -1)
+        return nullptr;
+
+    const size_t unpadded = sizeof(CaptureRecord) + addressLength + payload;
+    const size_t length = padded(unpadded);
+    if (length > windowSize - sizeof(CaptureHeader))
+        return nullptr;
+
+    if (used + length > windowSize)
+    {
+        munmap(window, windowSize);
+        window = nullptr;
+
+        if (!mapWindow(windowOffset + windowSize))
+        {
+            logMessage(LogError, "capture stopped after {1} bytes", bytes);
+            ::close(fd);
+            fd = -1;
+            return nullptr;
+        }
+    }
+
+    CaptureRecord *record = (CaptureRecord *)&window[used];
+    record->length = (uint32_t)length;
+    record->type = (uint8_t)type;
+    record->addressLength = (uint8_t)addressLength;
+    record->padding = (uint16_t)(length - unpadded);
+    record->time = time;
+    record->connection = connection;
+
+    used += length;
+    bytes += length;
+    return record;
+}
+
+void CaptureWriter::recordAccept(uint64_t time, uint64_t connection, const struct sockaddr_storage &address)
+{
+    const size_t addressLength = addressLengthOf(address);
+    CaptureRecord *record = reserve(CaptureAccept, time, connection, addressLength, 0);
+    if (record != nullptr)
+        memcpy(record + 1, &address, addressLength);
+}
+
+void CaptureWriter::recordTcpData(uint64_t time, uint64_t connection, const char *data, size_t length)
+{
+    CaptureRecord *record = reserve(CaptureTcpData, time, connection, 0, length);
+    if (record != nullptr)
+        memcpy(record + 1, data, length);
+}
+
+void CaptureWriter::recordTcpData(uint64_t time, uint64_t connection, const struct iovec *iov, int iovcnt,
+                                  size_t length)
+{
+    CaptureRecord *record = reserve(CaptureTcpData, time, connection, 0, length);
+    if (record == nullptr)
+        return;
+
+    // Only the first length bytes of the spans were filled in
+    char *out = (char *)(record + 1);
+    for (int i = 0; i < iovcnt && length > 0; ++i)
+    {
+        const size_t n = iov[i].iov_len < length ? iov[i].iov_len : length;
+        memcpy(out, iov[i].iov_base, n);
+        out += n;
+        length -= n;
+    }
+}
+
+void CaptureWriter::recordDatagram(uint64_t time, const struct sockaddr_storage &from, const char *data, size_t length)
+{
+    const size_t addressLength = addressLengthOf(from);
+    CaptureRecord *record = reserve(CaptureDatagram, time, 0, addressLength, length);
+    if (record == nullptr)
+        return;
+
+    memcpy(record + 1, &from, addressLength);
+    memcpy((char *)(record + 1) + addressLength, data, length);
+}
+
+void CaptureWriter::recordDisconnect(uint64_t time, uint64_t connection)
+{
+    reserve(CaptureDisconnect, time, connection, 0, 0);
+}
+
+CaptureReader::CaptureReader() : fd(-1), map(nullptr), size(0), windowSize(0), offset(0)
+{
+}
+
+CaptureReader::~CaptureReader()
+{
+    close();
+}
+
+bool CaptureReader::open(const char *path)
+{
+    close();
+
+    fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        logErrno(LogError, "couldn't open capture file {1}", path);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(CaptureHeader))
+    {
+        logMessage(LogError, "{1} is not a capture file", path);
+        close();
+        return false;
+    }
+
+    void *memory = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (memory == MAP_FAILED)
+    {
+        logErrno(LogError, "couldn't map capture file {1}", path);
+        close();
+        return false;
+    }
+    map = (const char *)memory;
+    size = st.st_size;
+
+    const CaptureHeader *header = (const CaptureHeader *)map;
+    if (memcmp(header->magic, captureMagic, sizeof header->magic) != 0 || header->version != captureVersion ||
+            header->windowSize < sizeof(CaptureHeader) || header->windowSize % 8 != 0)
+    {
+        logMessage(LogError, "{1} is not a capture file", path);
+        close();
+        return false;
+    }
+
+    windowSize = header->windowSize;
+    offset = sizeof(CaptureHeader);
+    return true;
+}
+
+void CaptureReader::close()
+{
+    if (map != nullptr)
+        munmap((void *)map, size);
+    if (fd != -1)
+        ::close(fd);
+
+    fd = -1;
+    map = nullptr;
+    size = 0;
+    offset = 0;
+}
+
+bool CaptureReader::next(Record &record)
+{
+    while (map != nullptr && offset < size)
+    {
+        const size_t windowEnd = (offset / windowSize + 1) * windowSize;
+        const size_t end = windowEnd < size ? windowEnd : size;
+
+        const CaptureRecord *header = (const CaptureRecord *)&map[offset];
+        if (offset + sizeof(CaptureRecord) > end || header->length == 0)
+        {
+            // Nothing more in this window
+            offset = windowEnd;
+            continue;
+        }
+
+        if (header->length < sizeof(CaptureRecord) + header->addressLength + header->padding || offset + header->length > end ||
+                header->addressLength > sizeof record.address)
+        {
+            logMessage(LogError, "capture file is damaged at offset {1}", offset);
+            return false;
+        }
+
+        record.type = (CaptureType)header->type;
+        record.time = header->time;
+        record.connection = header->connection;
+
+        memset(&record.address, 0, sizeof record.address);
+        memcpy(&record.address, header + 1, header->addressLength);
+        record.addressLength = header->addressLength;
+
+        record.data = (const char *)(header + 1) + header->addressLength;
+        record.length = header->length - sizeof(CaptureRecord) - header->addressLength - header->padding;
+
+        offset += header->length;
+        return true;
+    }
+
+    return false;
+}
+
+
+/* Local Variables: ***
+ * mode: C++ ***
+ * tab-width: 8 ***
+ * c-basic-offset: 2 ***
+ * indent-tabs-mode: t ***
+ * End: ***
+ * ex: shiftwidth=2 tabstop=8
+ */
@@ -0,0 +1,123 @@
+/* bzflag
+ * Copyright (c) 1993-2023 Tim Riker
+ *
+ * This package is free software;  you can redistribute it and/or
+ * modify it under the terms of the license found in the file
+ * named COPYING that should have accompanied this file.
+ *
+ * THIS PACKAGE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+/* common header */
+#include "common.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// Capture file layout: a CaptureHeader, then records, each a CaptureRecord
+// followed by the peer address (accepts and datagrams) and the payload,
+// padded to 8 bytes.  The file is written through windows of windowSize
+// bytes and a record never crosses into the next window; a zero length
+// where a record would start means the rest of the window is unused.
+enum CaptureType {
+    CaptureAccept = 1,
+    CaptureTcpData,
+    CaptureDatagram,
+    CaptureDisconnect
+};
+
+struct CaptureHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t windowSize;
+    uint64_t startTime;         // wall clock in microseconds, for reference only
+};
+
+struct CaptureRecord {
+    uint32_t length;            // the whole record, padding included
+    uint8_t type;
+    uint8_t addressLength;
+    uint16_t padding;           // bytes at the end that aren't payload
+    uint64_t time;              // NetManager::now() of the pass that read it
+    uint64_t connection;
+};
+
+// Appends records to a capture file.  Only the thread running the owning
+// NetManager may use it.  If the file can't grow any more the capture stops
+// and the server carries on.
+class CaptureWriter {
+    public:
+        CaptureWriter();
+        ~CaptureWriter();
+
+        bool open(const char *path);
+        void close();
+        bool isOpen() const;
+
+        void recordAccept(uint64_t time, uint64_t connection, const struct sockaddr_storage &address);
+        void recordTcpData(uint64_t time, uint64_t connection, const char *data, size_t length);
+        void recordTcpData(uint64_t time, uint64_t connection, const struct iovec *iov, int iovcnt, size_t length);
+        void recordDatagram(uint64_t time, const struct sockaddr_storage &from, const char *data, size_t length);
+        void recordDisconnect(uint64_t time, uint64_t connection);
+
+        // Bytes of records written so far
+        uint64_t getBytes() const;
+    private:
+        CaptureRecord *reserve(CaptureType type, uint64_t time, uint64_t connection, size_t addressLength, size_t payload);
+        bool mapWindow(uint64_t offset);
+
+        static const size_t windowSize = 64 * 1024 * 1024;
+
+        int fd;
+        char *window;
+        uint64_t windowOffset;
+        size_t used;
+        uint64_t bytes;
+};
+
+// Reads a capture file back one record at a time
+class CaptureReader {
+    public:
+        CaptureReader();
+        ~CaptureReader();
+
+        bool open(const char *path);
+        void close();
+
+        struct Record
+        {
+            CaptureType type;
+            uint64_t time;
+            uint64_t connection;
+            struct sockaddr_storage address;
+            socklen_t addressLength;
+            const char *data;
+            size_t length;
+        };
+
+        // False at the end of the file, the data stays valid until close()
+        bool next(Record &record);
+    private:
+        int fd;
+        const char *map;
+        size_t size;
+        size_t windowSize;
+        size_t offset;
+};
+
+#endif
+
+// Local Variables: ***
+// mode: C++ ***
+// tab-width: 4 ***
+// c-basic-offset: 4 ***
+// indent-tabs-mode: nil ***
+// End: ***
+// ex: shiftwidth=4 tabstop=4
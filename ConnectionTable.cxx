@@ -0,0 +1,140 @@
+/* bzflag
+ * Copyright (c) 1993-2023 Tim Riker
+ *
+ * This package is free software;  you can redistribute it and/or
+ * modify it under the terms of the license found in the file
+ * named COPYING that should have accompanied this file.
+ *
+ * THIS PACKAGE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* interface header */
+#include "ConnectionTable.h"
+
+Connection::Connection() : id(0), fd(-1), sendOffset(0), queuedBytes(0), closing(false), recvArmed(false),
+    writeArmed(false), connected(0), lastReceived(0), handshaken(false), probed(false), strand(nullptr), liveIndex(0)
+{
+}
+
+const uint32_t ConnectionTable::chunkBits;
+const uint32_t ConnectionTable::chunkSize;
+
+ConnectionTable::ConnectionTable()
+{
+}
+
+ConnectionTable::~ConnectionTable()
+{
+    for (auto chunk : chunks)
+        delete[] chunk;
+}
+
+Connection *ConnectionTable::insert(int fd)
+{
+    if (freeSlots.empty())
+        grow();
+
+    const uint32_t index = freeSlots.back();
+    freeSlots.pop_back();
+
+    Connection *conn = slot(index);
+    conn->fd = fd;
+    conn->liveIndex = (uint32_t)liveSlots.size();
+    liveSlots.push_back(index);
+
+    return conn;
+}
+
+void ConnectionTable::remove(Connection *conn)
+{
+    const uint32_t index = slotOf(conn->id);
+
+    // Swap the last live slot into the hole
+    const uint32_t last = liveSlots.back();
+    liveSlots[conn->liveIndex] = last;
+    slot(last)->liveIndex = conn->liveIndex;
+    liveSlots.pop_back();
+
+    // Skip generation 0 on wrap around so an id is never 0
+    uint32_t generation = (uint32_t)(conn->id >> 32) + 1;
+    if (generation == 0)
+        generation = 1;
+    conn->id = ((uint64_t)generation << 32) | index;
+
+    conn->fd = -1;
+    conn->sendQueue.clear();
+    conn->sendOffset = 0;
+    conn->queuedBytes = 0;
+    conn->closing = false;
+    conn->recvArmed = false;
+    conn->writeArmed = false;
+    conn->handshaken = false;
+    conn->probed = false;
+    conn->datagramSource = PeerAddress();
+    conn->strand = nullptr;
+
+    freeSlots.push_back(index);
+}
+
+Connection *ConnectionTable::find(uint64_t id)
+{
+    const uint32_t index = slotOf(id);
+    if (index >= chunks.size() * chunkSize)
+        return nullptr;
+
+    Connection *conn = slot(index);
+    if (conn->id != id || conn->fd == -1)
+        return nullptr;
+
+    return conn;
+}
+
+Connection *ConnectionTable::slot(uint32_t index)
+{
+    return &chunks[index >> chunkBits][index & (chunkSize - 1)];
+}
+
+uint32_t ConnectionTable::slotOf(uint64_t id)
+{
+    return (uint32_t)id;
+}
+
+size_t ConnectionTable::size() const
+{
+    return liveSlots.size();
+}
+
+Connection *ConnectionTable::live(size_t index)
+{
+    return slot(liveSlots[index]);
+}
+
+void ConnectionTable::grow()
+{
+    const uint32_t first = (uint32_t)chunks.size() * chunkSize;
+
+    Connection *chunk = new Connection[chunkSize];
+    for (uint32_t i = 0; i < chunkSize; ++i)
+        chunk[i].id = (1ULL << 32) | (first + i);
+    chunks.push_back(chunk);
+
+    // Hand out the lowest slots first
+    freeSlots.reserve(freeSlots.size() + chunkSize);
+    for (uint32_t i = chunkSize; i > 0; --i)
+        freeSlots.push_back(first + i - 1);
+
+    // Removal only ever shrinks this, so make room for the whole slab up front
+    liveSlots.reserve(chunks.size() * chunkSize);
+}
+
+
+/* Local Variables: ***
+ * mode: C++ ***
+ * tab-width: 8 ***
+ * c-basic-offset: 2 ***
+ * indent-tabs-mode: t ***
+ * End: ***
+ * ex: shiftwidth=2 tabstop=8
+ */
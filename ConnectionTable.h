@@ -0,0 +1,119 @@
+/* bzflag
+ * Copyright (c) 1993-2023 Tim Riker
+ *
+ * This package is free software;  you can redistribute it and/or
+ * modify it under the terms of the license found in the file
+ * named COPYING that should have accompanied this file.
+ *
+ * THIS PACKAGE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __CONNECTIONTABLE_H__
+#define __CONNECTIONTABLE_H__
+
+/* common header */
+#include "common.h"
+
+#include <stdint.h>
+#include <deque>
+#include <vector>
+
+#include "PeerAddress.h"
+#include "RecvRing.h"
+#include "TimingWheel.h"
+#include "WorkerPool.h"
+
+// State of one client connection.  Records live in a ConnectionTable and are
+// reused, so hold on to the id rather than a pointer or the descriptor.
+struct Connection
+{
+    Connection();
+
+    // Generation in the high 32 bits, slot in the low 32, never 0
+    uint64_t id;
+    int fd;
+
+    // Peer address, for the packet rate limit
+    PeerAddress peer;
+
+    // UDP source linked to it, if valid
+    PeerAddress datagramSource;
+
+    RecvRing ring;
+
+    // Data waiting for the socket to drain, the front buffer is sent up to sendOffset
+    std::deque<std::vector<char>> sendQueue;
+    size_t sendOffset;
+    size_t queuedBytes;
+
+    // Dropped, and waiting for the end of the pass (and io_uring) to be closed
+    bool closing;
+
+    // A multishot recv is in flight (io_uring), and we are waiting to be able to write
+    bool recvArmed;
+    bool writeArmed;
+
+    // When it was accepted and last sent anything, for the timeouts, which are armed on timeout
+    uint64_t connected;
+    uint64_t lastReceived;
+    TimingWheel::Entry timeout;
+
+    // Has sent a whole message, and has been sent a keepalive since it was last heard from
+    bool handshaken;
+    bool probed;
+
+    // Where work for this connection is queued on the worker pool, made on the first submit
+    WorkerPool::Strand *strand;
+
+    // Position in the table's list of live connections
+    uint32_t liveIndex;
+};
+
+// Slab of connection records allocated a chunk at a time, so records never
+// move and freed slots are reused without touching the allocator.  Each slot
+// has a generation that is bumped when it is freed, so an id handed out for
+// an earlier connection in the same slot doesn't match the new one.
+class ConnectionTable {
+    public:
+        ConnectionTable();
+        ~ConnectionTable();
+
+        // Take a free slot for fd, growing the slab by a chunk if there is none
+        Connection *insert(int fd);
+
+        // Free the slot, its receive buffer has to be handed back first
+        void remove(Connection *conn);
+
+        // Null if the connection is gone
+        Connection *find(uint64_t id);
+
+        // The record in a slot, live or not
+        Connection *slot(uint32_t index);
+        static uint32_t slotOf(uint64_t id);
+
+        // Live connections, in no particular order
+        size_t size() const;
+        Connection *live(size_t index);
+    private:
+        // Records allocated together, a power of two so a slot splits into chunk and offset
+        static const uint32_t chunkBits = 8;
+        static const uint32_t chunkSize = 1 << chunkBits;
+
+        void grow();
+
+        std::vector<Connection *> chunks;
+        std::vector<uint32_t> freeSlots;
+        std::vector<uint32_t> liveSlots;
+};
+
+#endif
+
+// Local Variables: ***
+// mode: C++ ***
+// tab-width: 4 ***
+// c-basic-offset: 4 ***
+// indent-tabs-mode: nil ***
+// End: ***
+// ex: shiftwidth=4 tabstop=4
@@ -0,0 +1,339 @@
+/* bzflag
+ * Copyright (c) 1993-2023 Tim Riker
+ *
+ * This package is free software;  you can redistribute it and/or
+ * modify it under the terms of the license found in the file
+ * named COPYING that should have accompanied this file.
+ *
+ * THIS PACKAGE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* interface header */
+#include "IoThread.h"
+
+#include <string.h>
+#include <netinet/in.h>
+
+const size_t IoThread::defaultQueueBytes;
+const int IoThread::waitBucketCount;
+const uint64_t IoThread::waitBucketLimits[waitBucketCount] =
+{
+    100, 1000, 5000, 10000, 33000, 100000, 1000000, UINT64_MAX
+};
+
+// Header of an inbound record, followed by the address if there is one and then the payload
+struct InboundRecord
+{
+    uint8_t type;
+    uint8_t hasAddress;
+    uint16_t code;
+    uint32_t length;
+    uint64_t connection;
+    uint64_t received;
+};
+
+enum OutboundType
+{
+    SendMessageRecord,
+    SendDatagramRecord,
+    DisconnectRecord
+};
+
+// Header of an outbound record, laid out the same way
+struct OutboundRecord
+{
+    uint8_t type;
+    uint8_t unused;
+    uint16_t code;
+    uint32_t length;
+    uint64_t connection;
+};
+
+IoThread::IoThread(NetManager &netManager, size_t queueBytes) : netManager(netManager), overflowPolicy(DropEvents),
+    inbound(queueBytes), outbound(queueBytes), unflushed(false), running(false)
+{
+}
+
+IoThread::~IoThread()
+{
+    stop();
+}
+
+void IoThread::setOverflowPolicy(OverflowPolicy policy)
+{
+    overflowPolicy = policy;
+}
+
+bool IoThread::start()
+{
+    if (running.load())
+        return false;
+
+    netManager.addAcceptCallback([this](struct sockaddr *address, NetManager::ConnectionId connection)
+    {
+        struct sockaddr_storage peer;
+        memset(&peer, 0, sizeof peer);
+        memcpy(&peer, address, address->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+        push(AcceptEvent, connection, 0, &peer, nullptr, 0, NetManager::now());
+    });
+
+    netManager.setMessageReceivedCallback([this](const NetManager::Message &message)
+    {
+        push(MessageEvent, message.connection, message.code, nullptr, message.data, message.length, message.received);
+    });
+
+    netManager.setDatagramReceivedCallback([this](const char *data, size_t length, const struct sockaddr_storage &from)
+    {
+        push(DatagramEvent, 0, 0, &from, data, length, NetManager::now());
+    });
+
+    netManager.setDisconnectCallback([this](NetManager::ConnectionId connection)
+    {
+        push(DisconnectEvent, connection, 0, nullptr, nullptr, 0, NetManager::now());
+    });
+
+    running.store(true);
+    thread = std::thread(&IoThread::run, this);
+    return true;
+}
+
+void IoThread::stop()
+{
+    if (!thread.joinable())
+        return;
+
+    running.store(false);
+    netManager.wakeup();
+    thread.join();
+}
+
+void IoThread::run()
+{
+    while (running.load(std::memory_order_relaxed))
+    {
+        netManager.process(-1);
+        sendQueued();
+    }
+}
+
+bool IoThread::push(EventType type, NetManager::ConnectionId connection, uint16_t code,
+                    const struct sockaddr_storage *address, const char *data, size_t length, uint64_t received)
+{
+    const size_t addressLength = address != nullptr ? sizeof *address : 0;
+    const size_t recordLength = sizeof(InboundRecord) + addressLength + length;
+
+    void *slot = inbound.reserve(recordLength);
+    while (slot == nullptr)
+    {
+        const bool droppable = type == MessageEvent || type == DatagramEvent;
+        if ((droppable && overflowPolicy != WaitForRoom) || !running.load(std::memory_order_relaxed))
+        {
+            dropped.add();
+            if (type == MessageEvent && overflowPolicy == DisconnectClient)
+                netManager.disconnect(connection);
+            return false;
+        }
+
+        // The game thread drains every tick, so this is a short wait
+        std::this_thread::yield();
+        slot = inbound.reserve(recordLength);
+    }
+
+    InboundRecord *record = (InboundRecord *)slot;
+    record->type = (uint8_t)type;
+    record->hasAddress = address != nullptr;
+    record->code = code;
+    record->length = (uint32_t)length;
+    record->connection = connection;
+    record->received = received;
+
+    char *out = (char *)(record + 1);
+    if (address != nullptr)
+        memcpy(out, address, addressLength);
+    if (length > 0)
+        memcpy(out + addressLength, data, length);
+
+    inbound.publish();
+    queued.add();
+
+    const uint64_t depth = queued.get() - delivered.get();
+    if (depth > peakDepth.get())
+        peakDepth.add(depth - peakDepth.get());
+
+    return true;
+}
+
+size_t IoThread::drain(const std::function<void(const Event &)> &handler)
+{
+    // Only what was there to begin with, a busy I/O thread can't keep the game thread in here
+    const uint64_t available = queued.get() - delivered.get();
+    const uint64_t now = NetManager::now();
+
+    size_t count = 0;
+    size_t length;
+    const void *slot;
+    while (count < available && (slot = inbound.front(length)) != nullptr)
+    {
+        const InboundRecord *record = (const InboundRecord *)slot;
+        const char *payload = (const char *)(record + 1);
+
+        Event event;
+        event.type = (EventType)record->type;
+        event.connection = record->connection;
+        event.code = record->code;
+        event.address = record->hasAddress ? (const struct sockaddr_storage *)payload : nullptr;
+        event.data = payload + (record->hasAddress ? sizeof(struct sockaddr_storage) : 0);
+        event.length = record->length;
+        event.received = record->received;
+
+        const uint64_t wait = now > record->received ? now - record->received : 0;
+        waitUsec.add(wait);
+        int bucket = 0;
+        while (wait > waitBucketLimits[bucket])
+            ++bucket;
+        waitBuckets[bucket].add();
+
+        handler(event);
+
+        inbound.pop();
+        delivered.add();
+        ++count;
+    }
+
+    return count;
+}
+
+void *IoThread::reserveSend(size_t length)
+{
+    void *slot = outbound.reserve(length);
+    if (slot == nullptr)
+    {
+        sendsDropped.add();
+        return nullptr;
+    }
+
+    sendsQueued.add();
+    unflushed = true;
+    return slot;
+}
+
+bool IoThread::sendMessage(NetManager::ConnectionId connection, uint16_t code, const char *data, size_t length)
+{
+    OutboundRecord *record = (OutboundRecord *)reserveSend(sizeof(OutboundRecord) + length);
+    if (record == nullptr)
+        return false;
+
+    record->type = SendMessageRecord;
+    record->code = code;
+    record->length = (uint32_t)length;
+    record->connection = connection;
+    if (length > 0)
+        memcpy(record + 1, data, length);
+
+    outbound.publish();
+    return true;
+}
+
+bool IoThread::sendDatagram(const struct sockaddr_storage &destination, const char *data, size_t length)
+{
+    OutboundRecord *record = (OutboundRecord *)reserveSend(sizeof(OutboundRecord) + sizeof destination + length);
+    if (record == nullptr)
+        return false;
+
+    record->type = SendDatagramRecord;
+    record->code = 0;
+    record->length = (uint32_t)length;
+    record->connection = 0;
+    memcpy(record + 1, &destination, sizeof destination);
+    if (length > 0)
+        memcpy((char *)(record + 1) + sizeof destination, data, length);
+
+    outbound.publish();
+    return true;
+}
+
+bool IoThread::disconnect(NetManager::ConnectionId connection)
+{
+    OutboundRecord *record = (OutboundRecord *)reserveSend(sizeof(OutboundRecord));
+    if (record == nullptr)
+        return false;
+
+    record->type = DisconnectRecord;
+    record->code = 0;
+    record->length = 0;
+    record->connection = connection;
+
+    outbound.publish();
+    return true;
+}
+
+void IoThread::flush()
+{
+    if (!unflushed)
+        return;
+
+    unflushed = false;
+    netManager.wakeup();
+}
+
+void IoThread::sendQueued()
+{
+    size_t length;
+    const void *slot;
+    while ((slot = outbound.front(length)) != nullptr)
+    {
+        const OutboundRecord *record = (const OutboundRecord *)slot;
+        const char *payload = (const char *)(record + 1);
+
+        switch (record->type)
+        {
+        case SendMessageRecord:
+            netManager.sendMessage(record->connection, record->code, payload, record->length);
+            break;
+
+        case SendDatagramRecord:
+        {
+            NetManager::Datagram datagram;
+            datagram.destination = (const struct sockaddr_storage *)payload;
+            datagram.data = payload + sizeof(struct sockaddr_storage);
+            datagram.length = record->length;
+            netManager.sendDatagrams(&datagram, 1);
+            break;
+        }
+
+        case DisconnectRecord:
+            netManager.disconnect(record->connection);
+            break;
+        }
+
+        outbound.pop();
+    }
+}
+
+IoThread::Stats IoThread::getStats() const
+{
+    Stats stats;
+    stats.delivered = delivered.get();
+    stats.queued = queued.get();
+    stats.dropped = dropped.get();
+    stats.depth = stats.queued > stats.delivered ? stats.queued - stats.delivered : 0;
+    stats.peakDepth = peakDepth.get();
+    stats.waitUsec = waitUsec.get();
+    for (int i = 0; i < waitBucketCount; ++i)
+        stats.waitBuckets[i] = waitBuckets[i].get();
+    stats.sendsQueued = sendsQueued.get();
+    stats.sendsDropped = sendsDropped.get();
+    return stats;
+}
+
+
+/* Local Variables: ***
+ * mode: C++ ***
+ * tab-width: 8 ***
+ * c-basic-offset: 2 ***
+ * indent-tabs-mode: t ***
+ * End: ***
+ * ex: shiftwidth=2 tabstop=8
+ */
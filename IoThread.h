@@ -0,0 +1,150 @@
+/* bzflag
+ * Copyright (c) 1993-2023 Tim Riker
+ *
+ * This package is free software;  you can redistribute it and/or
+ * modify it under the terms of the license found in the file
+ * named COPYING that should have accompanied this file.
+ *
+ * THIS PACKAGE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __IOTHREAD_H__
+#define __IOTHREAD_H__
+
+/* common header */
+#include "common.h"
+
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <thread>
+
+#include "Metrics.h"
+#include "NetManager.h"
+#include "SpscQueue.h"
+
+// Runs a NetManager on a thread of its own and hands what it receives to a
+// game thread through a bounded lock-free queue, so a slow callback never
+// holds up the sockets and a burst of packets never holds up the tick.  The
+// game thread drains the queue once per tick and queues its sends the other
+// way, waking the I/O thread once with flush().  Once started, the
+// NetManager belongs to the I/O thread and must not be used directly.
+class IoThread {
+    public:
+        // What happens to a message or datagram when the game thread has fallen so far behind that
+        // the queue is full.  Accepts and disconnects are never dropped, they always wait for room.
+        enum OverflowPolicy
+        {
+            DropEvents,         // drop it and count it
+            DisconnectClient,   // drop it and the connection it came from
+            WaitForRoom         // stall the I/O thread until the game thread catches up
+        };
+
+        enum EventType
+        {
+            AcceptEvent,
+            MessageEvent,
+            DatagramEvent,
+            DisconnectEvent
+        };
+
+        // One inbound event, pointing into the queue and only valid during the handler call
+        struct Event
+        {
+            EventType type;
+            NetManager::ConnectionId connection;    // 0 for datagrams
+            uint16_t code;
+            const char *data;
+            size_t length;
+            const struct sockaddr_storage *address; // the peer of accepts and datagrams
+
+            // NetManager::now() when the I/O thread picked it up
+            uint64_t received;
+        };
+
+        static const size_t defaultQueueBytes = 4 * 1024 * 1024;
+
+        IoThread(NetManager &netManager, size_t queueBytes = defaultQueueBytes);
+        ~IoThread();
+
+        // Set before start()
+        void setOverflowPolicy(OverflowPolicy policy);
+
+        bool start();
+        void stop();
+
+        // Game thread: hand every event queued so far to handler, returns how many
+        size_t drain(const std::function<void(const Event &)> &handler);
+
+        // Game thread: queue sends for the I/O thread, false if the outbound queue is full
+        bool sendMessage(NetManager::ConnectionId connection, uint16_t code, const char *data, size_t length);
+        bool sendDatagram(const struct sockaddr_storage &destination, const char *data, size_t length);
+        bool disconnect(NetManager::ConnectionId connection);
+
+        // Game thread: wake the I/O thread if anything was queued since the last flush
+        void flush();
+
+        // How long events sat in the queue, counted in buckets up to each of these many microseconds
+        static const int waitBucketCount = 8;
+        static const uint64_t waitBucketLimits[waitBucketCount];
+
+        // Safe to read from any thread
+        struct Stats
+        {
+            uint64_t queued;
+            uint64_t delivered;
+            uint64_t dropped;
+
+            // Events in the queue now and at most, counted when queued
+            uint64_t depth;
+            uint64_t peakDepth;
+
+            uint64_t waitUsec;
+            uint64_t waitBuckets[waitBucketCount];
+
+            uint64_t sendsQueued;
+            uint64_t sendsDropped;
+        };
+        Stats getStats() const;
+    private:
+        void run();
+        bool push(EventType type, NetManager::ConnectionId connection, uint16_t code,
+                  const struct sockaddr_storage *address, const char *data, size_t length, uint64_t received);
+        void *reserveSend(size_t length);
+        void sendQueued();
+
+        NetManager &netManager;
+        OverflowPolicy overflowPolicy;
+
+        // I/O thread to game thread, and back
+        SpscQueue inbound;
+        SpscQueue outbound;
+        bool unflushed;
+
+        std::thread thread;
+        std::atomic<bool> running;
+
+        // Written by the I/O thread
+        Counter queued;
+        Counter dropped;
+        Counter peakDepth;
+
+        // Written by the game thread
+        Counter delivered;
+        Counter waitUsec;
+        Counter waitBuckets[waitBucketCount];
+        Counter sendsQueued;
+        Counter sendsDropped;
+};
+
+#endif
+
+// Local Variables: ***
+// mode: C++ ***
+// tab-width: 4 ***
+// c-basic-offset: 4 ***
+// indent-tabs-mode: nil ***
+// End: ***
+// ex: shiftwidth=4 tabstop=4
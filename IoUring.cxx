@@ -0,0 +1,300 @@
+/* bzflag
+ * Copyright (c) 1993-2023 Tim Riker
+ *
+ * This package is free software;  you can redistribute it and/or
+ * modify it under the terms of the license found in the file
+ * named COPYING that should have accompanied this file.
+ *
+ * THIS PACKAGE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* interface header */
+#include "IoUring.h"
+
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "network.h"
+
+IoUring::IoUring() : ringFd(-1), features(0), sqRing(nullptr), sqRingBytes(0), sqHead(nullptr), sqTail(nullptr),
+    sqMask(nullptr), sqArray(nullptr), sqes(nullptr), sqesBytes(0), sqLocalTail(0),
+    cqRing(nullptr), cqRingBytes(0), cqHead(nullptr), cqTail(nullptr), cqMask(nullptr), cqes(nullptr)
+{
+}
+
+IoUring::~IoUring()
+{
+    // Closing the ring cancels anything still in flight
+    if (ringFd != -1)
+        close(ringFd);
+
+    for (auto &group : bufferGroups)
+    {
+        if (group.ring != nullptr)
+            munmap(group.ring, group.ringBytes);
+        free(group.buffers);
+    }
+
+    if (sqes != nullptr)
+        munmap(sqes, sqesBytes);
+    if (cqRing != nullptr && cqRing != sqRing)
+        munmap(cqRing, cqRingBytes);
+    if (sqRing != nullptr)
+        munmap(sqRing, sqRingBytes);
+}
+
+bool IoUring::init(unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof params);
+
+    // Multishot requests can post many completions per submission, so give the CQ extra room
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = entries * 8;
+
+    ringFd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ringFd == -1 && errno == EINVAL)
+    {
+        // Older kernels don't know about the newer setup flags
+        memset(&params, 0, sizeof params);
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * 8;
+        ringFd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    }
+    if (ringFd == -1)
+    {
+        nerror("couldn't set up io_uring");
+        return false;
+    }
+
+    features = params.features;
+    if (!(features & IORING_FEAT_EXT_ARG))
+    {
+        errno = ENOSYS;
+        nerror("io_uring is missing wait timeouts");
+        close(ringFd);
+        ringFd = -1;
+        return false;
+    }
+
+    sqRingBytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingBytes = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (cqRingBytes > sqRingBytes)
+            sqRingBytes = cqRingBytes;
+        cqRingBytes = sqRingBytes;
+    }
+
+    sqRing = mmap(nullptr, sqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED)
+    {
+        sqRing = nullptr;
+        nerror("couldn't map io_uring submission ring");
+        return false;
+    }
+
+    if (features & IORING_FEAT_SINGLE_MMAP)
+        cqRing = sqRing;
+    else
+    {
+        cqRing = mmap(nullptr, cqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED)
+        {
+            cqRing = nullptr;
+            nerror("couldn't map io_uring completion ring");
+            return false;
+        }
+    }
+
+    sqesBytes = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = (struct io_uring_sqe *)mmap(nullptr, sqesBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+    {
+        sqes = nullptr;
+        nerror("couldn't map io_uring submission entries");
+        return false;
+    }
+
+    char *sq = (char *)sqRing;
+    sqHead = (unsigned *)(sq + params.sq_off.head);
+    sqTail = (unsigned *)(sq + params.sq_off.tail);
+    sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    sqArray = (unsigned *)(sq + params.sq_off.array);
+    sqLocalTail = *sqTail;
+
+    // Submission slots always map straight to the entry with the same index
+    for (unsigned i = 0; i < params.sq_entries; ++i)
+        sqArray[i] = i;
+
+    char *cq = (char *)cqRing;
+    cqHead = (unsigned *)(cq + params.cq_off.head);
+    cqTail = (unsigned *)(cq + params.cq_off.tail);
+    cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    return true;
+}
+
+int IoUring::enter(unsigned toSubmit, unsigned minComplete, unsigned flags, void *arg, size_t argSize)
+{
+    return (int)syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, arg, argSize);
+}
+
+struct io_uring_sqe *IoUring::getSqe()
+{
+    unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+
+    // Full, so push what we have to the kernel and try again
+    if (sqLocalTail - head > *sqMask)
+    {
+        submit();
+        head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        if (sqLocalTail - head > *sqMask)
+            return nullptr;
+    }
+
+    struct io_uring_sqe *sqe = &sqes[sqLocalTail & *sqMask];
+    memset(sqe, 0, sizeof *sqe);
+    ++sqLocalTail;
+    return sqe;
+}
+
+int IoUring::submit()
+{
+    __atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+
+    unsigned pending = sqLocalTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    if (pending == 0)
+        return 0;
+
+    return enter(pending, 0, 0, nullptr, 0);
+}
+
+int IoUring::submitAndWait(int timeoutMs)
+{
+    __atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+    unsigned pending = sqLocalTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+
+    struct __kernel_timespec ts;
+    ts.tv_sec = timeoutMs / 1000;
+    ts.tv_nsec = (long long)(timeoutMs % 1000) * 1000000;
+
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof arg);
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = timeoutMs < 0 ? 0 : (uint64_t)(uintptr_t)&ts;
+
+    int r = enter(pending, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof arg);
+
+    // Running out the clock isn't an error
+    if (r == -1 && errno == ETIME)
+        return 0;
+    return r;
+}
+
+struct io_uring_cqe *IoUring::peekCqe()
+{
+    unsigned head = *cqHead;
+    if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+        return nullptr;
+
+    return &cqes[head & *cqMask];
+}
+
+void IoUring::seenCqe()
+{
+    __atomic_store_n(cqHead, *cqHead + 1, __ATOMIC_RELEASE);
+}
+
+bool IoUring::addBufferGroup(uint16_t groupId, unsigned count, unsigned size)
+{
+    // The kernel wants a power of two number of entries
+    if (count == 0 || (count & (count - 1)) != 0 || count > 32768)
+    {
+        errno = EINVAL;
+        nerror("io_uring buffer group size must be a power of two");
+        return false;
+    }
+
+    if (groupId >= bufferGroups.size())
+        bufferGroups.resize(groupId + 1);
+
+    BufferGroup &group = bufferGroups[groupId];
+    memset(&group, 0, sizeof group);
+    group.count = count;
+    group.size = size;
+
+    group.ringBytes = count * sizeof(struct io_uring_buf);
+    group.ring = (struct io_uring_buf_ring *)mmap(nullptr, group.ringBytes, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (group.ring == MAP_FAILED)
+    {
+        group.ring = nullptr;
+        nerror("couldn't allocate io_uring buffer ring");
+        return false;
+    }
+
+    group.buffers = (char *)malloc((size_t)count * size);
+    if (group.buffers == nullptr)
+    {
+        nerror("couldn't allocate io_uring buffers");
+        return false;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof reg);
+    reg.ring_addr = (uint64_t)(uintptr_t)group.ring;
+    reg.ring_entries = count;
+    reg.bgid = groupId;
+    if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+    {
+        nerror("couldn't register io_uring buffer ring");
+        return false;
+    }
+
+    for (unsigned i = 0; i < count; ++i)
+        recycleBuffer(groupId, (uint16_t)i);
+
+    return true;
+}
+
+char *IoUring::getBuffer(uint16_t groupId, uint16_t bufferId)
+{
+    BufferGroup &group = bufferGroups[groupId];
+    return group.buffers + (size_t)bufferId * group.size;
+}
+
+unsigned IoUring::getBufferSize(uint16_t groupId) const
+{
+    return bufferGroups[groupId].size;
+}
+
+void IoUring::recycleBuffer(uint16_t groupId, uint16_t bufferId)
+{
+    BufferGroup &group = bufferGroups[groupId];
+
+    // Index the entries by hand: in C++ the header's flexible array member doesn't start at offset 0
+    struct io_uring_buf *buf = (struct io_uring_buf *)group.ring + (group.tail & (group.count - 1));
+    buf->addr = (uint64_t)(uintptr_t)getBuffer(groupId, bufferId);
+    buf->len = group.size;
+    buf->bid = bufferId;
+
+    ++group.tail;
+    __atomic_store_n(&group.ring->tail, group.tail, __ATOMIC_RELEASE);
+}
+
+
+/* Local Variables: ***
+ * mode: C++ ***
+ * tab-width: 8 ***
+ * c-basic-offset: 2 ***
+ * indent-tabs-mode: t ***
+ * End: ***
+ * ex: shiftwidth=2 tabstop=8
+ */
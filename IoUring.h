@@ -0,0 +1,103 @@
+/* bzflag
+ * Copyright (c) 1993-2023 Tim Riker
+ *
+ * This package is free software;  you can redistribute it and/or
+ * modify it under the terms of the license found in the file
+ * named COPYING that should have accompanied this file.
+ *
+ * THIS PACKAGE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/*
+ * Minimal io_uring wrapper talking to the kernel directly, so the
+ * network layer does not need liburing.  Only the pieces NetManager
+ * uses are here: the submission/completion rings, waiting with a
+ * timeout and provided buffer rings.
+ */
+
+#ifndef __IOURING_H__
+#define __IOURING_H__
+
+/* common header */
+#include "common.h"
+
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <vector>
+
+class IoUring {
+    public:
+        IoUring();
+        ~IoUring();
+
+        // Set up a ring with room for the given number of submissions
+        bool init(unsigned entries);
+        bool isReady() const { return ringFd != -1; }
+
+        // Get a cleared submission entry, flushing the queue to the kernel if it is full
+        struct io_uring_sqe *getSqe();
+
+        // Hand queued submissions to the kernel, and optionally wait for a completion
+        int submit();
+        int submitAndWait(int timeoutMs);
+
+        // Walk the completion queue: peek the next entry, then mark it as consumed
+        struct io_uring_cqe *peekCqe();
+        void seenCqe();
+
+        // Register a ring of count buffers of size bytes under the given group id
+        bool addBufferGroup(uint16_t groupId, unsigned count, unsigned size);
+        char *getBuffer(uint16_t groupId, uint16_t bufferId);
+        unsigned getBufferSize(uint16_t groupId) const;
+
+        // Give a buffer the kernel filled back to its group
+        void recycleBuffer(uint16_t groupId, uint16_t bufferId);
+    private:
+        struct BufferGroup
+        {
+            struct io_uring_buf_ring *ring;
+            size_t ringBytes;
+            char *buffers;
+            unsigned count;
+            unsigned size;
+            uint16_t tail;
+        };
+
+        int enter(unsigned toSubmit, unsigned minComplete, unsigned flags, void *arg, size_t argSize);
+
+        int ringFd;
+        unsigned features;
+
+        // Submission queue
+        void *sqRing;
+        size_t sqRingBytes;
+        unsigned *sqHead;
+        unsigned *sqTail;
+        unsigned *sqMask;
+        unsigned *sqArray;
+        struct io_uring_sqe *sqes;
+        size_t sqesBytes;
+        unsigned sqLocalTail;
+
+        // Completion queue
+        void *cqRing;
+        size_t cqRingBytes;
+        unsigned *cqHead;
+        unsigned *cqTail;
+        unsigned *cqMask;
+        struct io_uring_cqe *cqes;
+
+        std::vector<BufferGroup> bufferGroups;
+};
+
+#endif
+
+// Local Variables: ***
+// mode: C++ ***
+// tab-width: 4 ***
+// c-basic-offset: 4 ***
+// indent-tabs-mode: nil ***
+// End: ***
+// ex: shiftwidth=4 tabstop=4
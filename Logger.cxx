@@ -0,0 +1,533 @@
+/* bzflag
+ * Copyright (c) 1993-2023 Tim Riker
+ *
+ * This package is free software;  you can redistribute it and/or
+ * modify it under the terms of the license found in the file
+ * named COPYING that should have accompanied this file.
+ *
+ * THIS PACKAGE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* interface header */
+#include "Logger.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "Metrics.h"
+#include "PeerAddress.h"
+
+static_assert(sizeof(LogRecord) == 256, "log records should stay four cache lines");
+
+// Rate limiting state for one distinct warning or error
+struct RateEntry {
+    uint64_t key;
+    uint64_t windowStart;
+    uint32_t count;
+    uint32_t suppressed;
+};
+
+// Single producer, single consumer: the thread that logs fills records at
+// tail, the writer thread formats them and moves head
+struct LogRing {
+    static const uint64_t capacity = 1024;
+    static const size_t rateSlots = 64;
+
+    LogRecord records[capacity];
+
+    std::atomic<uint64_t> head;
+    char headPadding[64];
+    std::atomic<uint64_t> tail;
+    char tailPadding[64];
+
+    Counter dropped;
+    Counter suppressed;
+    uint64_t reportedDropped;   // writer thread only
+
+    RateEntry rates[rateSlots];
+
+    // Set when the owning thread exits, so the ring can go to a new thread once drained
+    std::atomic<bool> released;
+
+    LogRing() : head(0), tail(0), reportedDropped(0), released(false)
+    {
+        memset(rates, 0, sizeof rates);
+    }
+};
+
+// Gives the ring back when its thread exits
+struct RingHolder {
+    LogRing *ring;
+
+    RingHolder() : ring(nullptr) {}
+
+    ~RingHolder()
+    {
+        if (ring != nullptr)
+            ring->released.store(true, std::memory_order_release);
+    }
+};
+
+static std::mutex ringsMutex;
+static std::vector<LogRing *> rings;
+static thread_local RingHolder localRing;
+
+static std::atomic<int> minLevel(LogInfo);
+static std::atomic<unsigned> rateLimit(10);
+static std::atomic<bool> running(false);
+static int outputFd = 2;
+
+static std::thread writer;
+static std::mutex wakeMutex;
+static std::condition_variable wakeCondition;
+static bool stopping = false;
+
+static const uint64_t rateWindow = 1000000;
+static const size_t batchBytes = 64 * 1024;
+
+static const char *levelNames[] = { "debug", "info", "warning", "error" };
+
+static LogRing *threadRing()
+{
+    if (localRing.ring != nullptr)
+        return localRing.ring;
+
+    std::lock_guard<std::mutex> lock(ringsMutex);
+
+    // Rings outlive their threads, take over one the writer has emptied
+    for (LogRing *ring : rings)
+    {
+        if (ring->released.load(std::memory_order_acquire) &&
+                ring->head.load(std::memory_order_acquire) == ring->tail.load(std::memory_order_relaxed))
+        {
+            memset(ring->rates, 0, sizeof ring->rates);
+            ring->released.store(false, std::memory_order_relaxed);
+            localRing.ring = ring;
+            return ring;
+        }
+    }
+
+    localRing.ring = new LogRing;
+    rings.push_back(localRing.ring);
+    return localRing.ring;
+}
+
+static uint64_t realTime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Tells repeats apart by call site, error and first argument
+static uint64_t rateKey(const LogRecord &record)
+{
+    uint64_t key = (uint64_t)(uintptr_t)record.format * 0x9e3779b97f4a7c15ULL;
+    key ^= (uint64_t)(uint32_t)record.errnum << 32;
+
+    if (record.argCount > 0)
+    {
+        if (record.types[0] == 's')
+        {
+            for (const char *c = &record.text[record.args[0].u]; *c != '\0'; ++c)
+                key = (key ^ (uint8_t)*c) * 0x100000001b3ULL;
+        }
+        else if (record.types[0] == 'a')
+        {
+            const char *c = &record.text[record.args[0].u];
+            for (size_t i = 0; i < sizeof(PeerAddress); ++i)
+                key = (key ^ (uint8_t)c[i]) * 0x100000001b3ULL;
+        }
+        else
+            key ^= record.args[0].u * 0xff51afd7ed558ccdULL;
+    }
+
+    return key | 1;
+}
+
+static bool allow(LogRing &ring, LogRecord &record)
+{
+    const uint64_t key = rateKey(record);
+
+    for (size_t probe = 0; probe < 8; ++probe)
+    {
+        RateEntry &entry = ring.rates[(key + probe) & (LogRing::rateSlots - 1)];
+        if (entry.key != 0 && entry.key != key)
+            continue;
+
+        if (entry.key == 0 || record.time - entry.windowStart >= rateWindow)
+        {
+            // Whatever was held back in the last window is mentioned by this one
+            record.suppressed = entry.suppressed;
+            entry.key = key;
+            entry.windowStart = record.time;
+            entry.count = 0;
+            entry.suppressed = 0;
+        }
+
+        if (++entry.count <= rateLimit.load(std::memory_order_relaxed))
+            return true;
+
+        ++entry.suppressed;
+        ring.suppressed.add();
+        return false;
+    }
+
+    // Too many distinct messages to keep track of, let it through
+    return true;
+}
+
+static void appendTime(std::string &out, uint64_t time)
+{
+    const time_t seconds = (time_t)(time / 1000000);
+    struct tm local;
+    localtime_r(&seconds, &local);
+
+    char buffer[64];
+    size_t length = strftime(buffer, sizeof buffer, "%Y-%m-%d %H:%M:%S", &local);
+    length += snprintf(buffer + length, sizeof buffer - length, ".%06u ", (unsigned)(time % 1000000));
+    out.append(buffer, length);
+}
+
+static void appendArg(std::string &out, const LogRecord &record, int index)
+{
+    const LogRecord::Arg &arg = record.args[index];
+    char buffer[32];
+    int length = 0;
+
+    switch (record.types[index])
+    {
+    case 'c':
+        out += (char)arg.i;
+        return;
+    case 's':
+        out += &record.text[arg.u];
+        return;
+    case 'a':
+    {
+        PeerAddress peer;
+        memcpy((void *)&peer, &record.text[arg.u], sizeof peer);
+        char text[PeerAddress::formattedSize];
+        out.append(text, peer.format(text, sizeof text));
+        return;
+    }
+    case 'i':
+        length = snprintf(buffer, sizeof buffer, "%lld", (long long)arg.i);
+        break;
+    case 'u':
+        length = snprintf(buffer, sizeof buffer, "%llu", (unsigned long long)arg.u);
+        break;
+    case 'f':
+        length = snprintf(buffer, sizeof buffer, "%g", arg.f);
+        break;
+    }
+
+    out.append(buffer, length);
+}
+
+static void formatRecord(const LogRecord &record, std::string &out)
+{
+    appendTime(out, record.time);
+    out += levelNames[record.level];
+    out += ": ";
+
+    const size_t start = out.size();
+    for (const char *c = record.format; *c != '\0'; ++c)
+    {
+        // {1} is the first argument, anything else is copied as it is
+        if (*c == '{' && c[1] >= '1' && c[1] <= '9' && c[2] == '}' && c[1] - '1' < record.argCount)
+        {
+            appendArg(out, record, c[1] - '1');
+            c += 2;
+        }
+        else
+            out += *c;
+    }
+
+    if (record.errnum != -1)
+    {
+        if (out.size() > start)
+            out += ": ";
+        out += strerror(record.errnum);
+    }
+
+    if (record.suppressed > 0)
+    {
+        char buffer[64];
+        snprintf(buffer, sizeof buffer, " (%u similar messages suppressed)", record.suppressed);
+        out += buffer;
+    }
+
+    out += '\n';
+}
+
+static void writeOut(int fd, std::string &out)
+{
+    size_t written = 0;
+    while (written < out.size())
+    {
+        ssize_t r = write(fd, out.data() + written, out.size() - written);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            break;
+        written += r;
+    }
+    out.clear();
+}
+
+// Format whatever the rings hold, returns the number of records written.  Records
+// from different threads are merged by time, so the output reads in order.
+static size_t drain(std::string &out)
+{
+    size_t drained = 0;
+
+    std::lock_guard<std::mutex> lock(ringsMutex);
+
+    std::vector<uint64_t> heads(rings.size());
+    std::vector<uint64_t> tails(rings.size());
+    for (size_t i = 0; i < rings.size(); ++i)
+    {
+        heads[i] = rings[i]->head.load(std::memory_order_relaxed);
+        tails[i] = rings[i]->tail.load(std::memory_order_acquire);
+    }
+
+    while (true)
+    {
+        const LogRecord *earliest = nullptr;
+        size_t from = 0;
+        for (size_t i = 0; i < rings.size(); ++i)
+        {
+            if (heads[i] == tails[i])
+                continue;
+
+            const LogRecord *record = &rings[i]->records[heads[i] & (LogRing::capacity - 1)];
+            if (earliest == nullptr || record->time < earliest->time)
+            {
+                earliest = record;
+                from = i;
+            }
+        }
+        if (earliest == nullptr)
+            break;
+
+        formatRecord(*earliest, out);
+        ++heads[from];
+        ++drained;
+
+        if (out.size() >= batchBytes)
+        {
+            for (size_t i = 0; i < rings.size(); ++i)
+                rings[i]->head.store(heads[i], std::memory_order_release);
+            writeOut(outputFd, out);
+        }
+    }
+
+    for (size_t i = 0; i < rings.size(); ++i)
+    {
+        LogRing *ring = rings[i];
+        ring->head.store(heads[i], std::memory_order_release);
+
+        const uint64_t dropped = ring->dropped.get();
+        if (dropped != ring->reportedDropped)
+        {
+            char buffer[96];
+            snprintf(buffer, sizeof buffer, "warning: log ring full, dropped %llu records\n",
+                     (unsigned long long)(dropped - ring->reportedDropped));
+            appendTime(out, realTime());
+            out += buffer;
+            ring->reportedDropped = dropped;
+        }
+    }
+
+    if (!out.empty())
+        writeOut(outputFd, out);
+
+    return drained;
+}
+
+static void writeLoop()
+{
+    std::string out;
+    out.reserve(batchBytes * 2);
+
+    while (true)
+    {
+        bool stop;
+        {
+            std::lock_guard<std::mutex> lock(wakeMutex);
+            stop = stopping;
+        }
+
+        // Keep going until a pass after stop() finds nothing left
+        if (drain(out) > 0)
+            continue;
+        if (stop)
+            return;
+
+        std::unique_lock<std::mutex> lock(wakeMutex);
+        wakeCondition.wait_for(lock, std::chrono::milliseconds(10), [] { return stopping; });
+    }
+}
+
+void LogRecord::add(const char *value)
+{
+    if (value == nullptr)
+        value = "(null)";
+    addString(value, strlen(value));
+}
+
+void LogRecord::add(const PeerAddress &value)
+{
+    // Kept as it is, the writer thread formats it
+    if (textUsed + sizeof value > sizeof text)
+    {
+        addString("", 0);
+        return;
+    }
+
+    types[argCount] = 'a';
+    memcpy(&text[textUsed], (const void *)&value, sizeof value);
+    args[argCount++].u = textUsed;
+    textUsed += sizeof value;
+}
+
+void LogRecord::addString(const char *value, size_t length)
+{
+    types[argCount] = 's';
+
+    // Out of room, point at the terminator of the last string copied
+    if (textUsed >= sizeof text)
+    {
+        args[argCount++].u = sizeof text - 1;
+        return;
+    }
+
+    const size_t room = sizeof text - textUsed - 1;
+    if (length > room)
+        length = room;
+
+    memcpy(&text[textUsed], value, length);
+    text[textUsed + length] = '\0';
+    args[argCount++].u = textUsed;
+    textUsed += length + 1;
+}
+
+bool Logger::start(int fd)
+{
+    if (running.load())
+        return true;
+
+    outputFd = fd;
+    stopping = false;
+    writer = std::thread(writeLoop);
+    running.store(true, std::memory_order_release);
+    return true;
+}
+
+void Logger::stop()
+{
+    if (!running.load())
+        return;
+
+    running.store(false, std::memory_order_release);
+    {
+        std::lock_guard<std::mutex> lock(wakeMutex);
+        stopping = true;
+    }
+    wakeCondition.notify_one();
+    writer.join();
+}
+
+void Logger::setLevel(LogLevel level)
+{
+    minLevel.store(level, std::memory_order_relaxed);
+}
+
+bool Logger::enabled(LogLevel level)
+{
+    return level >= minLevel.load(std::memory_order_relaxed);
+}
+
+void Logger::setRateLimit(unsigned perSecond)
+{
+    rateLimit.store(perSecond, std::memory_order_relaxed);
+}
+
+uint64_t Logger::getDropped()
+{
+    std::lock_guard<std::mutex> lock(ringsMutex);
+    uint64_t total = 0;
+    for (LogRing *ring : rings)
+        total += ring->dropped.get();
+    return total;
+}
+
+uint64_t Logger::getSuppressed()
+{
+    std::lock_guard<std::mutex> lock(ringsMutex);
+    uint64_t total = 0;
+    for (LogRing *ring : rings)
+        total += ring->suppressed.get();
+    return total;
+}
+
+LogRecord *Logger::begin(LogLevel level, const char *format, int errnum)
+{
+    LogRing *ring = threadRing();
+
+    const uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    if (tail - ring->head.load(std::memory_order_acquire) >= LogRing::capacity)
+    {
+        ring->dropped.add();
+        return nullptr;
+    }
+
+    LogRecord *record = &ring->records[tail & (LogRing::capacity - 1)];
+    record->time = realTime();
+    record->format = format;
+    record->suppressed = 0;
+    record->errnum = errnum;
+    record->level = (uint8_t)level;
+    record->argCount = 0;
+    record->textUsed = 0;
+    return record;
+}
+
+void Logger::commit(LogRecord *record)
+{
+    LogRing *ring = localRing.ring;
+
+    // A record held back is simply not published, its slot is reused
+    if (record->level >= LogWarning && !allow(*ring, *record))
+        return;
+
+    if (!running.load(std::memory_order_acquire))
+    {
+        std::string out;
+        formatRecord(*record, out);
+        writeOut(outputFd, out);
+        return;
+    }
+
+    ring->tail.store(ring->tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+
+/* Local Variables: ***
+ * mode: C++ ***
+ * tab-width: 8 ***
+ * c-basic-offset: 2 ***
+ * indent-tabs-mode: t ***
+ * End: ***
+ * ex: shiftwidth=2 tabstop=8
+ */
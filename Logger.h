@@ -0,0 +1,154 @@
+/* bzflag
+ * Copyright (c) 1993-2023 Tim Riker
+ *
+ * This package is free software;  you can redistribute it and/or
+ * modify it under the terms of the license found in the file
+ * named COPYING that should have accompanied this file.
+ *
+ * THIS PACKAGE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __LOGGER_H__
+#define __LOGGER_H__
+
+/* common header */
+#include "common.h"
+
+#include <stdint.h>
+#include <errno.h>
+#include <string>
+
+class PeerAddress;
+
+enum LogLevel {
+    LogDebug,
+    LogInfo,
+    LogWarning,
+    LogError
+};
+
+// One log line, unformatted.  The format is kept by pointer, so it has to be
+// a string literal; string arguments are copied into the record, numbers are
+// stored as they are, and so are peer addresses, which are only turned into
+// text if the record gets written.  Placeholders are numbered like
+// printError's, "{1}".
+struct LogRecord {
+    static const int maxArgs = 8;
+
+    union Arg {
+        int64_t i;
+        uint64_t u;
+        double f;
+    };
+
+    uint64_t time;
+    const char *format;
+    uint32_t suppressed;
+    int errnum;                 // appended as ": strerror(errnum)" unless -1
+    uint8_t level;
+    uint8_t argCount;
+    uint16_t textUsed;
+    char types[maxArgs];
+    Arg args[maxArgs];
+    char text[152];
+
+    void add(char value)                      { push('c').i = value; }
+    void add(int value)                       { push('i').i = value; }
+    void add(long value)                      { push('i').i = value; }
+    void add(long long value)                 { push('i').i = value; }
+    void add(unsigned value)                  { push('u').u = value; }
+    void add(unsigned long value)             { push('u').u = value; }
+    void add(unsigned long long value)        { push('u').u = value; }
+    void add(double value)                    { push('f').f = value; }
+    void add(const std::string &value)        { addString(value.data(), value.size()); }
+    void add(const char *value);
+    void add(const PeerAddress &value);
+
+    private:
+        Arg &push(char type)
+        {
+            types[argCount] = type;
+            return args[argCount++];
+        }
+
+        void addString(const char *value, size_t length);
+};
+
+// Log lines are queued as records in a ring per thread and formatted and
+// written in batches by a thread of its own, so logging from an event loop
+// costs a few stores and never a system call.  A full ring drops records and
+// counts them.  Warnings and errors that keep repeating are rate limited per
+// thread: past the limit in a second they are only counted, and the next one
+// let through says how many were left out.
+class Logger {
+    public:
+        // Until start(), or after stop(), lines are written right away
+        static bool start(int fd = 2);
+        static void stop();
+
+        static void setLevel(LogLevel level);
+        static bool enabled(LogLevel level);
+
+        // Warnings and errors let through per second for each distinct message
+        static void setRateLimit(unsigned perSecond);
+
+        static uint64_t getDropped();
+        static uint64_t getSuppressed();
+
+        // Used by logMessage(), a record to fill in or null if the ring is full
+        static LogRecord *begin(LogLevel level, const char *format, int errnum);
+        static void commit(LogRecord *record);
+};
+
+inline void logPack(LogRecord &UNUSED(record))
+{
+}
+
+template<typename T, typename... Rest>
+inline void logPack(LogRecord &record, const T &first, const Rest &... rest)
+{
+    record.add(first);
+    logPack(record, rest...);
+}
+
+template<typename... Args>
+inline void logRecord(LogLevel level, int errnum, const char *format, const Args &... args)
+{
+    static_assert(sizeof...(Args) <= LogRecord::maxArgs, "too many log arguments");
+
+    if (!Logger::enabled(level))
+        return;
+
+    LogRecord *record = Logger::begin(level, format, errnum);
+    if (record == nullptr)
+        return;
+
+    logPack(*record, args...);
+    Logger::commit(record);
+}
+
+// logMessage(LogInfo, "socket {1} has disconnected", fd);
+template<typename... Args>
+inline void logMessage(LogLevel level, const char *format, const Args &... args)
+{
+    logRecord(level, -1, format, args...);
+}
+
+// Like logMessage(), followed by the description of errno, as perror() does
+template<typename... Args>
+inline void logErrno(LogLevel level, const char *format, const Args &... args)
+{
+    logRecord(level, errno, format, args...);
+}
+
+#endif
+
+// Local Variables: ***
+// mode: C++ ***
+// tab-width: 4 ***
+// c-basic-offset: 4 ***
+// indent-tabs-mode: nil ***
+// End: ***
+// ex: shiftwidth=4 tabstop=4
@@ -0,0 +1,362 @@
+/* bzflag
+ * Copyright (c) 1993-2023 Tim Riker
+ *
+ * This package is free software;  you can redistribute it and/or
+ * modify it under the terms of the license found in the file
+ * named COPYING that should have accompanied this file.
+ *
+ * THIS PACKAGE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* interface header */
+#include "Metrics.h"
+
+#include <sstream>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/time.h>
+
+#include "IoThread.h"
+#include "Logger.h"
+#include "NetManager.h"
+#include "WorkerPool.h"
+#include "network.h"
+
+// Everything in NetManager::Stats, in the order it is rendered
+struct StatMetric
+{
+    const char *name;
+    const char *type;
+    const char *help;
+    uint64_t NetManager::Stats::*field;
+
+    // Microsecond counters are exported in seconds
+    double scale;
+};
+
+static const StatMetric statMetrics[] =
+{
+    { "netmanager_wakeups_total", "counter", "Times process() woke up with work to do", &NetManager::Stats::wakeups, 1 },
+    { "netmanager_events_total", "counter", "Events and completions handled", &NetManager::Stats::events, 1 },
+    { "netmanager_busy_seconds_total", "counter", "Time spent handling events", &NetManager::Stats::busyUsec, 1e-6 },
+    { "netmanager_wait_seconds_total", "counter", "Time spent waiting in epoll or io_uring", &NetManager::Stats::waitUsec, 1e-6 },
+    { "netmanager_accepts_total", "counter", "TCP connections accepted", &NetManager::Stats::accepts, 1 },
+    { "netmanager_disconnects_total", "counter", "TCP connections closed", &NetManager::Stats::disconnects, 1 },
+    { "netmanager_connections", "gauge", "TCP connections open", &NetManager::Stats::connections, 1 },
+    { "netmanager_tcp_received_bytes_total", "counter", "Bytes read from TCP connections", &NetManager::Stats::tcpBytesIn, 1 },
+    { "netmanager_tcp_sent_bytes_total", "counter", "Bytes written to TCP connections", &NetManager::Stats::tcpBytesOut, 1 },
+    { "netmanager_tcp_received_messages_total", "counter", "Whole messages read from TCP connections", &NetManager::Stats::tcpMessagesIn, 1 },
+    { "netmanager_tcp_sent_messages_total", "counter", "Messages queued with sendMessage()", &NetManager::Stats::tcpMessagesOut, 1 },
+    { "netmanager_udp_received_bytes_total", "counter", "UDP payload bytes received", &NetManager::Stats::udpBytesIn, 1 },
+    { "netmanager_udp_sent_bytes_total", "counter", "UDP payload bytes sent", &NetManager::Stats::udpBytesOut, 1 },
+    { "netmanager_udp_received_datagrams_total", "counter", "UDP datagrams received", &NetManager::Stats::udpDatagramsIn, 1 },
+    { "netmanager_udp_sent_datagrams_total", "counter", "UDP datagrams sent", &NetManager::Stats::udpDatagramsOut, 1 },
+    { "netmanager_receive_errors_total", "counter", "Failed reads other than running out of data", &NetManager::Stats::recvErrors, 1 },
+    { "netmanager_send_errors_total", "counter", "Failed sends other than a full socket buffer", &NetManager::Stats::sendErrors, 1 },
+    { "netmanager_accepts_limited_total", "counter", "Connections closed for going over the per-source connection rate", &NetManager::Stats::acceptsLimited, 1 },
+    { "netmanager_packets_limited_total", "counter", "Datagrams and messages over the per-source packet rate", &NetManager::Stats::packetsLimited, 1 },
+    { "netmanager_accepts_banned_total", "counter", "Connections closed because the address is banned", &NetManager::Stats::acceptsBanned, 1 },
+    { "netmanager_datagrams_banned_total", "counter", "Datagrams dropped because the address is banned", &NetManager::Stats::datagramsBanned, 1 },
+    { "netmanager_datagrams_unlinked_total", "counter", "Datagrams dropped because no connection is linked to the source", &NetManager::Stats::datagramsUnlinked, 1 },
+    { "netmanager_handshake_timeouts_total", "counter", "Connections closed for not sending a message in time", &NetManager::Stats::handshakeTimeouts, 1 },
+    { "netmanager_idle_timeouts_total", "counter", "Connections closed for going quiet", &NetManager::Stats::idleTimeouts, 1 },
+    { "netmanager_keepalives_total", "counter", "Keepalive callbacks for connections that had gone quiet", &NetManager::Stats::keepalives, 1 },
+    { "netmanager_pool_tasks_pending", "gauge", "Tasks handed to the worker pool and not back yet", &NetManager::Stats::tasksPending, 1 },
+};
+
+MetricsServer::MetricsServer() : listener(-1), stopFd(-1)
+{
+}
+
+MetricsServer::~MetricsServer()
+{
+    stop();
+}
+
+void MetricsServer::addNetManager(const NetManager &netManager)
+{
+    netManagers.push_back(&netManager);
+}
+
+void MetricsServer::addIoThread(const IoThread &ioThread)
+{
+    ioThreads.push_back(&ioThread);
+}
+
+void MetricsServer::addWorkerPool(const WorkerPool &workerPool)
+{
+    workerPools.push_back(&workerPool);
+}
+
+bool MetricsServer::start(const char *address, const char *port)
+{
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+
+    if (getaddrinfo(address, port, &hints, &res) != 0)
+    {
+        nerror("couldn't look up metrics interface information via getaddrinfo");
+        return false;
+    }
+
+    listener = socket(res->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener == -1)
+    {
+        nerror("couldn't make metrics socket");
+        freeaddrinfo(res);
+        return false;
+    }
+
+    const int on = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (SSOType)&on, sizeof on);
+
+    if (::bind(listener, res->ai_addr, res->ai_addrlen) == -1 || listen(listener, 16) == -1)
+    {
+        nerror("couldn't bind metrics socket");
+        close(listener);
+        listener = -1;
+        freeaddrinfo(res);
+        return false;
+    }
+    freeaddrinfo(res);
+
+    stopFd = eventfd(0, EFD_CLOEXEC);
+    if (stopFd == -1)
+    {
+        nerror("couldn't create metrics eventfd");
+        close(listener);
+        listener = -1;
+        return false;
+    }
+
+    thread = std::thread(&MetricsServer::run, this);
+    return true;
+}
+
+void MetricsServer::stop()
+{
+    if (thread.joinable())
+    {
+        const uint64_t one = 1;
+        if (write(stopFd, &one, sizeof one) == -1)
+            logErrno(LogError, "write");
+        thread.join();
+    }
+
+    if (listener != -1)
+        close(listener);
+    if (stopFd != -1)
+        close(stopFd);
+    listener = stopFd = -1;
+}
+
+void MetricsServer::run()
+{
+    while (true)
+    {
+        struct pollfd fds[2];
+        fds[0].fd = listener;
+        fds[0].events = POLLIN;
+        fds[1].fd = stopFd;
+        fds[1].events = POLLIN;
+
+        if (poll(fds, 2, -1) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            logErrno(LogError, "poll");
+            return;
+        }
+
+        if (fds[1].revents != 0)
+            return;
+
+        int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd == -1)
+            continue;
+
+        serve(fd);
+        close(fd);
+    }
+}
+
+void MetricsServer::serve(int fd)
+{
+    // Whatever was asked for, the answer is the same, but let the request arrive first
+    struct timeval timeout;
+    timeout.tv_sec = 1;
+    timeout.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+
+    std::string request;
+    char buffer[1024];
+    while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192)
+    {
+        ssize_t r = recv(fd, buffer, sizeof buffer, 0);
+        if (r <= 0)
+            return;
+        request.append(buffer, r);
+    }
+
+    const std::string body = render();
+
+    std::ostringstream response;
+    response << "HTTP/1.0 200 OK\r\n"
+             << "Content-Type: text/plain; version=0.0.4\r\n"
+             << "Content-Length: " << body.size() << "\r\n"
+             << "Connection: close\r\n\r\n"
+             << body;
+
+    const std::string out = response.str();
+    size_t sent = 0;
+    while (sent < out.size())
+    {
+        ssize_t r = send(fd, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+        if (r <= 0)
+            return;
+        sent += r;
+    }
+}
+
+std::string MetricsServer::render() const
+{
+    // Take every shard's numbers once, then lay them out metric by metric
+    std::vector<NetManager::Stats> stats;
+    std::vector<NetManager::BufferUsage> buffers;
+    for (auto netManager : netManagers)
+    {
+        stats.push_back(netManager->getStats());
+        buffers.push_back(netManager->getBufferUsage());
+    }
+
+    std::ostringstream out;
+    for (const StatMetric &metric : statMetrics)
+    {
+        out << "# HELP " << metric.name << " " << metric.help << "\n";
+        out << "# TYPE " << metric.name << " " << metric.type << "\n";
+        for (size_t i = 0; i < stats.size(); ++i)
+        {
+            out << metric.name << "{shard=\"" << i << "\"} ";
+            if (metric.scale == 1)
+                out << stats[i].*metric.field << "\n";
+            else
+                out << stats[i].*metric.field * metric.scale << "\n";
+        }
+    }
+
+    out << "# HELP netmanager_receive_buffers Receive buffers lent to connections\n";
+    out << "# TYPE netmanager_receive_buffers gauge\n";
+    for (size_t i = 0; i < buffers.size(); ++i)
+        out << "netmanager_receive_buffers{shard=\"" << i << "\"} " << buffers[i].inUse << "\n";
+
+    out << "# HELP netmanager_receive_buffers_peak Most receive buffers lent out at once\n";
+    out << "# TYPE netmanager_receive_buffers_peak gauge\n";
+    for (size_t i = 0; i < buffers.size(); ++i)
+        out << "netmanager_receive_buffers_peak{shard=\"" << i << "\"} " << buffers[i].highWater << "\n";
+
+    out << "# HELP netmanager_receive_buffer_bytes Memory reserved for receive buffers\n";
+    out << "# TYPE netmanager_receive_buffer_bytes gauge\n";
+    for (size_t i = 0; i < buffers.size(); ++i)
+        out << "netmanager_receive_buffer_bytes{shard=\"" << i << "\"} " << buffers[i].reserved * buffers[i].bufferSize << "\n";
+
+    std::vector<IoThread::Stats> queues;
+    for (auto ioThread : ioThreads)
+        queues.push_back(ioThread->getStats());
+
+    if (!queues.empty())
+    {
+        out << "# HELP iothread_events_total Events queued for the game thread\n";
+        out << "# TYPE iothread_events_total counter\n";
+        for (size_t i = 0; i < queues.size(); ++i)
+            out << "iothread_events_total{queue=\"" << i << "\"} " << queues[i].queued << "\n";
+
+        out << "# HELP iothread_events_dropped_total Messages and datagrams dropped because the queue was full\n";
+        out << "# TYPE iothread_events_dropped_total counter\n";
+        for (size_t i = 0; i < queues.size(); ++i)
+            out << "iothread_events_dropped_total{queue=\"" << i << "\"} " << queues[i].dropped << "\n";
+
+        out << "# HELP iothread_queue_depth Events waiting for the game thread\n";
+        out << "# TYPE iothread_queue_depth gauge\n";
+        for (size_t i = 0; i < queues.size(); ++i)
+            out << "iothread_queue_depth{queue=\"" << i << "\"} " << queues[i].depth << "\n";
+
+        out << "# HELP iothread_queue_peak_depth Most events waiting for the game thread at once\n";
+        out << "# TYPE iothread_queue_peak_depth gauge\n";
+        for (size_t i = 0; i < queues.size(); ++i)
+            out << "iothread_queue_peak_depth{queue=\"" << i << "\"} " << queues[i].peakDepth << "\n";
+
+        out << "# HELP iothread_event_wait_seconds Time events spent queued before the game thread took them\n";
+        out << "# TYPE iothread_event_wait_seconds histogram\n";
+        for (size_t i = 0; i < queues.size(); ++i)
+        {
+            uint64_t cumulative = 0;
+            for (int b = 0; b < IoThread::waitBucketCount; ++b)
+            {
+                cumulative += queues[i].waitBuckets[b];
+                out << "iothread_event_wait_seconds_bucket{queue=\"" << i << "\",le=\"";
+                if (IoThread::waitBucketLimits[b] == UINT64_MAX)
+                    out << "+Inf";
+                else
+                    out << IoThread::waitBucketLimits[b] / 1000000.0;
+                out << "\"} " << cumulative << "\n";
+            }
+            out << "iothread_event_wait_seconds_sum{queue=\"" << i << "\"} " << queues[i].waitUsec / 1000000.0 << "\n";
+            out << "iothread_event_wait_seconds_count{queue=\"" << i << "\"} " << cumulative << "\n";
+        }
+
+        out << "# HELP iothread_sends_dropped_total Sends the game thread couldn't queue for the I/O thread\n";
+        out << "# TYPE iothread_sends_dropped_total counter\n";
+        for (size_t i = 0; i < queues.size(); ++i)
+            out << "iothread_sends_dropped_total{queue=\"" << i << "\"} " << queues[i].sendsDropped << "\n";
+    }
+
+    std::vector<WorkerPool::Stats> pools;
+    for (auto workerPool : workerPools)
+        pools.push_back(workerPool->getStats());
+
+    if (!pools.empty())
+    {
+        out << "# HELP workerpool_tasks_total Tasks run by the worker pool\n";
+        out << "# TYPE workerpool_tasks_total counter\n";
+        for (size_t i = 0; i < pools.size(); ++i)
+            out << "workerpool_tasks_total{pool=\"" << i << "\"} " << pools[i].tasks << "\n";
+
+        out << "# HELP workerpool_steals_total Strands a worker took from another's deque\n";
+        out << "# TYPE workerpool_steals_total counter\n";
+        for (size_t i = 0; i < pools.size(); ++i)
+            out << "workerpool_steals_total{pool=\"" << i << "\"} " << pools[i].steals << "\n";
+
+        out << "# HELP workerpool_sleeps_total Times a worker ran out of work and went to sleep\n";
+        out << "# TYPE workerpool_sleeps_total counter\n";
+        for (size_t i = 0; i < pools.size(); ++i)
+            out << "workerpool_sleeps_total{pool=\"" << i << "\"} " << pools[i].sleeps << "\n";
+    }
+
+    out << "# HELP log_records_dropped_total Log records lost to a full ring\n";
+    out << "# TYPE log_records_dropped_total counter\n";
+    out << "log_records_dropped_total " << Logger::getDropped() << "\n";
+
+    out << "# HELP log_records_suppressed_total Repeated warnings and errors held back by rate limiting\n";
+    out << "# TYPE log_records_suppressed_total counter\n";
+    out << "log_records_suppressed_total " << Logger::getSuppressed() << "\n";
+
+    return out.str();
+}
+
+
+/* Local Variables: ***
+ * mode: C++ ***
+ * tab-width: 8 ***
+ * c-basic-offset: 2 ***
+ * indent-tabs-mode: t ***
+ * End: ***
+ * ex: shiftwidth=2 tabstop=8
+ */
@@ -0,0 +1,91 @@
+/* bzflag
+ * Copyright (c) 1993-2023 Tim Riker
+ *
+ * This package is free software;  you can redistribute it and/or
+ * modify it under the terms of the license found in the file
+ * named COPYING that should have accompanied this file.
+ *
+ * THIS PACKAGE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+/* common header */
+#include "common.h"
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+class NetManager;
+class IoThread;
+class WorkerPool;
+
+// A counter or gauge with a single writer.  Since only one thread ever
+// changes it, an update is a relaxed load and store, which compiles to a
+// plain add rather than a locked one, and any thread can read it.
+class Counter {
+    public:
+        Counter() : value(0) {}
+
+        void add(uint64_t n = 1)
+        {
+            value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+
+        void sub(uint64_t n = 1)
+        {
+            value.store(value.load(std::memory_order_relaxed) - n, std::memory_order_relaxed);
+        }
+
+        uint64_t get() const
+        {
+            return value.load(std::memory_order_relaxed);
+        }
+    private:
+        std::atomic<uint64_t> value;
+};
+
+// Serves the statistics of a set of NetManagers in the Prometheus text
+// format over HTTP, from a thread of its own so a scrape never touches the
+// event loops.  Each NetManager is reported with a shard label.
+class MetricsServer {
+    public:
+        MetricsServer();
+        ~MetricsServer();
+
+        // Add every NetManager, IoThread and WorkerPool before start()
+        void addNetManager(const NetManager &netManager);
+        void addIoThread(const IoThread &ioThread);
+        void addWorkerPool(const WorkerPool &workerPool);
+
+        // Listen on address and port, meant for a loopback address
+        bool start(const char *address, const char *port);
+        void stop();
+    private:
+        void run();
+        void serve(int fd);
+        std::string render() const;
+
+        std::vector<const NetManager *> netManagers;
+        std::vector<const IoThread *> ioThreads;
+        std::vector<const WorkerPool *> workerPools;
+        int listener;
+        int stopFd;
+        std::thread thread;
+};
+
+#endif
+
+// Local Variables: ***
+// mode: C++ ***
+// tab-width: 4 ***
+// c-basic-offset: 4 ***
+// indent-tabs-mode: nil ***
+// End: ***
+// ex: shiftwidth=4 tabstop=4
@@ -0,0 +1,80 @@
+/* bzflag
+ * Copyright (c) 1993-2023 Tim Riker
+ *
+ * This package is free software;  you can redistribute it and/or
+ * modify it under the terms of the license found in the file
+ * named COPYING that should have accompanied this file.
+ *
+ * THIS PACKAGE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* interface header */
+#include "MpscQueue.h"
+
+MpscQueue::MpscQueue() : head(&stub), tail(&stub)
+{
+}
+
+void MpscQueue::push(MpscNode *node)
+{
+    node->next.store(nullptr, std::memory_order_relaxed);
+    MpscNode *previous = head.exchange(node, std::memory_order_acq_rel);
+
+    // Until this store the consumer can't see node, or anything pushed after it
+    previous->next.store(node, std::memory_order_release);
+}
+
+MpscNode *MpscQueue::pop()
+{
+    MpscNode *first = tail.load(std::memory_order_relaxed);
+    MpscNode *next = first->next.load(std::memory_order_acquire);
+
+    // The stub only marks the empty queue, step over it
+    if (first == &stub)
+    {
+        if (next == nullptr)
+            return nullptr;
+        tail.store(next, std::memory_order_relaxed);
+        first = next;
+        next = next->next.load(std::memory_order_acquire);
+    }
+
+    if (next != nullptr)
+    {
+        tail.store(next, std::memory_order_relaxed);
+        return first;
+    }
+
+    // first looks like the last node, but a push may be under way behind it
+    if (first != head.load(std::memory_order_acquire))
+        return nullptr;
+
+    // Put the stub back behind first so first can be handed out
+    push(&stub);
+    next = first->next.load(std::memory_order_acquire);
+    if (next != nullptr)
+    {
+        tail.store(next, std::memory_order_relaxed);
+        return first;
+    }
+
+    return nullptr;
+}
+
+bool MpscQueue::empty() const
+{
+    return tail.load(std::memory_order_relaxed) == &stub && stub.next.load(std::memory_order_acquire) == nullptr &&
+           head.load(std::memory_order_acquire) == &stub;
+}
+
+
+/* Local Variables: ***
+ * mode: C++ ***
+ * tab-width: 8 ***
+ * c-basic-offset: 2 ***
+ * indent-tabs-mode: t ***
+ * End: ***
+ * ex: shiftwidth=2 tabstop=8
+ */
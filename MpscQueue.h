@@ -0,0 +1,60 @@
+/* bzflag
+ * Copyright (c) 1993-2023 Tim Riker
+ *
+ * This package is free software;  you can redistribute it and/or
+ * modify it under the terms of the license found in the file
+ * named COPYING that should have accompanied this file.
+ *
+ * THIS PACKAGE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __MPSCQUEUE_H__
+#define __MPSCQUEUE_H__
+
+/* common header */
+#include "common.h"
+
+#include <atomic>
+
+// Embedded in anything that goes through an MpscQueue; a node can be in one
+// queue at a time
+struct MpscNode
+{
+    MpscNode() : next(nullptr) {}
+
+    std::atomic<MpscNode *> next;
+};
+
+// Intrusive unbounded queue with any number of producers and one consumer
+// (Vyukov's).  A push is one exchange and a store and never waits; a pop
+// can come back empty while a push is halfway through, so the consumer
+// should check empty() before deciding there is nothing left.
+class MpscQueue {
+    public:
+        MpscQueue();
+
+        // Any thread
+        void push(MpscNode *node);
+
+        // Consumer only
+        MpscNode *pop();
+        bool empty() const;
+    private:
+        std::atomic<MpscNode *> head;
+        char headPadding[64];
+        // Only the consumer moves it, but whoever was consumer last may still check empty()
+        std::atomic<MpscNode *> tail;
+        MpscNode stub;
+};
+
+#endif
+
+// Local Variables: ***
+// mode: C++ ***
+// tab-width: 4 ***
+// c-basic-offset: 4 ***
+// indent-tabs-mode: nil ***
+// End: ***
+// ex: shiftwidth=4 tabstop=4
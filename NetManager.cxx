@@ -14,32 +14,531 @@
 #include "NetManager.h"
 
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <netinet/udp.h>
+#include <netinet/tcp.h>
+#include <algorithm>
+#include <thread>
 #include "network.h"
-#include <iostream>
+#include "Logger.h"
+#include "Capture.h"
+#include "BanList.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include "IoUring.h"
+#endif
+
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+#include <linux/filter.h>
+#endif
 
 const int udpBufSize = 128000;
 
-NetManager::NetManager(const char* port) : port(port), fd_count(0), fd_size(14), numInterfaces(0), messageReceivedCallback(nullptr)
+// Largest message payload accepted unless setMaxMessageLength() says otherwise
+const uint16_t defaultMaxMessageLength = 8192;
+const size_t NetManager::messageHeaderSize;
+
+// Connections taken off a listener per pass of process() before moving on to other events
+const unsigned defaultAcceptBudget = 64;
+
+// How often the connection timeouts are looked at
+const uint64_t timeoutTick = 100000;
+
+// Bytes a connection may have waiting to be sent before it is dropped as too slow
+const size_t defaultSendQueueLimit = 256 * 1024;
+const unsigned NetManager::maxFlushBuffers;
+
+// Largest datagram we accept, and how many recvmmsg() pulls in per call
+const unsigned maxDatagramSize = 2048;
+const unsigned NetManager::udpBatchSize;
+const unsigned NetManager::sendBatchSize;
+
+// The kernel's limit on how many segments one UDP_SEGMENT send may carry
+const int maxGsoSegments = 64;
+
+#ifdef HAVE_LINUX_IO_URING_H
+// Submission queue depth and the provided buffers multishot receives fill
+const unsigned uringEntries = 256;
+const uint16_t tcpBufferGroup = 0;
+const unsigned tcpBufferCount = 512;
+const unsigned tcpBufferSize = 2048;
+const uint16_t udpBufferGroup = 1;
+const unsigned udpBufferCount = 256;
+const unsigned udpBufferSize = sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_storage) + maxDatagramSize;
+#endif
+
+// A message copied for a pool thread, and what it wants done back on the event loop
+struct PooledMessage
+{
+    NetManager::Message message;
+    std::vector<char> data;
+    std::function<void()> reply;
+};
+
+// A v4-mapped IPv6 address from a dual-stack socket, turned back into the IPv4 one it carries
+static void unmapAddress(struct sockaddr_storage &address)
+{
+    if (address.ss_family != AF_INET6)
+        return;
+
+    const struct sockaddr_in6 in6 = *(const struct sockaddr_in6 *)&address;
+    if (!IN6_IS_ADDR_V4MAPPED(&in6.sin6_addr))
+        return;
+
+    struct sockaddr_in *in = (struct sockaddr_in *)&address;
+    memset(&address, 0, sizeof address);
+    in->sin_family = AF_INET;
+    in->sin_port = in6.sin6_port;
+    memcpy(&in->sin_addr, in6.sin6_addr.s6_addr + 12, sizeof in->sin_addr);
+}
+
+// An IPv4 address the way a dual-stack socket wants it
+static void mapAddress(const struct sockaddr_storage &address, struct sockaddr_in6 &mapped)
+{
+    const struct sockaddr_in *in = (const struct sockaddr_in *)&address;
+    memset(&mapped, 0, sizeof mapped);
+    mapped.sin6_family = AF_INET6;
+    mapped.sin6_port = in->sin_port;
+    mapped.sin6_addr.s6_addr[10] = 0xff;
+    mapped.sin6_addr.s6_addr[11] = 0xff;
+    memcpy(mapped.sin6_addr.s6_addr + 12, &in->sin_addr, sizeof in->sin_addr);
+}
+
+// Scratch space for one recvmmsg() call
+struct NetManager::UdpBatch
+{
+    struct mmsghdr msgs[udpBatchSize];
+    struct iovec iov[udpBatchSize];
+    struct sockaddr_storage addrs[udpBatchSize];
+    char data[udpBatchSize][maxDatagramSize];
+};
+
+NetManager::NetManager(const char* port, Backend backend) : port(port), backend(EpollBackend), reusePort(false), steeringGroup(0), dualStack(false),
+    listenBacklog(SOMAXCONN), deferAcceptSecs(0), acceptBudget(defaultAcceptBudget), epollFd(-1), banList(nullptr), banReader(-1), banOnline(false),
+    sendQueueLimit(defaultSendQueueLimit), timerFd(-1), wakeupFd(-1), armedDeadline(0), nextTimerId(1),
+    runningTimer(0), handshakeTimeout(0), idleTimeout(0), keepaliveInterval(0), timeouts(timeoutTick, now()), timeoutTimer(0),
+    maxMessageLength(defaultMaxMessageLength), frameBuffer(defaultMaxMessageLength), wakeTime(0), udpGso(true), capture(nullptr), udpBatch(nullptr), workerPool(nullptr),
+    completions([this]() { wakeup(); }), messageReceivedCallback(nullptr), datagramReceivedCallback(nullptr),
+    datagramLinkHandler(nullptr), linkedDatagramCallback(nullptr), disconnectCallback(nullptr), pooledMessageCallback(nullptr),
+    keepaliveCallback(nullptr)
 {
-    // Allocate memory for the initial size of the pollfds
-    fds = (struct pollfd *)malloc(sizeof *fds * fd_size);
-    memset(fds, 0, sizeof *fds * fd_size);
+    recvBuffers.setBufferSize(ringSizeFor(maxMessageLength));
+
+#ifdef HAVE_LINUX_IO_URING_H
+    uring = nullptr;
+
+    if (backend == IoUringBackend)
+    {
+        uring = new IoUring();
+        if (uring->init(uringEntries) && uring->addBufferGroup(tcpBufferGroup, tcpBufferCount, tcpBufferSize) &&
+                uring->addBufferGroup(udpBufferGroup, udpBufferCount, udpBufferSize))
+        {
+            memset(&recvmsgTemplate, 0, sizeof recvmsgTemplate);
+            recvmsgTemplate.msg_namelen = sizeof(struct sockaddr_storage);
+            this->backend = IoUringBackend;
+        }
+        else
+        {
+            logMessage(LogWarning, "io_uring is unavailable, falling back to epoll");
+            delete uring;
+            uring = nullptr;
+        }
+    }
+#else
+    if (backend == IoUringBackend)
+        logMessage(LogWarning, "built without io_uring support, falling back to epoll");
+#endif
+
+    if (this->backend == EpollBackend)
+    {
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (epollFd == -1)
+            nerror("couldn't create epoll instance");
+
+        // Point each message of the batch at its own buffer and address once, up front
+        udpBatch = new UdpBatch;
+        memset(udpBatch->msgs, 0, sizeof udpBatch->msgs);
+        for (unsigned i = 0; i < udpBatchSize; ++i)
+        {
+            udpBatch->iov[i].iov_base = udpBatch->data[i];
+            udpBatch->iov[i].iov_len = maxDatagramSize;
+            udpBatch->msgs[i].msg_hdr.msg_iov = &udpBatch->iov[i];
+            udpBatch->msgs[i].msg_hdr.msg_iovlen = 1;
+            udpBatch->msgs[i].msg_hdr.msg_name = &udpBatch->addrs[i];
+        }
+    }
+
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timerFd == -1)
+        nerror("couldn't create timerfd");
+    wakeupFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeupFd == -1)
+        nerror("couldn't create wakeup eventfd");
+
+#ifdef HAVE_LINUX_IO_URING_H
+    if (this->backend == IoUringBackend)
+    {
+        if (timerFd != -1)
+            armPoll(timerFd, TimerEvent, 0, POLLIN, true);
+        if (wakeupFd != -1)
+            armPoll(wakeupFd, WakeupEvent, 0, POLLIN, true);
+    }
+    else
+#endif
+    {
+        if (timerFd != -1)
+            watch(timerFd, TimerEvent, 0);
+        if (wakeupFd != -1)
+            watch(wakeupFd, WakeupEvent, 0);
+    }
 }
 
 NetManager::~NetManager()
 {
-    int i;
+    // Tasks still out on the pool point at our strands and completion queue
+    while (counters.tasksPending.get() > 0)
+    {
+        runCompletions();
+        std::this_thread::yield();
+    }
+    for (WorkerPool::Task *task : freeTasks)
+        delete task;
 
-    // TODO: Do we need to close the client sockets too?
-    //for(i = numInterfaces * 2; i < fd_count; ++i)
-        //close(fds[i].fd);
+    // Close the client sockets
+    for (size_t i = 0; i < clients.size(); ++i)
+    {
+        close(clients.live(i)->fd);
+        if (clients.live(i)->strand != nullptr)
+            WorkerPool::release(clients.live(i)->strand);
+    }
 
     // Close the TCP and UDP listening sockets
-    for (i = 0; i < numInterfaces * 2; ++i)
-        close(fds[i].fd);
+    for (int fd : tcpListeners)
+        close(fd);
+    for (int fd : udpSockets)
+        close(fd);
+
+    if (timerFd != -1)
+        close(timerFd);
+    if (wakeupFd != -1)
+        close(wakeupFd);
+
+    if (epollFd != -1)
+        close(epollFd);
+
+    delete udpBatch;
+    delete capture;
+
+#ifdef HAVE_LINUX_IO_URING_H
+    delete uring;
+#endif
+}
+
+NetManager::Backend NetManager::getBackend() const
+{
+    return backend;
+}
+
+void NetManager::setReusePort(bool enable)
+{
+    reusePort = enable;
+}
+
+void NetManager::setSourceSteering(unsigned groupSize)
+{
+    steeringGroup = groupSize;
+}
+
+// Have the kernel hand packets for fd's SO_REUSEPORT group to the member picked by a hash of the
+// source address.  The filter runs with the transport payload as its packet, so the address is
+// read relative to the network header, and an IPv6 one is folded into a word first.
+static bool steerBySource(int fd, unsigned groupSize)
+{
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)(SKF_AD_OFF + SKF_AD_PROTOCOL)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x86dd, 2, 0),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)(SKF_NET_OFF + 12)),
+        BPF_JUMP(BPF_JMP | BPF_JA, 10, 0, 0),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)(SKF_NET_OFF + 8)),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)(SKF_NET_OFF + 12)),
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)(SKF_NET_OFF + 16)),
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)(SKF_NET_OFF + 20)),
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+
+        // Mix the low bits with the high ones, so neighbouring addresses spread out
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+        BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 0x45d9f3b),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, groupSize),
+        BPF_STMT(BPF_RET | BPF_A, 0)
+    };
+    struct sock_fprog program;
+    program.len = sizeof code / sizeof code[0];
+    program.filter = code;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof program) == -1)
+    {
+        logErrno(LogError, "setsockopt SO_ATTACH_REUSEPORT_CBPF");
+        return false;
+    }
+    return true;
+#else
+    logMessage(LogError, "can't steer SO_REUSEPORT groups by source address on this system");
+    return false;
+#endif
+}
+
+void NetManager::setDualStack(bool enable)
+{
+    dualStack = enable;
+}
+
+NetManager::Stats NetManager::getStats() const
+{
+    Stats stats;
+    stats.wakeups = counters.wakeups.get();
+    stats.events = counters.events.get();
+    stats.busyUsec = counters.busyUsec.get();
+    stats.waitUsec = counters.waitUsec.get();
+    stats.accepts = counters.accepts.get();
+    stats.disconnects = counters.disconnects.get();
+    stats.connections = counters.connections.get();
+    stats.tcpBytesIn = counters.tcpBytesIn.get();
+    stats.tcpBytesOut = counters.tcpBytesOut.get();
+    stats.tcpMessagesIn = counters.tcpMessagesIn.get();
+    stats.tcpMessagesOut = counters.tcpMessagesOut.get();
+    stats.udpBytesIn = counters.udpBytesIn.get();
+    stats.udpBytesOut = counters.udpBytesOut.get();
+    stats.udpDatagramsIn = counters.udpDatagramsIn.get();
+    stats.udpDatagramsOut = counters.udpDatagramsOut.get();
+    stats.recvErrors = counters.recvErrors.get();
+    stats.sendErrors = counters.sendErrors.get();
+    stats.acceptsLimited = counters.acceptsLimited.get();
+    stats.packetsLimited = counters.packetsLimited.get();
+    stats.acceptsBanned = counters.acceptsBanned.get();
+    stats.datagramsBanned = counters.datagramsBanned.get();
+    stats.datagramsUnlinked = counters.datagramsUnlinked.get();
+    stats.handshakeTimeouts = counters.handshakeTimeouts.get();
+    stats.idleTimeouts = counters.idleTimeouts.get();
+    stats.keepalives = counters.keepalives.get();
+    stats.tasksPending = counters.tasksPending.get();
+    return stats;
+}
+
+// A power of two holding a whole message, so a full ring always has one to hand out and never stalls
+size_t NetManager::ringSizeFor(uint16_t length)
+{
+    size_t size = 1;
+    while (size < messageHeaderSize + length)
+        size <<= 1;
+    return size;
+}
+
+NetManager::BufferUsage NetManager::getBufferUsage() const
+{
+    BufferUsage usage;
+    usage.bufferSize = recvBuffers.getBufferSize();
+    usage.inUse = recvBuffers.getInUse();
+    usage.highWater = recvBuffers.getHighWater();
+    usage.reserved = recvBuffers.getReserved();
+    return usage;
+}
+
+uint64_t NetManager::now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void NetManager::wakeup()
+{
+    uint64_t one = 1;
+    if (write(wakeupFd, &one, sizeof one) == -1 && errno != EAGAIN)
+        logErrno(LogError, "wakeup");
+}
+
+NetManager::TimerId NetManager::addTimer(uint64_t delayUsec, std::function<void(uint64_t)> callback)
+{
+    return scheduleTimer(now() + delayUsec, 0, callback);
+}
+
+NetManager::TimerId NetManager::addRepeatingTimer(uint64_t periodUsec, std::function<void(uint64_t)> callback)
+{
+    if (periodUsec == 0)
+        return 0;
+
+    return scheduleTimer(now() + periodUsec, periodUsec, callback);
+}
+
+bool NetManager::cancelTimer(TimerId id)
+{
+    auto timer = timers.find(id);
+    if (timer == timers.end())
+        return false;
+
+    // A timer cancelling itself from its own callback is cleaned up once the callback returns
+    if (id == runningTimer)
+        timer->second.cancelled = true;
+    else
+        timers.erase(timer);
+
+    // The stale heap entry is skipped when it comes up
+    return true;
+}
+
+NetManager::TimerId NetManager::scheduleTimer(uint64_t deadline, uint64_t period, std::function<void(uint64_t)> callback)
+{
+    const TimerId id = nextTimerId++;
+
+    Timer &timer = timers[id];
+    timer.period = period;
+    timer.cancelled = false;
+    timer.callback = callback;
+
+    TimerDeadline entry;
+    entry.deadline = deadline;
+    entry.id = id;
+    timerQueue.push_back(entry);
+    std::push_heap(timerQueue.begin(), timerQueue.end());
+
+    // Inside runTimers() the timerfd gets re-armed once all due timers are done
+    if (runningTimer == 0)
+        armTimerFd();
+
+    return id;
+}
+
+void NetManager::runTimers()
+{
+    const uint64_t current = now();
+
+    while (!timerQueue.empty() && timerQueue.front().deadline <= current)
+    {
+        TimerDeadline entry = timerQueue.front();
+        std::pop_heap(timerQueue.begin(), timerQueue.end());
+        timerQueue.pop_back();
+
+        auto timer = timers.find(entry.id);
+        if (timer == timers.end())
+            continue;
+
+        runningTimer = entry.id;
+        timer->second.callback(entry.deadline);
+        runningTimer = 0;
+
+        // The callback may have added timers, which can rehash the map
+        timer = timers.find(entry.id);
+        if (timer->second.cancelled || timer->second.period == 0)
+        {
+            timers.erase(timer);
+            continue;
+        }
+
+        // Stay on the original grid, skipping any deadlines we were too late for
+        const uint64_t period = timer->second.period;
+        entry.deadline += period;
+        if (entry.deadline <= current)
+            entry.deadline += ((current - entry.deadline) / period + 1) * period;
+
+        timerQueue.push_back(entry);
+        std::push_heap(timerQueue.begin(), timerQueue.end());
+    }
 
-    free(fds);
-    fds = nullptr;
+    armTimerFd();
+}
+
+void NetManager::armTimerFd()
+{
+    if (timerFd == -1)
+        return;
+
+    // Drop cancelled timers from the top so they don't cause pointless wakeups
+    while (!timerQueue.empty() && timers.find(timerQueue.front().id) == timers.end())
+    {
+        std::pop_heap(timerQueue.begin(), timerQueue.end());
+        timerQueue.pop_back();
+    }
+
+    const uint64_t deadline = timerQueue.empty() ? 0 : timerQueue.front().deadline;
+    if (deadline == armedDeadline)
+        return;
+
+    // An all zero it_value disarms the timer
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof spec);
+    spec.it_value.tv_sec = deadline / 1000000;
+    spec.it_value.tv_nsec = (deadline % 1000000) * 1000;
+
+    if (timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &spec, nullptr) == -1)
+    {
+        logErrno(LogError, "timerfd_settime");
+        return;
+    }
+    armedDeadline = deadline;
+}
+
+void NetManager::drainFd(int fd)
+{
+    uint64_t count;
+    while (read(fd, &count, sizeof count) > 0)
+        ;
+}
+
+void NetManager::recordLoad(uint64_t events, uint64_t since)
+{
+    counters.wakeups.add();
+    counters.events.add(events);
+    counters.busyUsec.add(now() - since);
+}
+
+uint64_t NetManager::makeEventTag(EventType type, uint32_t id)
+{
+    return ((uint64_t)type << 32) | id;
+}
+
+NetManager::EventType NetManager::eventTagType(uint64_t tag)
+{
+    return (EventType)(tag >> 32);
+}
+
+uint32_t NetManager::eventTagId(uint64_t tag)
+{
+    return (uint32_t)tag;
+}
+
+bool NetManager::watch(int fd, EventType type, uint32_t id)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof ev);
+
+    // Everything is edge-triggered, so each handler must drain its socket until EAGAIN
+    ev.events = EPOLLIN | EPOLLET;
+    if (type == ClientEvent)
+        ev.events |= EPOLLRDHUP;
+    ev.data.u64 = makeEventTag(type, id);
+
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) == -1)
+    {
+        nerror("couldn't add socket to epoll");
+        return false;
+    }
+
+    return true;
 }
 
 bool NetManager::bind(const char* address)
@@ -87,8 +586,19 @@ bool NetManager::bind(const char* address)
         return false;
     }
 #endif
-    // On IPv6 interfaces, set it to use IPv6 only
+#ifdef SO_REUSEPORT
+    // Let every shard bind its own listener on the same port, the kernel spreads connections between them
     opt = optOn;
+    if (reusePort && setsockopt(tcpSocket, SOL_SOCKET, SO_REUSEPORT, (SSOType)&opt, sizeof(opt)) < 0)
+    {
+        nerror("serverStart: setsockopt SO_REUSEPORT");
+        close(tcpSocket);
+        freeaddrinfo(res);
+        return false;
+    }
+#endif
+    // On IPv6 interfaces, set it to use IPv6 only, unless it is to take IPv4 as well
+    opt = dualStack ? 0 : optOn;
     if (res->ai_family == AF_INET6 && setsockopt(tcpSocket, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof opt) == -1)
     {
         nerror("serverStart: setsockopt IPV6_ONLY");
@@ -105,7 +615,19 @@ bool NetManager::bind(const char* address)
         return false;
     }
 
-    if (listen(tcpSocket, 5) == -1)
+#ifdef TCP_DEFER_ACCEPT
+    // Only hand over connections once the client has sent something, so idle connects never wake us
+    if (deferAcceptSecs > 0 &&
+            setsockopt(tcpSocket, IPPROTO_TCP, TCP_DEFER_ACCEPT, (SSOType)&deferAcceptSecs, sizeof(deferAcceptSecs)) < 0)
+    {
+        nerror("serverStart: setsockopt TCP_DEFER_ACCEPT");
+        close(tcpSocket);
+        freeaddrinfo(res);
+        return false;
+    }
+#endif
+
+    if (listen(tcpSocket, listenBacklog) == -1)
     {
         nerror("couldn't make connect socket queue");
         close(tcpSocket);
@@ -113,6 +635,14 @@ bool NetManager::bind(const char* address)
         return false;
     }
 
+    // The group only exists once the socket is listening
+    if (reusePort && steeringGroup > 1 && !steerBySource(tcpSocket, steeringGroup))
+    {
+        close(tcpSocket);
+        freeaddrinfo(res);
+        return false;
+    }
+
     // TODO: Check if we should run getaddrinfo again with the other protocol
 
     // we open a udp socket on the same port
@@ -142,8 +672,20 @@ bool NetManager::bind(const char* address)
         return false;
     }
 
-    // On IPv6 interfaces, set it to use IPv6 only
+#ifdef SO_REUSEPORT
     opt = optOn;
+    if (reusePort && setsockopt(udpSocket, SOL_SOCKET, SO_REUSEPORT, (SSOType)&opt, sizeof(opt)) < 0)
+    {
+        nerror("serverStart: setsockopt SO_REUSEPORT");
+        close(udpSocket);
+        close(tcpSocket);
+        freeaddrinfo(res);
+        return false;
+    }
+#endif
+
+    // On IPv6 interfaces, set it to use IPv6 only, unless it is to take IPv4 as well
+    opt = dualStack ? 0 : optOn;
     if (res->ai_family == AF_INET6 && setsockopt(udpSocket, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof opt) == -1)
     {
         nerror("serverStart: setsockopt IPV6_ONLY");
@@ -162,130 +704,1587 @@ bool NetManager::bind(const char* address)
         return false;
     }
 
+    if (reusePort && steeringGroup > 1 && !steerBySource(udpSocket, steeringGroup))
+    {
+        close(udpSocket);
+        close(tcpSocket);
+        freeaddrinfo(res);
+        return false;
+    }
+
+    const int family = res->ai_family;
     freeaddrinfo(res);
 
     // don't buffer info, send it immediately
     BzfNetwork::setNonBlocking(udpSocket);
 
-    // Add the two new sockets to our pollfds
-    fds[fd_count].fd = tcpSocket;
-    fds[fd_count++].events = POLLIN;
-    fds[fd_count].fd = udpSocket;
-    fds[fd_count++].events = POLLIN;
-    numInterfaces += 1;
+    // The listener is drained in a loop, so it must not block once the backlog is empty
+    BzfNetwork::setNonBlocking(tcpSocket);
+
+    tcpListeners.push_back(tcpSocket);
+    udpSockets.push_back(udpSocket);
+    udpFamilies.push_back(family);
+
+    // Register the two new sockets, tagged with their index so process() knows what they are
+    bool registered;
+#ifdef HAVE_LINUX_IO_URING_H
+    if (backend == IoUringBackend)
+        registered = armAccept((uint32_t)tcpListeners.size() - 1) && armRecvmsg((uint32_t)udpSockets.size() - 1);
+    else
+#endif
+        registered = watch(tcpSocket, TcpListenerEvent, (uint32_t)tcpListeners.size() - 1) &&
+                     watch(udpSocket, UdpSocketEvent, (uint32_t)udpSockets.size() - 1);
+
+    if (!registered)
+    {
+        tcpListeners.pop_back();
+        udpSockets.pop_back();
+        udpFamilies.pop_back();
+        close(udpSocket);
+        close(tcpSocket);
+        return false;
+    }
 
     return true;
 }
 
-bool NetManager::process()
+bool NetManager::process(int timeoutMs)
+{
+    bool result;
+#ifdef HAVE_LINUX_IO_URING_H
+    if (backend == IoUringBackend)
+        result = processUring(timeoutMs);
+    else
+#endif
+        result = processEpoll(timeoutMs);
+
+    // Nothing is looked up between passes, so a ban list update never has to wait for us
+    if (banOnline)
+    {
+        banList->offline(banReader);
+        banOnline = false;
+    }
+
+    return result;
+}
+
+bool NetManager::processEpoll(int timeoutMs)
 {
-    int pollCount = poll(fds, fd_count, 50);
+    // Listeners that ran out of accept budget still have connections waiting, and edge triggered
+    // epoll won't report them again, so don't block
+    const size_t backlogged = backloggedListeners.size();
+
+    const uint64_t waitStart = now();
+    int eventCount = epoll_wait(epollFd, events, maxEvents, backlogged > 0 ? 0 : timeoutMs);
+    wakeTime = now();
+    counters.waitUsec.add(wakeTime - waitStart);
 
     // Uh oh, something went wong
-    if (pollCount == -1)
+    if (eventCount == -1)
     {
-        perror("poll");
+        // A signal arrived, let the caller decide what to do
+        if (errno == EINTR)
+            return true;
+
+        logErrno(LogError, "epoll_wait");
         return false;
     }
 
     // Nothing to process
-    if (pollCount == 0)
+    if (eventCount == 0 && backlogged == 0)
         return true;
 
-    for (int i = 0; i < fd_count; i++)
+    // Draining may put a listener straight back on the list, only take the ones that were there
+    for (size_t i = 0; i < backlogged; ++i)
+    {
+        const uint32_t listener = backloggedListeners.front();
+        backloggedListeners.erase(backloggedListeners.begin());
+        acceptClients(listener);
+    }
+
+    for (int i = 0; i < eventCount; i++)
     {
-        // Check if a socket is ready to read
-        if (fds[i].revents & POLLIN)
+        const uint64_t tag = events[i].data.u64;
+        const uint32_t id = eventTagId(tag);
+
+        switch (eventTagType(tag))
         {
-            // If it's out listening socket, accept the client
-            // TODO: See if we need to match the fd with the TCP listener
-            if (i < 2 * numInterfaces - 1 && i % 2 == 0)
-            {
-                struct sockaddr_storage remoteIP;
-                socklen_t remoteIPLen = sizeof remoteIP;
-                int cs = accept(fds[i].fd, (struct sockaddr *)&remoteIP, &remoteIPLen);
+        case TcpListenerEvent:
+            acceptClients(id);
+            break;
 
-                if (cs == -1)
-                {
-                    perror("accept");
-                }
-                else
-                {
-                    // If we are out of room, expand it a bit
-                    if (fd_count == fd_size)
-                    {
-                        const int fd_size_increase = 10;
-                        struct pollfd* new_fds;
-                        new_fds = (struct pollfd*)realloc(fds, sizeof(*fds) * (fd_size + fd_size_increase));
-                        if (new_fds == nullptr)
-                            return false;
-                        else
-                        {
-                            // TODO: Need to test if this actually initializes the extra allocated memory
-                            memset(fds + (sizeof *fds * fd_size), 0, sizeof *fds * fd_size_increase);
-                            fd_size += fd_size_increase;
-                            fds = new_fds;
-                        }
-                    }
-
-                    // Set socket to non-blocking
-                    //fcntl(cs, F_SETFL, O_NONBLOCK);
-
-                    fds[fd_count].fd = cs;
-                    fds[fd_count++].events = POLLIN;
-
-
-                    for (auto acceptCallback : acceptCallbacks)
-                        acceptCallback((struct sockaddr *)&remoteIP, cs);
-                }
-            }
+        case UdpSocketEvent:
+            readUdp(udpSockets[id]);
+            break;
 
-            // If not a listener, it's a client
-            else
-            {
-                char buf[1024] = {0};
+        case ClientEvent:
+        {
+            Connection &conn = *clients.slot(id);
+            if (events[i].events & EPOLLOUT)
+                flushClient(conn);
+
+            // Hangups and errors are picked up by recv() returning 0 or -1, which has to be read
+            // for even when the data ahead of it comes in a short read
+            if (events[i].events & ~EPOLLOUT)
+                readClient(conn, (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0);
+            break;
+        }
 
-                int nbytes = recv(fds[i].fd, buf, sizeof buf, 0);
+        case TimerEvent:
+            drainFd(timerFd);
+            runTimers();
+            break;
 
-                if (nbytes <= 0)
-                {
-                    if (nbytes == 0)
-                    {
-                        std::cout << "socket " << fds[i].fd << " has disconnected" << std::endl;
-                    }
-                    else
-                    {
-                        perror("recv");
-                    }
-
-                    // Close the socket
-                    close(fds[i].fd);
-
-                    // Remove an index from the set by copying the ones from the end over this one
-                    fds[i] = fds[fd_count--];
-                }
-                else
-                {
-                    if (messageReceivedCallback != nullptr)
-                        messageReceivedCallback(buf);
-                }
-            }
+        case WakeupEvent:
+            drainFd(wakeupFd);
+            break;
+
+        case ClientWritableEvent:
+            break;
         }
     }
 
+    runCompletions();
+    reapClients();
+
+    recordLoad(eventCount, wakeTime);
+
     return true;
 }
 
-void NetManager::addAcceptCallback(std::function<void(struct sockaddr *, int)> callback)
+void NetManager::acceptClients(uint32_t listener)
 {
-    acceptCallbacks.push_back(callback);
+    for (unsigned accepted = 0; accepted < acceptBudget; ++accepted)
+    {
+        struct sockaddr_storage remoteIP;
+        socklen_t remoteIPLen = sizeof remoteIP;
+        int cs = accept4(tcpListeners[listener], (struct sockaddr *)&remoteIP, &remoteIPLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (cs == -1)
+        {
+            // The peer gave up before we got to it, move on to the next one
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                logErrno(LogError, "accept");
+            return;
+        }
+
+        unmapAddress(remoteIP);
+        const PeerAddress peer(remoteIP);
+        if (isBanned(peer))
+        {
+            close(cs);
+            counters.acceptsBanned.add();
+            continue;
+        }
+
+        if (!connectionLimiter.allow(peer, wakeTime))
+        {
+            close(cs);
+            counters.acceptsLimited.add();
+            continue;
+        }
+
+        addClient(cs, remoteIP);
+    }
+
+    // Out of budget, pick up where we left off on the next pass
+    if (std::find(backloggedListeners.begin(), backloggedListeners.end(), listener) == backloggedListeners.end())
+        backloggedListeners.push_back(listener);
 }
 
-void NetManager::setMessageReceivedCallback(std::function<void(const char *)> callback)
+// Looked up from the event loop only, which is a ban list reader while it does
+bool NetManager::isBanned(const PeerAddress &peer)
+{
+    if (banList == nullptr)
+        return false;
+
+    if (!banOnline)
+    {
+        banList->online(banReader);
+        banOnline = true;
+    }
+    return banList->banned(peer);
+}
+
+NetManager::ConnectionId NetManager::addClient(int cs, struct sockaddr_storage &remoteIP)
+{
+    Connection &conn = *clients.insert(cs);
+    conn.peer = PeerAddress(remoteIP);
+
+    bool registered;
+#ifdef HAVE_LINUX_IO_URING_H
+    if (backend == IoUringBackend)
+        registered = armRecv(conn);
+    else
+#endif
+        registered = watch(cs, ClientEvent, ConnectionTable::slotOf(conn.id));
+
+    if (!registered)
+    {
+        clients.remove(&conn);
+        close(cs);
+        return 0;
+    }
+
+    conn.connected = conn.lastReceived = now();
+    armTimeout(conn);
+
+    counters.accepts.add();
+    counters.connections.add();
+    if (capture != nullptr)
+        capture->recordAccept(wakeTime, conn.id, remoteIP);
+
+    for (auto acceptCallback : acceptCallbacks)
+        acceptCallback((struct sockaddr *)&remoteIP, conn.id);
+
+    return conn.id;
+}
+
+NetManager::ConnectionId NetManager::adoptConnection(int fd)
+{
+    struct sockaddr_storage remoteIP;
+    socklen_t remoteIPLen = sizeof remoteIP;
+    memset(&remoteIP, 0, sizeof remoteIP);
+    if (getpeername(fd, (struct sockaddr *)&remoteIP, &remoteIPLen) == -1)
+    {
+        logErrno(LogError, "getpeername");
+        close(fd);
+        return 0;
+    }
+    unmapAddress(remoteIP);
+
+    BzfNetwork::setNonBlocking(fd);
+    return addClient(fd, remoteIP);
+}
+
+bool NetManager::borrowBuffer(Connection &conn)
+{
+    if (conn.ring.attached())
+        return true;
+
+    char *buffer = recvBuffers.acquire();
+    if (buffer == nullptr)
+    {
+        logMessage(LogError, "no receive buffer for socket {1}, disconnecting", conn.fd);
+        dropClient(conn);
+        return false;
+    }
+
+    conn.ring.attach(buffer, recvBuffers.getBufferSize());
+    return true;
+}
+
+void NetManager::returnBuffer(Connection &conn)
+{
+    // Only a ring holding the start of a message has to keep its buffer
+    if (conn.ring.attached() && (conn.ring.size() == 0 || conn.closing))
+        recvBuffers.release(conn.ring.detach());
+}
+
+void NetManager::readClient(Connection &conn, bool hungUp)
+{
+    if (!conn.closing && borrowBuffer(conn))
+        readRing(conn, hungUp);
+
+    returnBuffer(conn);
+}
+
+void NetManager::readRing(Connection &conn, bool hungUp)
+{
+    const int fd = conn.fd;
+    RecvRing &ring = conn.ring;
+
+    while (!conn.closing)
+    {
+        // Read straight into the connection's ring, so whole messages can be handed out in place
+        struct iovec iov[2];
+        const int spans = ring.writableSpans(iov);
+        const size_t wanted = spans == 2 ? iov[0].iov_len + iov[1].iov_len : iov[0].iov_len;
+
+        ssize_t nbytes = readv(fd, iov, spans);
+
+        if (nbytes <= 0)
+        {
+            if (nbytes == 0)
+            {
+                logMessage(LogInfo, "socket {1} has disconnected", fd);
+            }
+            else
+            {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return;
+                logErrno(LogError, "recv");
+                counters.recvErrors.add();
+            }
+
+            dropClient(conn);
+            return;
+        }
+
+        ring.commit(nbytes);
+        counters.tcpBytesIn.add(nbytes);
+        if (capture != nullptr)
+            capture->recordTcpData(wakeTime, conn.id, iov, spans, nbytes);
+        if (!frameMessages(conn))
+            return;
+
+        // A short read on a stream socket means it has been drained, no need to wait for EAGAIN,
+        // unless the peer has hung up and there is an end of file still to read
+        if ((size_t)nbytes < wanted && !hungUp)
+            return;
+    }
+}
+
+bool NetManager::frameMessages(Connection &conn)
+{
+    RecvRing &ring = conn.ring;
+
+    // Heard from, the timeouts see this when they next go off
+    conn.lastReceived = wakeTime;
+    conn.probed = false;
+
+    // A callback may drop the connection, stop handing out its messages when it does
+    while (ring.size() >= messageHeaderSize && !conn.closing)
+    {
+        // BZFlag header: 16 bit payload length, then 16 bit message code, both in network order
+        unsigned char header[messageHeaderSize];
+        ring.peek(0, (char *)header, sizeof header);
+        const uint16_t length = (uint16_t)((header[0] << 8) | header[1]);
+        const uint16_t code = (uint16_t)((header[2] << 8) | header[3]);
+
+        if (length > maxMessageLength)
+        {
+            logMessage(LogWarning, "socket {1} sent a {2} byte message, disconnecting", conn.fd, length);
+            dropClient(conn);
+            return false;
+        }
+
+        // Wait for the rest of it
+        if (ring.size() < messageHeaderSize + length)
+            break;
+
+        if (!packetLimiter.allow(conn.peer, wakeTime))
+        {
+            logMessage(LogWarning, "socket {1} is sending too fast, disconnecting", conn.fd);
+            counters.packetsLimited.add();
+            dropClient(conn);
+            return false;
+        }
+
+        conn.handshaken = true;
+
+        // Only a message wrapping around the end of the ring has to be copied out
+        const char *message = ring.contiguous(messageHeaderSize + length);
+        if (message != nullptr)
+            deliver(conn, code, message + messageHeaderSize, length);
+        else
+        {
+            ring.peek(messageHeaderSize, frameBuffer.data(), length);
+            deliver(conn, code, frameBuffer.data(), length);
+        }
+
+        ring.consume(messageHeaderSize + length);
+    }
+
+    return !conn.closing;
+}
+
+void NetManager::deliver(Connection &conn, uint16_t code, const char *data, size_t length)
+{
+    counters.tcpMessagesIn.add();
+
+    if (pooledMessageCallback != nullptr && workerPool != nullptr)
+    {
+        // The payload is only ours until we return, so the pool thread gets a copy
+        PooledMessage *pooled = new PooledMessage;
+        pooled->data.assign(data, data + length);
+        pooled->message.connection = conn.id;
+        pooled->message.code = code;
+        pooled->message.data = pooled->data.data();
+        pooled->message.length = length;
+        pooled->message.received = wakeTime;
+
+        auto work = [this, pooled]()
+        {
+            pooled->reply = pooledMessageCallback(pooled->message);
+        };
+        auto done = [pooled]()
+        {
+            if (pooled->reply)
+                pooled->reply();
+            delete pooled;
+        };
+        if (!submit(conn.id, work, done))
+            delete pooled;
+        return;
+    }
+
+    if (messageReceivedCallback == nullptr)
+        return;
+
+    Message message;
+    message.connection = conn.id;
+    message.code = code;
+    message.data = data;
+    message.length = length;
+    message.received = wakeTime;
+    messageReceivedCallback(message);
+}
+
+void NetManager::readUdp(int fd)
+{
+    struct mmsghdr *msgs = udpBatch->msgs;
+
+    while (true)
+    {
+        // The kernel overwrites the address lengths, so reset them for every batch
+        for (unsigned i = 0; i < udpBatchSize; ++i)
+            msgs[i].msg_hdr.msg_namelen = sizeof udpBatch->addrs[i];
+
+        int count = recvmmsg(fd, msgs, udpBatchSize, 0, nullptr);
+
+        if (count < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                logErrno(LogError, "recvmmsg");
+                counters.recvErrors.add();
+            }
+            return;
+        }
+
+        for (int i = 0; i < count; ++i)
+        {
+            // Anything bigger than a datagram buffer isn't one of ours
+            if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+                continue;
+
+            unmapAddress(udpBatch->addrs[i]);
+            const PeerAddress peer(udpBatch->addrs[i]);
+            if (isBanned(peer))
+            {
+                counters.datagramsBanned.add();
+                continue;
+            }
+
+            if (!packetLimiter.allow(peer, wakeTime))
+            {
+                counters.packetsLimited.add();
+                continue;
+            }
+
+            receivedDatagram(udpBatch->data[i], msgs[i].msg_len, udpBatch->addrs[i], peer);
+        }
+
+        // A short batch means the socket is drained
+        if (count < (int)udpBatchSize)
+            return;
+    }
+}
+
+void NetManager::receivedDatagram(const char *data, size_t length, const struct sockaddr_storage &from, const PeerAddress &peer)
+{
+    counters.udpDatagramsIn.add();
+    counters.udpBytesIn.add(length);
+    if (capture != nullptr)
+        capture->recordDatagram(wakeTime, from, data, length);
+
+    if (datagramLinkHandler == nullptr)
+    {
+        if (datagramReceivedCallback != nullptr)
+            datagramReceivedCallback(data, length, from);
+        return;
+    }
+
+    const ConnectionId *linked = datagramLinks.find(peer);
+    if (linked != nullptr)
+    {
+        if (linkedDatagramCallback != nullptr)
+            linkedDatagramCallback(*linked, data, length, from);
+        return;
+    }
+
+    // A source we don't know only gets as far as the link handshake
+    const ConnectionId connection = datagramLinkHandler(data, length, from);
+    if (connection == 0 || !linkDatagrams(connection, from))
+        counters.datagramsUnlinked.add();
+}
+
+int NetManager::udpSocketFor(int family, bool &mapped) const
+{
+    mapped = false;
+    for (size_t i = 0; i < udpSockets.size(); ++i)
+    {
+        if (udpFamilies[i] == family)
+            return udpSockets[i];
+    }
+
+    // A dual-stack socket sends to IPv4 peers at their v4-mapped address
+    if (dualStack && family == AF_INET)
+    {
+        for (size_t i = 0; i < udpSockets.size(); ++i)
+        {
+            if (udpFamilies[i] == AF_INET6)
+            {
+                mapped = true;
+                return udpSockets[i];
+            }
+        }
+    }
+
+    return -1;
+}
+
+int NetManager::sendDatagrams(const Datagram *datagrams, int count)
+{
+    struct mmsghdr msgs[sendBatchSize];
+    struct iovec iov[sendBatchSize];
+    struct sockaddr_in6 mappedNames[sendBatchSize];
+    int sent = 0;
+
+    while (sent < count)
+    {
+        // Batch up a run of destinations that go out through the same socket
+        const int family = datagrams[sent].destination->ss_family;
+        bool mapped;
+        const int fd = udpSocketFor(family, mapped);
+        if (fd == -1)
+        {
+            errno = EAFNOSUPPORT;
+            return sent;
+        }
+
+        int batch = 0;
+        while (batch < (int)sendBatchSize && sent + batch < count &&
+                datagrams[sent + batch].destination->ss_family == family)
+        {
+            const Datagram &datagram = datagrams[sent + batch];
+
+            iov[batch].iov_base = (void *)datagram.data;
+            iov[batch].iov_len = datagram.length;
+
+            memset(&msgs[batch], 0, sizeof msgs[batch]);
+            if (mapped)
+            {
+                mapAddress(*datagram.destination, mappedNames[batch]);
+                msgs[batch].msg_hdr.msg_name = &mappedNames[batch];
+                msgs[batch].msg_hdr.msg_namelen = sizeof mappedNames[batch];
+            }
+            else
+            {
+                msgs[batch].msg_hdr.msg_name = (void *)datagram.destination;
+                msgs[batch].msg_hdr.msg_namelen = family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+            }
+            msgs[batch].msg_hdr.msg_iov = &iov[batch];
+            msgs[batch].msg_hdr.msg_iovlen = 1;
+            ++batch;
+        }
+
+        int r = sendmmsg(fd, msgs, batch, 0);
+        if (r == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            // EAGAIN means the socket buffer is full, the caller can retry the rest later
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                counters.sendErrors.add();
+            return sent;
+        }
+
+        counters.udpDatagramsOut.add(r);
+        for (int i = 0; i < r; ++i)
+            counters.udpBytesOut.add(msgs[i].msg_len);
+
+        // If the kernel stopped early, the next call starts with the datagram that failed and reports why
+        sent += r;
+    }
+
+    return sent;
+}
+
+int NetManager::broadcastDatagram(const char *data, size_t length, const struct sockaddr_storage *destinations, int count)
+{
+    Datagram datagrams[sendBatchSize];
+    int sent = 0;
+
+    while (sent < count)
+    {
+        int batch = count - sent < (int)sendBatchSize ? count - sent : (int)sendBatchSize;
+        for (int i = 0; i < batch; ++i)
+        {
+            datagrams[i].data = data;
+            datagrams[i].length = length;
+            datagrams[i].destination = &destinations[sent + i];
+        }
+
+        int r = sendDatagrams(datagrams, batch);
+        sent += r;
+        if (r < batch)
+            break;
+    }
+
+    return sent;
+}
+
+int NetManager::sendDatagramTrain(const char *data, size_t length, size_t segmentSize,
+                                  const struct sockaddr_storage &destination)
+{
+    // Nothing sent, like every other failure here
+    if (segmentSize == 0)
+    {
+        errno = EINVAL;
+        return 0;
+    }
+
+    const int segments = (int)((length + segmentSize - 1) / segmentSize);
+
+#ifdef UDP_SEGMENT
+    // One send with UDP_SEGMENT set has the kernel (or the NIC) cut the train into datagrams
+    if (udpGso && segments > 1 && segments <= maxGsoSegments && length <= 65507)
+    {
+        bool mapped;
+        const int fd = udpSocketFor(destination.ss_family, mapped);
+        if (fd == -1)
+        {
+            errno = EAFNOSUPPORT;
+            return 0;
+        }
+
+        struct sockaddr_in6 mappedName;
+        if (mapped)
+            mapAddress(destination, mappedName);
+
+        struct iovec iov;
+        iov.iov_base = (void *)data;
+        iov.iov_len = length;
+
+        char control[CMSG_SPACE(sizeof(uint16_t))];
+        memset(control, 0, sizeof control);
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof msg);
+        if (mapped)
+        {
+            msg.msg_name = &mappedName;
+            msg.msg_namelen = sizeof mappedName;
+        }
+        else
+        {
+            msg.msg_name = (void *)&destination;
+            msg.msg_namelen = destination.ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+        }
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof control;
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        uint16_t size = (uint16_t)segmentSize;
+        memcpy(CMSG_DATA(cmsg), &size, sizeof size);
+
+        ssize_t r;
+        do
+            r = sendmsg(fd, &msg, 0);
+        while (r == -1 && errno == EINTR);
+
+        if (r != -1)
+        {
+            counters.udpDatagramsOut.add(segments);
+            counters.udpBytesOut.add(length);
+            return segments;
+        }
+
+        // The whole train either goes or it doesn't
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+            return 0;
+
+        // No GSO on this kernel or route, remember that and send the segments one by one
+        if (errno != EINVAL && errno != EIO && errno != ENOPROTOOPT && errno != EOPNOTSUPP)
+            return 0;
+        udpGso = false;
+    }
+#endif
+
+    std::vector<Datagram> datagrams(segments);
+    for (int i = 0; i < segments; ++i)
+    {
+        const size_t offset = i * segmentSize;
+        datagrams[i].data = data + offset;
+        datagrams[i].length = length - offset < segmentSize ? length - offset : segmentSize;
+        datagrams[i].destination = &destination;
+    }
+
+    return sendDatagrams(datagrams.data(), segments);
+}
+
+bool NetManager::send(ConnectionId connection, const char *data, size_t length)
+{
+    struct iovec iov;
+    iov.iov_base = (void *)data;
+    iov.iov_len = length;
+
+    return queueSend(connection, &iov, 1);
+}
+
+bool NetManager::sendMessage(ConnectionId connection, uint16_t code, const char *data, size_t length)
+{
+    if (length > 0xffff)
+    {
+        errno = EMSGSIZE;
+        return false;
+    }
+
+    unsigned char header[messageHeaderSize];
+    header[0] = (unsigned char)(length >> 8);
+    header[1] = (unsigned char)length;
+    header[2] = (unsigned char)(code >> 8);
+    header[3] = (unsigned char)code;
+
+    struct iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof header;
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = length;
+
+    if (!queueSend(connection, iov, length > 0 ? 2 : 1))
+        return false;
+
+    counters.tcpMessagesOut.add();
+    return true;
+}
+
+bool NetManager::queueSend(ConnectionId connection, const struct iovec *iov, int iovcnt)
+{
+    Connection *client = clients.find(connection);
+    if (client == nullptr || client->closing)
+    {
+        errno = ENOTCONN;
+        return false;
+    }
+    Connection &conn = *client;
+    const int fd = conn.fd;
+
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; ++i)
+        total += iov[i].iov_len;
+
+    // Nothing is waiting, so try the socket straight away
+    size_t written = 0;
+    if (conn.sendQueue.empty())
+    {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof msg);
+        msg.msg_iov = (struct iovec *)iov;
+        msg.msg_iovlen = iovcnt;
+
+        ssize_t r;
+        do
+            r = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        while (r == -1 && errno == EINTR);
+
+        if (r == -1)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                logErrno(LogError, "send");
+                counters.sendErrors.add();
+                dropClient(conn);
+                return false;
+            }
+            r = 0;
+        }
+        written = r;
+        counters.tcpBytesOut.add(written);
+    }
+
+    if (written == total)
+        return true;
+
+    // A client that can't keep up doesn't get to hold on to an unbounded amount of our memory
+    const size_t queued = conn.queuedBytes + total - written;
+    if (queued > sendQueueLimit)
+    {
+        logMessage(LogWarning, "socket {1} would have {2} bytes queued, disconnecting", fd, queued);
+        dropClient(conn);
+        errno = ENOBUFS;
+        return false;
+    }
+
+    // Keep whatever the socket didn't take as one buffer
+    std::vector<char> pending;
+    pending.reserve(total - written);
+    size_t skip = written;
+    for (int i = 0; i < iovcnt; ++i)
+    {
+        const char *base = (const char *)iov[i].iov_base;
+        if (skip >= iov[i].iov_len)
+        {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        pending.insert(pending.end(), base + skip, base + iov[i].iov_len);
+        skip = 0;
+    }
+
+    conn.queuedBytes += pending.size();
+    conn.sendQueue.push_back(std::move(pending));
+
+    setWritableInterest(conn, true);
+    return true;
+}
+
+void NetManager::flushClient(Connection &conn)
+{
+    if (conn.closing)
+        return;
+
+    while (!conn.sendQueue.empty())
+    {
+        // Gather as much of the queue as one sendmsg() can take
+        struct iovec iov[maxFlushBuffers];
+        int iovcnt = 0;
+        for (auto pending = conn.sendQueue.begin(); pending != conn.sendQueue.end() && iovcnt < (int)maxFlushBuffers;
+                ++pending)
+        {
+            const size_t offset = iovcnt == 0 ? conn.sendOffset : 0;
+            iov[iovcnt].iov_base = pending->data() + offset;
+            iov[iovcnt].iov_len = pending->size() - offset;
+            ++iovcnt;
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof msg);
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+
+        ssize_t r = sendmsg(conn.fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (r == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+
+            logErrno(LogError, "send");
+            counters.sendErrors.add();
+            dropClient(conn);
+            return;
+        }
+
+        // Drop what went out, a partly sent buffer stays at the front with an offset
+        conn.queuedBytes -= r;
+        counters.tcpBytesOut.add(r);
+        size_t sent = r;
+        while (sent > 0)
+        {
+            const size_t left = conn.sendQueue.front().size() - conn.sendOffset;
+            if (sent < left)
+            {
+                conn.sendOffset += sent;
+                break;
+            }
+            sent -= left;
+            conn.sendQueue.pop_front();
+            conn.sendOffset = 0;
+        }
+    }
+
+    setWritableInterest(conn, !conn.sendQueue.empty());
+}
+
+void NetManager::setWritableInterest(Connection &conn, bool writable)
+{
+    const uint32_t slot = ConnectionTable::slotOf(conn.id);
+
+    if (conn.writeArmed == writable)
+        return;
+
+#ifdef HAVE_LINUX_IO_URING_H
+    if (backend == IoUringBackend)
+    {
+        // A one-shot poll, there is no way to take it back so it just completes with nothing to do
+        if (writable && armPoll(conn.fd, ClientWritableEvent, slot, POLLOUT, false))
+            conn.writeArmed = true;
+        return;
+    }
+#endif
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof ev);
+    ev.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+    if (writable)
+        ev.events |= EPOLLOUT;
+    ev.data.u64 = makeEventTag(ClientEvent, slot);
+
+    if (epoll_ctl(epollFd, EPOLL_CTL_MOD, conn.fd, &ev) == -1)
+    {
+        nerror("couldn't change socket epoll interest");
+        return;
+    }
+    conn.writeArmed = writable;
+}
+
+void NetManager::disconnect(ConnectionId connection)
+{
+    Connection *conn = clients.find(connection);
+    if (conn != nullptr)
+        dropClient(*conn);
+}
+
+bool NetManager::submit(ConnectionId connection, std::function<void()> work, std::function<void()> done)
+{
+    Connection *conn = clients.find(connection);
+    if (workerPool == nullptr || conn == nullptr || conn->closing)
+        return false;
+
+    if (conn->strand == nullptr)
+        conn->strand = new WorkerPool::Strand;
+
+    WorkerPool::Task *task;
+    if (freeTasks.empty())
+        task = new WorkerPool::Task;
+    else
+    {
+        task = freeTasks.back();
+        freeTasks.pop_back();
+    }
+
+    task->work = std::move(work);
+    task->done = std::move(done);
+    task->strand = conn->strand;
+    task->completions = &completions;
+
+    counters.tasksPending.add();
+    workerPool->submit(task);
+    return true;
+}
+
+// Call done for everything the pool has finished since last time
+void NetManager::runCompletions()
+{
+    if (!completions.takeWakeup())
+        return;
+
+    WorkerPool::Task *task;
+    while ((task = completions.pop()) != nullptr)
+    {
+        // The strand may be gone by now, don't touch it
+        counters.tasksPending.sub();
+
+        // done may submit more, so put the record back first
+        std::function<void()> done = std::move(task->done);
+        task->work = nullptr;
+        task->done = nullptr;
+        freeTasks.push_back(task);
+
+        if (done)
+            done();
+    }
+}
+
+void NetManager::dropClient(Connection &conn)
+{
+    if (conn.closing)
+        return;
+
+    // The socket is closed once process() is done with this pass, and anything io_uring still has
+    // in flight for it has finished; shutting it down now makes those requests complete
+    conn.closing = true;
+    shutdown(conn.fd, SHUT_RDWR);
+    closingClients.push_back(&conn);
+    timeouts.cancel(conn.timeout);
+    unlinkDatagrams(conn.id);
+}
+
+void NetManager::armTimeout(Connection &conn)
+{
+    uint64_t deadline = 0;
+    if (!conn.handshaken && handshakeTimeout != 0)
+        deadline = conn.connected + handshakeTimeout;
+    if (idleTimeout != 0 && (deadline == 0 || conn.lastReceived + idleTimeout < deadline))
+        deadline = conn.lastReceived + idleTimeout;
+    if (keepaliveInterval != 0 && !conn.probed && (deadline == 0 || conn.lastReceived + keepaliveInterval < deadline))
+        deadline = conn.lastReceived + keepaliveInterval;
+    if (deadline == 0)
+        return;
+
+    conn.timeout.data = conn.id;
+    timeouts.arm(conn.timeout, deadline);
+
+    // The wheel only needs turning while something is on it
+    if (timeoutTimer == 0)
+        timeoutTimer = addRepeatingTimer(timeoutTick, [this](uint64_t) { expireTimeouts(); });
+}
+
+void NetManager::expireTimeouts()
+{
+    timeouts.advance(now(), [this](TimingWheel::Entry &entry)
+    {
+        Connection *conn = clients.find(entry.data);
+        if (conn != nullptr && !conn->closing)
+            connectionTimedOut(*conn);
+    });
+
+    if (timeouts.size() == 0)
+    {
+        cancelTimer(timeoutTimer);
+        timeoutTimer = 0;
+    }
+}
+
+void NetManager::connectionTimedOut(Connection &conn)
+{
+    const uint64_t current = now();
+
+    if (!conn.handshaken && handshakeTimeout != 0 && current >= conn.connected + handshakeTimeout)
+    {
+        logMessage(LogInfo, "socket {1} didn't say anything in time, disconnecting", conn.fd);
+        counters.handshakeTimeouts.add();
+        dropClient(conn);
+        return;
+    }
+
+    if (idleTimeout != 0 && current >= conn.lastReceived + idleTimeout)
+    {
+        logMessage(LogInfo, "socket {1} has gone quiet, disconnecting", conn.fd);
+        counters.idleTimeouts.add();
+        dropClient(conn);
+        return;
+    }
+
+    if (keepaliveInterval != 0 && !conn.probed && current >= conn.lastReceived + keepaliveInterval)
+    {
+        conn.probed = true;
+        counters.keepalives.add();
+        if (keepaliveCallback != nullptr)
+            keepaliveCallback(conn.id);
+        if (conn.closing)
+            return;
+    }
+
+    // Heard from since it was armed, or there is more to come
+    armTimeout(conn);
+}
+
+void NetManager::reapClients()
+{
+    size_t kept = 0;
+
+    for (size_t i = 0; i < closingClients.size(); ++i)
+    {
+        Connection *conn = closingClients[i];
+
+        // Wait for io_uring to let go of the descriptor and slot before they can be reused
+        if (backend == IoUringBackend && (conn->recvArmed || conn->writeArmed))
+        {
+            closingClients[kept++] = conn;
+            continue;
+        }
+
+        // Closing the descriptor also removes it from the epoll set
+        const ConnectionId id = conn->id;
+        close(conn->fd);
+        returnBuffer(*conn);
+
+        // Work still queued for the connection keeps its strand until it has run
+        if (conn->strand != nullptr)
+            WorkerPool::release(conn->strand);
+
+        clients.remove(conn);
+        counters.disconnects.add();
+        counters.connections.sub();
+        if (capture != nullptr)
+            capture->recordDisconnect(wakeTime, id);
+
+        if (disconnectCallback != nullptr)
+            disconnectCallback(id);
+    }
+
+    closingClients.resize(kept);
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+bool NetManager::processUring(int timeoutMs)
+{
+    // Push out the re-arms queued last time and wait for something to complete
+    const uint64_t waitStart = now();
+    const int waited = uring->submitAndWait(timeoutMs);
+    wakeTime = now();
+    counters.waitUsec.add(wakeTime - waitStart);
+
+    if (waited == -1)
+    {
+        // A signal arrived, let the caller decide what to do
+        if (errno == EINTR)
+            return true;
+
+        logErrno(LogError, "io_uring_enter");
+        return false;
+    }
+    uint64_t completions = 0;
+
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring->peekCqe()) != nullptr)
+    {
+        handleCompletion(cqe);
+        uring->seenCqe();
+        ++completions;
+    }
+
+    runCompletions();
+    reapClients();
+
+    // New clients and finished multishots queued submissions, don't make them wait for the next tick
+    uring->submit();
+
+    if (completions > 0)
+        recordLoad(completions, wakeTime);
+
+    return true;
+}
+
+void NetManager::handleCompletion(const struct io_uring_cqe *cqe)
+{
+    const uint32_t id = eventTagId(cqe->user_data);
+    const bool more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+
+    switch (eventTagType(cqe->user_data))
+    {
+    case TcpListenerEvent:
+        if (cqe->res >= 0)
+        {
+            struct sockaddr_storage remoteIP;
+            socklen_t remoteIPLen = sizeof remoteIP;
+
+            // Multishot accept doesn't hand back the peer address
+            const bool named = getpeername(cqe->res, (struct sockaddr *)&remoteIP, &remoteIPLen) == 0;
+            if (named)
+                unmapAddress(remoteIP);
+
+            if (!named)
+            {
+                logErrno(LogError, "getpeername");
+                close(cqe->res);
+            }
+            else if (isBanned(PeerAddress(remoteIP)))
+            {
+                close(cqe->res);
+                counters.acceptsBanned.add();
+            }
+            else if (!connectionLimiter.allow(PeerAddress(remoteIP), wakeTime))
+            {
+                close(cqe->res);
+                counters.acceptsLimited.add();
+            }
+            else
+                addClient(cqe->res, remoteIP);
+        }
+        else if (cqe->res != -EAGAIN && cqe->res != -ECONNABORTED)
+        {
+            errno = -cqe->res;
+            logErrno(LogError, "accept");
+        }
+
+        if (!more && cqe->res != -EBADF && cqe->res != -EINVAL && cqe->res != -ECANCELED)
+            armAccept(id);
+        break;
+
+    case UdpSocketEvent:
+        if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER))
+        {
+            const uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            char *data = uring->getBuffer(udpBufferGroup, bid);
+            const struct io_uring_recvmsg_out *out = (const struct io_uring_recvmsg_out *)data;
+
+            const size_t payloadOffset = sizeof *out + recvmsgTemplate.msg_namelen + recvmsgTemplate.msg_controllen;
+            if ((size_t)cqe->res >= payloadOffset && !(out->flags & MSG_TRUNC) &&
+                    out->namelen <= sizeof(struct sockaddr_storage))
+            {
+                struct sockaddr_storage from;
+                memcpy(&from, data + sizeof *out, out->namelen);
+                unmapAddress(from);
+
+                const PeerAddress peer(from);
+                if (isBanned(peer))
+                    counters.datagramsBanned.add();
+                else if (!packetLimiter.allow(peer, wakeTime))
+                    counters.packetsLimited.add();
+                else
+                    receivedDatagram(data + payloadOffset, out->payloadlen, from, peer);
+            }
+
+            uring->recycleBuffer(udpBufferGroup, bid);
+        }
+        else if (cqe->res < 0 && cqe->res != -ENOBUFS)
+        {
+            errno = -cqe->res;
+            logErrno(LogError, "recvmsg");
+            counters.recvErrors.add();
+        }
+
+        if (!more && cqe->res != -EBADF && cqe->res != -EINVAL && cqe->res != -ECANCELED)
+            armRecvmsg(id);
+        break;
+
+    case ClientEvent:
+    {
+        const uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+
+        // The slot isn't freed while a request for it is in flight
+        Connection &conn = *clients.slot(id);
+        if (!more)
+            conn.recvArmed = false;
+
+        if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER))
+        {
+            const char *data = uring->getBuffer(tcpBufferGroup, bid);
+            size_t length = cqe->res;
+            counters.tcpBytesIn.add(length);
+            if (capture != nullptr)
+                capture->recordTcpData(wakeTime, conn.id, data, length);
+
+            // Feed the data through the connection's ring, a message never exceeds its capacity so
+            // each pass makes room for the next; if one doesn't, drop the connection rather than spin
+            bool open = !conn.closing && borrowBuffer(conn);
+            while (open && length > 0)
+            {
+                const size_t written = conn.ring.write(data, length);
+                if (written == 0)
+                {
+                    logMessage(LogError, "socket {1} has a message its receive buffer can't hold, disconnecting", conn.fd);
+                    dropClient(conn);
+                    open = false;
+                    break;
+                }
+                data += written;
+                length -= written;
+                open = frameMessages(conn);
+            }
+            uring->recycleBuffer(tcpBufferGroup, bid);
+            returnBuffer(conn);
+
+            if (open && !more)
+                armRecv(conn);
+        }
+        else if (cqe->res == -ENOBUFS)
+        {
+            // Every provided buffer was in use, the multishot stopped
+            if (!conn.closing)
+                armRecv(conn);
+        }
+        else if (!conn.closing)
+        {
+            if (cqe->res == 0)
+                logMessage(LogInfo, "socket {1} has disconnected", conn.fd);
+            else
+            {
+                errno = -cqe->res;
+                logErrno(LogError, "recv");
+                counters.recvErrors.add();
+            }
+
+            dropClient(conn);
+        }
+        break;
+    }
+
+    case ClientWritableEvent:
+    {
+        Connection &conn = *clients.slot(id);
+        conn.writeArmed = false;
+        flushClient(conn);
+        break;
+    }
+
+    case TimerEvent:
+    case WakeupEvent:
+        if (cqe->res >= 0)
+        {
+            if (eventTagType(cqe->user_data) == TimerEvent)
+            {
+                drainFd(timerFd);
+                runTimers();
+            }
+            else
+                drainFd(wakeupFd);
+        }
+
+        if (!more && cqe->res != -EBADF && cqe->res != -ECANCELED)
+            armPoll(eventTagType(cqe->user_data) == TimerEvent ? timerFd : wakeupFd, eventTagType(cqe->user_data), 0, POLLIN, true);
+        break;
+    }
+}
+
+bool NetManager::armAccept(uint32_t listener)
+{
+    struct io_uring_sqe *sqe = uring->getSqe();
+    if (sqe == nullptr)
+    {
+        logMessage(LogError, "io_uring submission queue is full");
+        return false;
+    }
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = tcpListeners[listener];
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = makeEventTag(TcpListenerEvent, listener);
+
+    return true;
+}
+
+bool NetManager::armRecv(Connection &conn)
+{
+    struct io_uring_sqe *sqe = uring->getSqe();
+    if (sqe == nullptr)
+    {
+        logMessage(LogError, "io_uring submission queue is full");
+        return false;
+    }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn.fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = tcpBufferGroup;
+    sqe->user_data = makeEventTag(ClientEvent, ConnectionTable::slotOf(conn.id));
+    conn.recvArmed = true;
+
+    return true;
+}
+
+bool NetManager::armRecvmsg(uint32_t udpSocket)
+{
+    struct io_uring_sqe *sqe = uring->getSqe();
+    if (sqe == nullptr)
+    {
+        logMessage(LogError, "io_uring submission queue is full");
+        return false;
+    }
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = udpSockets[udpSocket];
+    sqe->addr = (uint64_t)(uintptr_t)&recvmsgTemplate;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = udpBufferGroup;
+    sqe->user_data = makeEventTag(UdpSocketEvent, udpSocket);
+
+    return true;
+}
+
+bool NetManager::armPoll(int fd, EventType type, uint32_t id, uint32_t events, bool multishot)
+{
+    struct io_uring_sqe *sqe = uring->getSqe();
+    if (sqe == nullptr)
+    {
+        logMessage(LogError, "io_uring submission queue is full");
+        return false;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+    sqe->user_data = makeEventTag(type, id);
+
+    return true;
+}
+#endif
+
+bool NetManager::startCapture(const char *path)
+{
+    stopCapture();
+
+    capture = new CaptureWriter;
+    if (!capture->open(path))
+    {
+        delete capture;
+        capture = nullptr;
+        return false;
+    }
+
+    return true;
+}
+
+void NetManager::stopCapture()
+{
+    delete capture;
+    capture = nullptr;
+}
+
+void NetManager::setListenBacklog(int backlog)
+{
+    listenBacklog = backlog;
+}
+
+void NetManager::setDeferAccept(int seconds)
+{
+    deferAcceptSecs = seconds;
+}
+
+void NetManager::setHandshakeTimeout(uint64_t handshakeUsec)
+{
+    handshakeTimeout = handshakeUsec;
+}
+
+void NetManager::setIdleTimeout(uint64_t idleUsec)
+{
+    idleTimeout = idleUsec;
+}
+
+void NetManager::setKeepalive(uint64_t keepaliveUsec, std::function<void(ConnectionId)> callback)
+{
+    keepaliveInterval = keepaliveUsec;
+    keepaliveCallback = callback;
+}
+
+void NetManager::setAcceptBudget(unsigned count)
+{
+    acceptBudget = count > 0 ? count : 1;
+}
+
+void NetManager::setConnectionRateLimit(double perSecond, unsigned burst)
+{
+    connectionLimiter.setLimit(perSecond, burst);
+}
+
+void NetManager::setPacketRateLimit(double perSecond, unsigned burst)
+{
+    packetLimiter.setLimit(perSecond, burst);
+}
+
+bool NetManager::setBanList(BanList *list)
+{
+    const int reader = list->addReader();
+    if (reader == -1)
+    {
+        logMessage(LogError, "too many event loops reading one ban list");
+        return false;
+    }
+
+    banList = list;
+    banReader = reader;
+    return true;
+}
+
+void NetManager::setRateLimitTable(size_t sources, int ipv6PrefixBits)
+{
+    connectionLimiter.setTable(sources, ipv6PrefixBits);
+    packetLimiter.setTable(sources, ipv6PrefixBits);
+}
+
+void NetManager::setSendQueueLimit(size_t bytes)
+{
+    sendQueueLimit = bytes;
+}
+
+void NetManager::setDisconnectCallback(std::function<void(ConnectionId)> callback)
+{
+    disconnectCallback = callback;
+}
+
+bool NetManager::setMaxMessageLength(uint16_t length)
+{
+    // The rings are sized for the longest message, and can't change once they are handed out
+    if (!recvBuffers.setBufferSize(ringSizeFor(length)))
+    {
+        logMessage(LogError, "can't change the message length limit once connections have buffers");
+        return false;
+    }
+
+    maxMessageLength = length;
+    frameBuffer.resize(maxMessageLength);
+    return true;
+}
+
+void NetManager::setHugePages(bool enable)
+{
+    recvBuffers.setHugePages(enable);
+}
+
+void NetManager::addAcceptCallback(std::function<void(struct sockaddr *, ConnectionId)> callback)
+{
+    acceptCallbacks.push_back(callback);
+}
+
+void NetManager::setMessageReceivedCallback(std::function<void(const Message &)> callback)
 {
     messageReceivedCallback = callback;
 }
 
+void NetManager::setWorkerPool(WorkerPool *pool)
+{
+    workerPool = pool;
+}
+
+void NetManager::setPooledMessageCallback(std::function<std::function<void()>(const Message &)> callback)
+{
+    pooledMessageCallback = callback;
+}
+
+void NetManager::setDatagramReceivedCallback(std::function<void(const char *, size_t, const struct sockaddr_storage &)> callback)
+{
+    datagramReceivedCallback = callback;
+}
+
+void NetManager::setDatagramLinkHandler(std::function<ConnectionId(const char *, size_t, const struct sockaddr_storage &)> handler)
+{
+    datagramLinkHandler = handler;
+}
+
+void NetManager::setLinkedDatagramCallback(std::function<void(ConnectionId, const char *, size_t, const struct sockaddr_storage &)> callback)
+{
+    linkedDatagramCallback = callback;
+}
+
+bool NetManager::linkDatagrams(ConnectionId connection, const struct sockaddr_storage &source)
+{
+    Connection *conn = clients.find(connection);
+    if (conn == nullptr || conn->closing)
+        return false;
+
+    const PeerAddress peer(source);
+    if (!peer.valid())
+        return false;
+
+    // Take the source from whoever had it, and let go of the connection's old one
+    ConnectionId &owner = datagramLinks[peer];
+    if (owner != 0 && owner != connection)
+    {
+        Connection *previous = clients.find(owner);
+        if (previous != nullptr)
+            previous->datagramSource = PeerAddress();
+    }
+    owner = connection;
+
+    if (conn->datagramSource.valid() && conn->datagramSource != peer)
+        datagramLinks.erase(conn->datagramSource);
+    conn->datagramSource = peer;
+    return true;
+}
+
+void NetManager::unlinkDatagrams(ConnectionId connection)
+{
+    Connection *conn = clients.find(connection);
+    if (conn == nullptr || !conn->datagramSource.valid())
+        return;
+
+    datagramLinks.erase(conn->datagramSource);
+    conn->datagramSource = PeerAddress();
+}
+
 
 /* Local Variables: ***
  * mode: C++ ***
@@ -16,38 +16,495 @@
 /* common header */
 #include "common.h"
 
-#include <poll.h>
+#include <sys/epoll.h>
+#include <stdint.h>
+#include <atomic>
 #include <vector>
+#include <unordered_map>
 #include <functional>
 
+#include <sys/socket.h>
+
+#include "BufferPool.h"
+#include "ConnectionTable.h"
+#include "Metrics.h"
+#include "PeerMap.h"
+#include "RateLimiter.h"
+#include "TimingWheel.h"
+#include "WorkerPool.h"
+
+class BanList;
+class CaptureWriter;
+
+#ifdef HAVE_LINUX_IO_URING_H
+class IoUring;
+struct io_uring_cqe;
+#endif
+
 class NetManager {
     public:
-        NetManager(const char* port);
+        // Which kernel interface drives the event loop
+        enum Backend
+        {
+            EpollBackend,
+            IoUringBackend
+        };
+
+        // io_uring falls back to epoll if the kernel or build doesn't support it
+        NetManager(const char* port, Backend backend = EpollBackend);
         ~NetManager();
 
+        Backend getBackend() const;
+
+        // Bind with SO_REUSEPORT so several NetManagers can share a port, must be set before bind()
+        void setReusePort(bool enable);
+
+        // Pick the member of each SO_REUSEPORT group from the source address alone, rather than
+        // the kernel's hash of address and port, for groups of groupSize NetManagers that bind the
+        // same addresses in the same order.  A host's TCP connection and its UDP datagrams then
+        // land on the same NetManager, which datagram links need once there is more than one,
+        // at the price of every connection from one address sharing a NetManager.  Set before bind().
+        void setSourceSteering(unsigned groupSize);
+
+        // Bind IPv6 sockets with IPV6_V6ONLY off, so one "::" listener and UDP socket also take
+        // IPv4 peers and a NetManager needs half the sockets.  IPv4 peers arrive as v4-mapped
+        // addresses and are handed to ban checks, limits and callbacks as plain IPv4 ones; IPv4
+        // destinations go out through the IPv6 socket.  Set before bind(), and bind only "::".
+        void setDualStack(bool enable);
+
+        // Listener options, set before bind().  The backlog is capped by net.core.somaxconn.  With
+        // a defer time set, the kernel holds on to a connection until the client sends data (or
+        // the time runs out), so connects that never say anything don't cost a wakeup.
+        void setListenBacklog(int backlog);
+        void setDeferAccept(int seconds);
+
+        // Most connections accepted from one listener per pass of process(), so a connect storm
+        // can't starve everything else.  io_uring accepts in the kernel, so it only applies to epoll.
+        void setAcceptBudget(unsigned count);
+
+        // Token bucket limits per source, checked before anything else sees a new connection,
+        // datagram or message: a source may connect, or send, perSecond times a second on average
+        // and burst times at once.  A datagram over the limit is dropped and a connection sending
+        // messages over it is closed.  Sources are IPv4 addresses, and IPv6 addresses cut down to
+        // their first ipv6PrefixBits (64 by default).  Each limit tracks up to sources peers, the
+        // one seen longest ago making way for a new one.  Off unless set, set before bind().
+        void setConnectionRateLimit(double perSecond, unsigned burst);
+        void setPacketRateLimit(double perSecond, unsigned burst);
+        void setRateLimitTable(size_t sources, int ipv6PrefixBits);
+
+        // Close connections from banned addresses as soon as they are accepted and drop their
+        // datagrams, before any callback or log line.  One list can be shared by every NetManager,
+        // it has to outlive them.  Set before bind().
+        bool setBanList(BanList *list);
+
+        // Work done by process() so far, safe to read from any thread.  Everything counts up from
+        // when the NetManager was created, except connections which is the current number.
+        struct Stats
+        {
+            uint64_t wakeups;
+            uint64_t events;
+            uint64_t busyUsec;
+            uint64_t waitUsec;
+
+            uint64_t accepts;
+            uint64_t disconnects;
+            uint64_t connections;
+
+            uint64_t tcpBytesIn;
+            uint64_t tcpBytesOut;
+            uint64_t tcpMessagesIn;
+            uint64_t tcpMessagesOut;
+
+            uint64_t udpBytesIn;
+            uint64_t udpBytesOut;
+            uint64_t udpDatagramsIn;
+            uint64_t udpDatagramsOut;
+
+            uint64_t recvErrors;
+            uint64_t sendErrors;
+
+            // Turned away by the rate limits
+            uint64_t acceptsLimited;
+            uint64_t packetsLimited;
+
+            // Turned away by the ban list
+            uint64_t acceptsBanned;
+            uint64_t datagramsBanned;
+
+            // Dropped for coming from a UDP source that isn't linked to a connection
+            uint64_t datagramsUnlinked;
+
+            // Closed, or probed, by the connection timeouts
+            uint64_t handshakeTimeouts;
+            uint64_t idleTimeouts;
+            uint64_t keepalives;
+
+            // Handed to the worker pool and not back yet
+            uint64_t tasksPending;
+        };
+        Stats getStats() const;
+
+        // Connections only hold a receive buffer while they have part of a message waiting, the
+        // rest of the time it goes back to a pool shared by every connection
+        struct BufferUsage
+        {
+            uint64_t bufferSize;
+            uint64_t inUse;
+            uint64_t highWater;
+            uint64_t reserved;
+        };
+        BufferUsage getBufferUsage() const;
+
+        // Back the receive buffer pool with huge pages, set before bind()
+        void setHugePages(bool enable);
+
         // Bind to a new IP
         bool bind(const char* address);
 
-        // Process network events
-        bool process();
+        // Record every accepted connection, TCP read, datagram and disconnect into a capture file
+        // for the replay tool.  Call from the thread running process(), or before it runs.
+        bool startCapture(const char *path);
+        void stopCapture();
+
+        // Process network events and due timers, waiting at most timeoutMs (forever if -1) for something to happen
+        bool process(int timeoutMs = -1);
+
+        // Make a process() call blocked on another thread return, safe to call from any thread
+        void wakeup();
+
+        // Monotonic clock in microseconds, the time base for timers
+        static uint64_t now();
+
+        // Timers run from process() on the thread calling it.  A repeating timer fires on a fixed
+        // grid of deadlines (first + n * period), so late wakeups never make it drift; if it falls
+        // more than a period behind, the missed deadlines are skipped.  The callback gets the
+        // deadline it was scheduled for.
+        typedef uint64_t TimerId;
+        TimerId addTimer(uint64_t delayUsec, std::function<void(uint64_t)> callback);
+        TimerId addRepeatingTimer(uint64_t periodUsec, std::function<void(uint64_t)> callback);
+        bool cancelTimer(TimerId id);
 
         static void * get_in_addr(struct sockaddr *sa);
 
-        void addAcceptCallback(std::function<void(struct sockaddr *, int)> callback);
-        void setMessageReceivedCallback(std::function<void(const char *)> callback);
+        // Identifies a client connection in callbacks.  Unlike the descriptor it isn't handed to the
+        // next connection, so one kept after its connection is gone just doesn't match anything.
+        typedef uint64_t ConnectionId;
+
+        void addAcceptCallback(std::function<void(struct sockaddr *, ConnectionId)> callback);
+
+        // Take over a connected stream socket that didn't come from one of our listeners, such as
+        // one end of a socketpair().  Accept callbacks are called for it as usual.  Returns 0, and
+        // closes the socket, if it can't be watched.
+        ConnectionId adoptConnection(int fd);
+
+        // One whole BZFlag message read from a connection, without its 4 byte length/code header.
+        // The payload points into NetManager's own buffers and is only valid until the callback
+        // returns, so parse it in place or copy what you need to keep.
+        struct Message
+        {
+            ConnectionId connection;
+            uint16_t code;
+            const char *data;
+            size_t length;
+
+            // now() when the data was picked up
+            uint64_t received;
+        };
+        void setMessageReceivedCallback(std::function<void(const Message &)> callback);
+
+        // Hand work too slow for the event loop to a pool of threads.  Work submitted for a
+        // connection runs in order, one task at a time, while other connections' work runs in
+        // parallel; done is then called on the thread running process(), even if the connection
+        // is gone by then.  Set the pool before bind(), it has to outlive the NetManager.
+        void setWorkerPool(WorkerPool *pool);
+        bool submit(ConnectionId connection, std::function<void()> work, std::function<void()> done = nullptr);
+
+        // Handle messages on the worker pool instead of in process(), taking over from the message
+        // received callback.  The callback gets a copy of the message, on a pool thread, and what
+        // it returns is called on the thread running process() (the place to send replies from)
+        // while the copy is still valid.
+        void setPooledMessageCallback(std::function<std::function<void()>(const Message &)> callback);
+
+        // Connections sending a message with a bigger payload than this are dropped.  Set before
+        // the first connection: once receive buffers exist it returns false unless they already fit.
+        bool setMaxMessageLength(uint16_t length);
+
+        // Send on a connection without blocking.  Whatever the socket doesn't take right away is
+        // queued and written out as it drains; a connection whose queue grows past the limit is
+        // dropped.  Returns false if the connection is gone or was just dropped.
+        bool send(ConnectionId connection, const char *data, size_t length);
+        bool sendMessage(ConnectionId connection, uint16_t code, const char *data, size_t length);
+        void setSendQueueLimit(size_t bytes);
+
+        // Close a connection once the current pass of process() is done with it
+        void disconnect(ConnectionId connection);
+
+        // Called once a connection is gone, whoever closed it
+        void setDisconnectCallback(std::function<void(ConnectionId)> callback);
+
+        // Connection timeouts in microseconds, 0 for none (the default).  A connection is closed if
+        // its first message hasn't arrived handshakeUsec after it was accepted, or nothing has
+        // arrived for idleUsec.  Once nothing has arrived for keepaliveUsec, callback is called
+        // (once until the peer is heard from again) to send something it has to answer.  They are
+        // kept on a timing wheel ticking every 100ms, so they go off up to a tick late.  Set
+        // before bind().
+        void setHandshakeTimeout(uint64_t handshakeUsec);
+        void setIdleTimeout(uint64_t idleUsec);
+        void setKeepalive(uint64_t keepaliveUsec, std::function<void(ConnectionId)> callback);
+
+        // Called once per UDP datagram with its payload and sender, the data is only valid during the call
+        void setDatagramReceivedCallback(std::function<void(const char *, size_t, const struct sockaddr_storage &)> callback);
+
+        // Tie UDP sources to connections, for clients that send datagrams alongside their TCP
+        // session.  Once a link handler is set, a datagram from a source no connection is linked to
+        // goes only to the handler, which checks the link handshake it carries and returns the
+        // connection to link the source to, or 0 to drop it.  Datagrams from linked sources go to
+        // the linked callback with their connection, looked up by address and port, and everything
+        // else is dropped before any callback.  A connection has one source, linking again moves
+        // it, and the link goes when the connection does.  Links are per NetManager, so several
+        // sharing a port need setSourceSteering() (NetShards sets it).  Set before bind().
+        void setDatagramLinkHandler(std::function<ConnectionId(const char *, size_t, const struct sockaddr_storage &)> handler);
+        void setLinkedDatagramCallback(std::function<void(ConnectionId, const char *, size_t, const struct sockaddr_storage &)> callback);
+
+        // Link a source without a handshake datagram, false if the connection is gone
+        bool linkDatagrams(ConnectionId connection, const struct sockaddr_storage &source);
+        void unlinkDatagrams(ConnectionId connection);
+
+        // A datagram to send, the data and destination only need to live until the send call returns
+        struct Datagram
+        {
+            const char *data;
+            size_t length;
+            const struct sockaddr_storage *destination;
+        };
+
+        // Send datagrams through the UDP socket bound for each destination's address family, batching
+        // them into as few sendmmsg() calls as possible.  Returns how many were handed to the kernel;
+        // anything short of count stopped at that index with errno set, EAGAIN meaning the socket
+        // buffer is full and the rest can be retried later.
+        int sendDatagrams(const Datagram *datagrams, int count);
+
+        // Send the same payload to many destinations, with the same return value as sendDatagrams()
+        int broadcastDatagram(const char *data, size_t length, const struct sockaddr_storage *destinations, int count);
+
+        // Send length bytes to one peer cut into segmentSize datagrams (the last may be shorter).
+        // Uses a single UDP_SEGMENT (GSO) send where the kernel supports it, and falls back to
+        // sendDatagrams() otherwise.  Returns how many segments were sent.
+        int sendDatagramTrain(const char *data, size_t length, size_t segmentSize, const struct sockaddr_storage &destination);
     private:
+        // What the user data of an epoll event refers to
+        enum EventType
+        {
+            TcpListenerEvent = 1,
+            UdpSocketEvent,
+            ClientEvent,
+            TimerEvent,
+            WakeupEvent,
+            ClientWritableEvent
+        };
+
+        // Pack/unpack the event type and an id (listener index or connection slot) into epoll user data
+        static uint64_t makeEventTag(EventType type, uint32_t id);
+        static EventType eventTagType(uint64_t tag);
+        static uint32_t eventTagId(uint64_t tag);
+
+        void recordLoad(uint64_t events, uint64_t since);
+        bool processEpoll(int timeoutMs);
+        bool isBanned(const PeerAddress &peer);
+
+        bool watch(int fd, EventType type, uint32_t id);
+        void acceptClients(uint32_t listener);
+        ConnectionId addClient(int cs, struct sockaddr_storage &remoteIP);
+        bool borrowBuffer(Connection &conn);
+        void returnBuffer(Connection &conn);
+        void readClient(Connection &conn, bool hungUp);
+        void readRing(Connection &conn, bool hungUp);
+        bool frameMessages(Connection &conn);
+        void deliver(Connection &conn, uint16_t code, const char *data, size_t length);
+        void readUdp(int fd);
+        void receivedDatagram(const char *data, size_t length, const struct sockaddr_storage &from, const PeerAddress &peer);
+        int udpSocketFor(int family, bool &mapped) const;
+
+        // Most datagrams put in one sendmmsg() call
+        static const unsigned sendBatchSize = 64;
+        bool queueSend(ConnectionId connection, const struct iovec *iov, int iovcnt);
+        void flushClient(Connection &conn);
+        void setWritableInterest(Connection &conn, bool writable);
+        void dropClient(Connection &conn);
+        void armTimeout(Connection &conn);
+        void expireTimeouts();
+        void connectionTimedOut(Connection &conn);
+        void reapClients();
+        void runCompletions();
+
+        // Most queued buffers handed to one sendmsg() when flushing
+        static const unsigned maxFlushBuffers = 64;
+
+        struct Timer
+        {
+            uint64_t period;
+            bool cancelled;
+            std::function<void(uint64_t)> callback;
+        };
+
+        // Min-heap entry, stale once its timer is cancelled
+        struct TimerDeadline
+        {
+            uint64_t deadline;
+            TimerId id;
+
+            bool operator<(const TimerDeadline &other) const
+            {
+                return deadline > other.deadline;
+            }
+        };
+
+        TimerId scheduleTimer(uint64_t deadline, uint64_t period, std::function<void(uint64_t)> callback);
+        void runTimers();
+        void armTimerFd();
+        static void drainFd(int fd);
+
+#ifdef HAVE_LINUX_IO_URING_H
+        // io_uring backend: everything is a multishot request completing into the ring
+        bool processUring(int timeoutMs);
+        void handleCompletion(const struct io_uring_cqe *cqe);
+        bool armAccept(uint32_t listener);
+        bool armRecv(Connection &conn);
+        bool armRecvmsg(uint32_t udpSocket);
+        bool armPoll(int fd, EventType type, uint32_t id, uint32_t events, bool multishot);
+
+        IoUring *uring;
+
+        // Shape of the datagrams multishot recvmsg writes into the provided buffers
+        struct msghdr recvmsgTemplate;
+#endif
+
         // Port to bind all interfaces on
         const char* port;
 
+        Backend backend;
+        bool reusePort;
+        unsigned steeringGroup;
+        bool dualStack;
+        int listenBacklog;
+        int deferAcceptSecs;
+        unsigned acceptBudget;
+
         // Socket descriptor information
-        int fd_count;
-        int fd_size;
-        int numInterfaces;
-        struct pollfd *fds;
+        int epollFd;
+        std::vector<int> tcpListeners;
+        std::vector<uint32_t> backloggedListeners;
+        std::vector<int> udpSockets;
+        std::vector<int> udpFamilies;
+        ConnectionTable clients;
+        RateLimiter connectionLimiter;
+        RateLimiter packetLimiter;
+
+        // Ban list, and whether this pass has gone online as one of its readers
+        BanList *banList;
+        int banReader;
+        bool banOnline;
+        std::vector<Connection *> closingClients;
+        size_t sendQueueLimit;
+
+        // Timer state: one timerfd armed for the earliest deadline, and an eventfd for wakeup()
+        int timerFd;
+        int wakeupFd;
+        uint64_t armedDeadline;
+        TimerId nextTimerId;
+        TimerId runningTimer;
+        std::unordered_map<TimerId, Timer> timers;
+        std::vector<TimerDeadline> timerQueue;
+
+        // Connection timeouts, one wheel entry per connection armed for the earliest of them.
+        // Traffic doesn't move it, it is checked and re-armed when it goes off.
+        uint64_t handshakeTimeout;
+        uint64_t idleTimeout;
+        uint64_t keepaliveInterval;
+        TimingWheel timeouts;
+        TimerId timeoutTimer;
+
+        // Connection each linked UDP source belongs to
+        PeerMap<ConnectionId> datagramLinks;
+
+        // Message framing: 16 bit length and 16 bit code ahead of every payload
+        static const size_t messageHeaderSize = 4;
+        uint16_t maxMessageLength;
+
+        // Receive ring size for a maximum message length
+        static size_t ringSizeFor(uint16_t length);
+
+        // Where a message that wraps around the end of a ring is put back together
+        std::vector<char> frameBuffer;
+
+        // Receive ring memory, lent to connections while they have partial messages
+        BufferPool recvBuffers;
+
+        // Time process() woke up, used to stamp everything read during that pass
+        uint64_t wakeTime;
+
+        // Cleared the first time the kernel turns down a UDP_SEGMENT send
+        bool udpGso;
+
+        // Traffic capture, null unless one was started
+        CaptureWriter *capture;
+
+        // Datagrams pulled from a UDP socket per recvmmsg() call
+        static const unsigned udpBatchSize = 32;
+        struct UdpBatch;
+        UdpBatch *udpBatch;
+
+        // Worker pool, if any.  Finished tasks come back through the completion queue, which
+        // wakes process() up, and their records are kept for the next submit().
+        WorkerPool *workerPool;
+        WorkerPool::CompletionQueue completions;
+        std::vector<WorkerPool::Task *> freeTasks;
+
+        // Only written by the thread running process()
+        struct Counters
+        {
+            Counter wakeups;
+            Counter events;
+            Counter busyUsec;
+            Counter waitUsec;
+            Counter accepts;
+            Counter disconnects;
+            Counter connections;
+            Counter tcpBytesIn;
+            Counter tcpBytesOut;
+            Counter tcpMessagesIn;
+            Counter tcpMessagesOut;
+            Counter udpBytesIn;
+            Counter udpBytesOut;
+            Counter udpDatagramsIn;
+            Counter udpDatagramsOut;
+            Counter recvErrors;
+            Counter sendErrors;
+            Counter acceptsLimited;
+            Counter packetsLimited;
+            Counter acceptsBanned;
+            Counter datagramsBanned;
+            Counter datagramsUnlinked;
+            Counter handshakeTimeouts;
+            Counter idleTimeouts;
+            Counter keepalives;
+            Counter tasksPending;
+        };
+        Counters counters;
+
+        // Events returned by a single epoll_wait
+        static const int maxEvents = 64;
+        struct epoll_event events[maxEvents];
 
         // Callbacks
-        std::vector<std::function<void(struct sockaddr *, int)>> acceptCallbacks;
-        std::function<void(const char *)> messageReceivedCallback;
+        std::vector<std::function<void(struct sockaddr *, ConnectionId)>> acceptCallbacks;
+        std::function<void(const Message &)> messageReceivedCallback;
+        std::function<void(const char *, size_t, const struct sockaddr_storage &)> datagramReceivedCallback;
+        std::function<ConnectionId(const char *, size_t, const struct sockaddr_storage &)> datagramLinkHandler;
+        std::function<void(ConnectionId, const char *, size_t, const struct sockaddr_storage &)> linkedDatagramCallback;
+        std::function<void(ConnectionId)> disconnectCallback;
+        std::function<std::function<void()>(const Message &)> pooledMessageCallback;
+        std::function<void(ConnectionId)> keepaliveCallback;
 
 #if defined(_WIN32)
         const BOOL optOn = TRUE;
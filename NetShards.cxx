@@ -0,0 +1,200 @@
+/* bzflag
+ * Copyright (c) 1993-2023 Tim Riker
+ *
+ * This package is free software;  you can redistribute it and/or
+ * modify it under the terms of the license found in the file
+ * named COPYING that should have accompanied this file.
+ *
+ * THIS PACKAGE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* interface header */
+#include "NetShards.h"
+
+#include <string>
+#include "Logger.h"
+
+#ifdef HAVE_SCHED_H
+#include <sched.h>
+#endif
+
+NetShards::NetShards(const char* port, int count, NetManager::Backend backend) : running(false)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        NetManager *shard = new NetManager(port, backend);
+        shard->setReusePort(true);
+        shards.push_back(shard);
+    }
+}
+
+NetShards::~NetShards()
+{
+    stop();
+
+    for (auto shard : shards)
+        delete shard;
+    shards.clear();
+}
+
+bool NetShards::bind(const char* address)
+{
+    for (auto shard : shards)
+    {
+        if (!shard->bind(address))
+            return false;
+    }
+
+    return true;
+}
+
+bool NetShards::startCapture(const char *path)
+{
+    // Each shard writes its own file, path.0, path.1, ...
+    for (size_t i = 0; i < shards.size(); ++i)
+    {
+        if (!shards[i]->startCapture((std::string(path) + "." + std::to_string(i)).c_str()))
+            return false;
+    }
+
+    return true;
+}
+
+bool NetShards::start()
+{
+    if (running)
+        return false;
+
+    // Hand out the cores we are allowed to run on, wrapping around if there are more shards than cores
+    std::vector<int> cpus;
+#ifdef HAVE_SCHED_SETAFFINITY
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof allowed, &allowed) == 0)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        {
+            if (CPU_ISSET(cpu, &allowed))
+                cpus.push_back(cpu);
+        }
+    }
+#endif
+
+    running = true;
+    for (int i = 0; i < (int)shards.size(); ++i)
+        threads.push_back(std::thread(&NetShards::run, this, i, cpus.empty() ? -1 : cpus[i % cpus.size()]));
+
+    return true;
+}
+
+void NetShards::stop()
+{
+    running = false;
+    for (auto shard : shards)
+        shard->wakeup();
+
+    for (auto &thread : threads)
+        thread.join();
+    threads.clear();
+}
+
+int NetShards::getShardCount() const
+{
+    return (int)shards.size();
+}
+
+NetManager &NetShards::getShard(int index)
+{
+    return *shards[index];
+}
+
+void NetShards::addAcceptCallback(std::function<void(struct sockaddr *, NetManager::ConnectionId)> callback)
+{
+    for (auto shard : shards)
+        shard->addAcceptCallback(callback);
+}
+
+void NetShards::setMessageReceivedCallback(std::function<void(const NetManager::Message &)> callback)
+{
+    for (auto shard : shards)
+        shard->setMessageReceivedCallback(callback);
+}
+
+void NetShards::setDatagramReceivedCallback(std::function<void(const char *, size_t, const struct sockaddr_storage &)> callback)
+{
+    for (auto shard : shards)
+        shard->setDatagramReceivedCallback(callback);
+}
+
+void NetShards::setDisconnectCallback(std::function<void(NetManager::ConnectionId)> callback)
+{
+    for (auto shard : shards)
+        shard->setDisconnectCallback(callback);
+}
+
+void NetShards::setDatagramLinkHandler(std::function<NetManager::ConnectionId(const char *, size_t, const struct sockaddr_storage &)> handler)
+{
+    for (auto shard : shards)
+    {
+        shard->setSourceSteering((unsigned)shards.size());
+        shard->setDatagramLinkHandler(handler);
+    }
+}
+
+void NetShards::setLinkedDatagramCallback(std::function<void(NetManager::ConnectionId, const char *, size_t, const struct sockaddr_storage &)> callback)
+{
+    for (auto shard : shards)
+    {
+        shard->setSourceSteering((unsigned)shards.size());
+        shard->setLinkedDatagramCallback(callback);
+    }
+}
+
+void NetShards::setWorkerPool(WorkerPool *pool)
+{
+    for (auto shard : shards)
+        shard->setWorkerPool(pool);
+}
+
+void NetShards::setPooledMessageCallback(std::function<std::function<void()>(const NetManager::Message &)> callback)
+{
+    for (auto shard : shards)
+        shard->setPooledMessageCallback(callback);
+}
+
+void NetShards::run(int index, int cpu)
+{
+#ifdef HAVE_SCHED_SETAFFINITY
+    if (cpu != -1)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+
+        // A pid of 0 means the calling thread
+        if (sched_setaffinity(0, sizeof set, &set) == -1)
+            logErrno(LogError, "sched_setaffinity");
+    }
+#else
+    (void)cpu;
+#endif
+
+    // stop() wakes every shard up, so process() can block until there is work
+    while (running.load(std::memory_order_relaxed))
+    {
+        if (!shards[index]->process())
+            break;
+    }
+}
+
+
+/* Local Variables: ***
+ * mode: C++ ***
+ * tab-width: 8 ***
+ * c-basic-offset: 2 ***
+ * indent-tabs-mode: t ***
+ * End: ***
+ * ex: shiftwidth=2 tabstop=8
+ */
@@ -0,0 +1,78 @@
+/* bzflag
+ * Copyright (c) 1993-2023 Tim Riker
+ *
+ * This package is free software;  you can redistribute it and/or
+ * modify it under the terms of the license found in the file
+ * named COPYING that should have accompanied this file.
+ *
+ * THIS PACKAGE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __NETSHARDS_H__
+#define __NETSHARDS_H__
+
+/* common header */
+#include "common.h"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <functional>
+
+#include "NetManager.h"
+
+// Runs several NetManagers, each on its own thread pinned to its own core.
+// Every shard binds its own sockets with SO_REUSEPORT, so the kernel spreads
+// incoming connections and datagrams across them.  Callbacks are called on
+// the thread of the shard that owns the socket.
+class NetShards {
+    public:
+        NetShards(const char* port, int count, NetManager::Backend backend = NetManager::EpollBackend);
+        ~NetShards();
+
+        // Bind every shard to a new IP
+        bool bind(const char* address);
+
+        // Capture each shard's traffic to path.<shard>, call before start()
+        bool startCapture(const char *path);
+
+        // Start and stop the shard threads
+        bool start();
+        void stop();
+
+        int getShardCount() const;
+        NetManager &getShard(int index);
+
+        void addAcceptCallback(std::function<void(struct sockaddr *, NetManager::ConnectionId)> callback);
+        void setMessageReceivedCallback(std::function<void(const NetManager::Message &)> callback);
+        void setDatagramReceivedCallback(std::function<void(const char *, size_t, const struct sockaddr_storage &)> callback);
+        void setDisconnectCallback(std::function<void(NetManager::ConnectionId)> callback);
+
+        // Datagram links as on a NetManager.  Both steer each SO_REUSEPORT group by source
+        // address, so the datagrams come in on the shard holding their connection, and the
+        // handler runs there.  Set before bind().
+        void setDatagramLinkHandler(std::function<NetManager::ConnectionId(const char *, size_t, const struct sockaddr_storage &)> handler);
+        void setLinkedDatagramCallback(std::function<void(NetManager::ConnectionId, const char *, size_t, const struct sockaddr_storage &)> callback);
+
+        // One pool shared by every shard, each shard gets its own completions back
+        void setWorkerPool(WorkerPool *pool);
+        void setPooledMessageCallback(std::function<std::function<void()>(const NetManager::Message &)> callback);
+    private:
+        void run(int index, int cpu);
+
+        std::vector<NetManager *> shards;
+        std::vector<std::thread> threads;
+        std::atomic<bool> running;
+};
+
+#endif
+
+// Local Variables: ***
+// mode: C++ ***
+// tab-width: 4 ***
+// c-basic-offset: 4 ***
+// indent-tabs-mode: nil ***
+// End: ***
+// ex: shiftwidth=4 tabstop=4
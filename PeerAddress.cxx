@@ -0,0 +1,176 @@
+/* bzflag
+ * Copyright (c) 1993-2023 Tim Riker
+ *
+ * This package is free software;  you can redistribute it and/or
+ * modify it under the terms of the license found in the file
+ * named COPYING that should have accompanied this file.
+ *
+ * THIS PACKAGE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* interface header */
+#include "PeerAddress.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+const size_t PeerAddress::formattedSize;
+
+static uint64_t rotate(uint64_t x, int bits)
+{
+    return (x << bits) | (x >> (64 - bits));
+}
+
+static void sipRound(uint64_t &v0, uint64_t &v1, uint64_t &v2, uint64_t &v3)
+{
+    v0 += v1; v1 = rotate(v1, 13); v1 ^= v0; v0 = rotate(v0, 32);
+    v2 += v3; v3 = rotate(v3, 16); v3 ^= v2;
+    v0 += v3; v3 = rotate(v3, 21); v3 ^= v0;
+    v2 += v1; v1 = rotate(v1, 17); v1 ^= v2; v2 = rotate(v2, 32);
+}
+
+static uint64_t loadBigEndian(const uint8_t *bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < 8; ++i)
+        value = (value << 8) | bytes[i];
+    return value;
+}
+
+PeerAddress::PeerAddress() : port(0)
+{
+    memset(bytes, 0, sizeof bytes);
+}
+
+PeerAddress::PeerAddress(const struct sockaddr_storage &address) : PeerAddress((const struct sockaddr *)&address)
+{
+}
+
+PeerAddress::PeerAddress(const struct sockaddr *address) : port(0)
+{
+    memset(bytes, 0, sizeof bytes);
+
+    if (address->sa_family == AF_INET)
+    {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)address;
+        bytes[10] = 0xff;
+        bytes[11] = 0xff;
+        memcpy(bytes + 12, &in->sin_addr, 4);
+        port = ntohs(in->sin_port);
+    }
+    else if (address->sa_family == AF_INET6)
+    {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)address;
+        memcpy(bytes, &in6->sin6_addr, sizeof bytes);
+        port = ntohs(in6->sin6_port);
+    }
+}
+
+bool PeerAddress::valid() const
+{
+    return high() != 0 || low() != 0;
+}
+
+bool PeerAddress::isIPv4() const
+{
+    return high() == 0 && (low() >> 32) == 0xffff;
+}
+
+uint64_t PeerAddress::high() const
+{
+    return loadBigEndian(bytes);
+}
+
+uint64_t PeerAddress::low() const
+{
+    return loadBigEndian(bytes + 8);
+}
+
+uint16_t PeerAddress::getPort() const
+{
+    return port;
+}
+
+void PeerAddress::toSockaddr(struct sockaddr_storage &address) const
+{
+    memset(&address, 0, sizeof address);
+
+    if (isIPv4())
+    {
+        struct sockaddr_in *in = (struct sockaddr_in *)&address;
+        in->sin_family = AF_INET;
+        in->sin_port = htons(port);
+        memcpy(&in->sin_addr, bytes + 12, 4);
+    }
+    else if (valid())
+    {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&address;
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(port);
+        memcpy(&in6->sin6_addr, bytes, sizeof bytes);
+    }
+}
+
+bool PeerAddress::operator==(const PeerAddress &other) const
+{
+    return port == other.port && memcmp(bytes, other.bytes, sizeof bytes) == 0;
+}
+
+bool PeerAddress::operator!=(const PeerAddress &other) const
+{
+    return !(*this == other);
+}
+
+uint64_t PeerAddress::hash(uint64_t k0, uint64_t k1) const
+{
+    uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+
+    // Three words in, the last one carrying the port and the length as SipHash pads it
+    const uint64_t words[3] = { high(), low(), (18ULL << 56) | port };
+    for (uint64_t word : words)
+    {
+        v3 ^= word;
+        sipRound(v0, v1, v2, v3);
+        v0 ^= word;
+    }
+
+    v2 ^= 0xff;
+    sipRound(v0, v1, v2, v3);
+    sipRound(v0, v1, v2, v3);
+    sipRound(v0, v1, v2, v3);
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+size_t PeerAddress::format(char *buffer, size_t size) const
+{
+    if (size == 0)
+        return 0;
+
+    char host[INET6_ADDRSTRLEN];
+    if (isIPv4())
+        inet_ntop(AF_INET, bytes + 12, host, sizeof host);
+    else
+        inet_ntop(AF_INET6, bytes, host, sizeof host);
+
+    int length = snprintf(buffer, size, isIPv4() ? "%s:%u" : "[%s]:%u", host, (unsigned)port);
+    if (length < 0)
+        length = 0;
+    return (size_t)length < size ? (size_t)length : size - 1;
+}
+
+
+/* Local Variables: ***
+ * mode: C++ ***
+ * tab-width: 8 ***
+ * c-basic-offset: 2 ***
+ * indent-tabs-mode: t ***
+ * End: ***
+ * ex: shiftwidth=2 tabstop=8
+ */
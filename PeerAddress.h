@@ -0,0 +1,69 @@
+/* bzflag
+ * Copyright (c) 1993-2023 Tim Riker
+ *
+ * This package is free software;  you can redistribute it and/or
+ * modify it under the terms of the license found in the file
+ * named COPYING that should have accompanied this file.
+ *
+ * THIS PACKAGE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __PEERADDRESS_H__
+#define __PEERADDRESS_H__
+
+/* common header */
+#include "common.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/socket.h>
+
+// An IPv4 or IPv6 address and port in 18 bytes, for keying per-peer state.
+// IPv4 addresses are kept in their v4-mapped form, so a peer compares and
+// hashes the same whichever kind of socket it came in on.  A default made
+// one, or one made from any other family, is all zero and not valid().
+class PeerAddress {
+    public:
+        PeerAddress();
+        explicit PeerAddress(const struct sockaddr_storage &address);
+        explicit PeerAddress(const struct sockaddr *address);
+
+        bool valid() const;
+        bool isIPv4() const;
+
+        // The address as two big-endian halves, IPv4 ones as ::ffff:a.b.c.d
+        uint64_t high() const;
+        uint64_t low() const;
+        uint16_t getPort() const;
+
+        // IPv4 ones as sockaddr_in, everything else as sockaddr_in6
+        void toSockaddr(struct sockaddr_storage &address) const;
+
+        bool operator==(const PeerAddress &other) const;
+        bool operator!=(const PeerAddress &other) const;
+
+        // SipHash-1-3 of the address and port under a 128 bit key, so peers can't pick addresses
+        // that collide in a table they don't know the key of
+        uint64_t hash(uint64_t k0, uint64_t k1) const;
+
+        // "192.0.2.1:5154" or "[2001:db8::1]:5154" into buffer, without allocating.  Returns the
+        // length, the text is cut short (and still terminated) if size is too small.
+        static const size_t formattedSize = 56;
+        size_t format(char *buffer, size_t size) const;
+    private:
+        uint8_t bytes[16];
+        uint16_t port;
+};
+
+#endif
+
+// Local Variables: ***
+// mode: C++ ***
+// tab-width: 4 ***
+// c-basic-offset: 4 ***
+// indent-tabs-mode: nil ***
+// End: ***
+// ex: shiftwidth=4 tabstop=4
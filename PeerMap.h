@@ -0,0 +1,201 @@
+/* bzflag
+ * Copyright (c) 1993-2023 Tim Riker
+ *
+ * This package is free software;  you can redistribute it and/or
+ * modify it under the terms of the license found in the file
+ * named COPYING that should have accompanied this file.
+ *
+ * THIS PACKAGE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __PEERMAP_H__
+#define __PEERMAP_H__
+
+/* common header */
+#include "common.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "PeerAddress.h"
+
+// Per-peer state keyed by address and port, in one flat array with linear
+// probing.  The hash is keyed with a secret picked when the map is made, so
+// peers can't choose addresses that pile up in one run of slots.  Each slot
+// keeps 32 bits of its hash, which makes growing the table and the backward
+// shift on erase (there are no tombstones) cheap.  Growing moves the values,
+// so pointers into the map only last until the next insert.
+template<typename T>
+class PeerMap {
+    public:
+        explicit PeerMap(size_t capacity = 16) : count(0)
+        {
+            std::random_device random;
+            k0 = ((uint64_t)random() << 32) | random();
+            k1 = ((uint64_t)random() << 32) | random();
+            allocate(capacity);
+        }
+
+        size_t size() const
+        {
+            return count;
+        }
+
+        // The peer's value, or null if there is none
+        T *find(const PeerAddress &peer)
+        {
+            const uint32_t code = codeOf(peer);
+            for (size_t i = code & mask; slots[i].code != 0; i = (i + 1) & mask)
+            {
+                if (slots[i].code == code && slots[i].key == peer)
+                    return &slots[i].value;
+            }
+            return nullptr;
+        }
+
+        const T *find(const PeerAddress &peer) const
+        {
+            return const_cast<PeerMap *>(this)->find(peer);
+        }
+
+        // The peer's value, made with T() if it wasn't there
+        T &operator[](const PeerAddress &peer)
+        {
+            const uint32_t code = codeOf(peer);
+            size_t i = code & mask;
+            for (; slots[i].code != 0; i = (i + 1) & mask)
+            {
+                if (slots[i].code == code && slots[i].key == peer)
+                    return slots[i].value;
+            }
+
+            // Keep at least a quarter of the slots empty, so runs stay short
+            if ((count + 1) * 4 > slots.size() * 3)
+            {
+                grow();
+                for (i = code & mask; slots[i].code != 0; i = (i + 1) & mask)
+                    ;
+            }
+
+            slots[i].code = code;
+            slots[i].key = peer;
+            slots[i].value = T();
+            ++count;
+            return slots[i].value;
+        }
+
+        bool erase(const PeerAddress &peer)
+        {
+            const uint32_t code = codeOf(peer);
+            size_t hole = code & mask;
+            for (; slots[hole].code != 0; hole = (hole + 1) & mask)
+            {
+                if (slots[hole].code == code && slots[hole].key == peer)
+                    break;
+            }
+            if (slots[hole].code == 0)
+                return false;
+
+            // Pull back anything later in the run that the hole would cut off from its home slot
+            for (size_t i = (hole + 1) & mask; slots[i].code != 0; i = (i + 1) & mask)
+            {
+                const size_t home = slots[i].code & mask;
+                if (((i - home) & mask) >= ((i - hole) & mask))
+                {
+                    slots[hole] = std::move(slots[i]);
+                    hole = i;
+                }
+            }
+
+            slots[hole].code = 0;
+            slots[hole].value = T();
+            --count;
+            return true;
+        }
+
+        void clear()
+        {
+            for (Slot &slot : slots)
+            {
+                slot.code = 0;
+                slot.value = T();
+            }
+            count = 0;
+        }
+
+        // f(const PeerAddress &, T &) for every entry, which mustn't insert or erase
+        template<typename F>
+        void forEach(F f)
+        {
+            for (Slot &slot : slots)
+            {
+                if (slot.code != 0)
+                    f(slot.key, slot.value);
+            }
+        }
+    private:
+        struct Slot
+        {
+            Slot() : code(0), value() {}
+
+            // Low 32 bits of the hash, never 0, which marks an empty slot
+            uint32_t code;
+            PeerAddress key;
+            T value;
+        };
+
+        uint32_t codeOf(const PeerAddress &peer) const
+        {
+            const uint32_t code = (uint32_t)peer.hash(k0, k1);
+            return code != 0 ? code : 1;
+        }
+
+        void allocate(size_t capacity)
+        {
+            size_t size = 16;
+            while (size < capacity)
+                size <<= 1;
+            slots.clear();
+            slots.resize(size);
+            mask = size - 1;
+        }
+
+        void grow()
+        {
+            std::vector<Slot> old;
+            old.swap(slots);
+            allocate(old.size() * 2);
+
+            for (Slot &slot : old)
+            {
+                if (slot.code == 0)
+                    continue;
+
+                size_t i = slot.code & mask;
+                while (slots[i].code != 0)
+                    i = (i + 1) & mask;
+                slots[i] = std::move(slot);
+            }
+        }
+
+        std::vector<Slot> slots;
+        size_t mask;
+        size_t count;
+        uint64_t k0;
+        uint64_t k1;
+};
+
+#endif
+
+// Local Variables: ***
+// mode: C++ ***
+// tab-width: 4 ***
+// c-basic-offset: 4 ***
+// indent-tabs-mode: nil ***
+// End: ***
+// ex: shiftwidth=4 tabstop=4
@@ -0,0 +1,167 @@
+/* bzflag
+ * Copyright (c) 1993-2023 Tim Riker
+ *
+ * This package is free software;  you can redistribute it and/or
+ * modify it under the terms of the license found in the file
+ * named COPYING that should have accompanied this file.
+ *
+ * THIS PACKAGE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* interface header */
+#include "RateLimiter.h"
+
+#include <random>
+
+const unsigned RateLimiter::probeLength;
+const uint32_t RateLimiter::tokenUnit;
+
+// Sources tracked unless told otherwise
+static const size_t defaultSources = 65536;
+
+// MurmurHash3's finalizer, every input bit affects every output bit
+static uint64_t mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+RateLimiter::RateLimiter() : refillPerMs(0), capacity(0), sources(defaultSources), prefixBits(64), seed(0), mask(0)
+{
+}
+
+void RateLimiter::setLimit(double perSecond, unsigned burst)
+{
+    if (perSecond <= 0 || burst == 0)
+    {
+        refillPerMs = 0;
+        buckets.clear();
+        buckets.shrink_to_fit();
+        return;
+    }
+
+    if (burst > 65535)
+        burst = 65535;
+
+    // Rates too low to add anything in a millisecond still add a little
+    const double refill = perSecond * tokenUnit / 1000.0;
+    refillPerMs = refill < 1 ? 1 : (uint32_t)refill;
+    capacity = burst * tokenUnit;
+
+    if (buckets.empty())
+        allocate();
+}
+
+void RateLimiter::setTable(size_t sources, int ipv6PrefixBits)
+{
+    this->sources = sources;
+    prefixBits = ipv6PrefixBits < 0 ? 0 : ipv6PrefixBits > 128 ? 128 : ipv6PrefixBits;
+
+    if (enabled())
+        allocate();
+}
+
+bool RateLimiter::enabled() const
+{
+    return refillPerMs != 0;
+}
+
+void RateLimiter::allocate()
+{
+    size_t size = probeLength;
+    while (size < sources)
+        size <<= 1;
+
+    Bucket empty;
+    empty.high = 0;
+    empty.low = 0;
+    empty.tokens = 0;
+    empty.stamp = 0;
+    buckets.assign(size, empty);
+    mask = size - 1;
+
+    std::random_device random;
+    seed = ((uint64_t)random() << 32) | random();
+}
+
+size_t RateLimiter::slotFor(uint64_t high, uint64_t low) const
+{
+    return mix(mix(high ^ seed) ^ low) & mask;
+}
+
+bool RateLimiter::allow(const PeerAddress &peer, uint64_t now)
+{
+    if (!enabled() || !peer.valid())
+        return true;
+
+    // IPv4 addresses are limited one by one, IPv6 ones by prefix
+    uint64_t high = peer.high();
+    uint64_t low = peer.low();
+    if (!peer.isIPv4())
+    {
+        if (prefixBits <= 64)
+        {
+            high = prefixBits == 0 ? 0 : high & (~0ULL << (64 - prefixBits));
+            low = 0;
+        }
+        else if (prefixBits < 128)
+            low &= ~0ULL << (128 - prefixBits);
+    }
+
+    uint32_t stamp = (uint32_t)(now / 1000);
+    if (stamp == 0)
+        stamp = 1;
+
+    const size_t start = slotFor(high, low);
+    Bucket *victim = nullptr;
+    for (unsigned i = 0; i < probeLength; ++i)
+    {
+        Bucket &bucket = buckets[(start + i) & mask];
+
+        if (bucket.stamp != 0 && bucket.high == high && bucket.low == low)
+        {
+            // Wraps after 49 days, which just looks like a bucket used recently
+            uint64_t tokens = bucket.tokens + (uint64_t)(uint32_t)(stamp - bucket.stamp) * refillPerMs;
+            if (tokens > capacity)
+                tokens = capacity;
+            bucket.stamp = stamp;
+
+            if (tokens < tokenUnit)
+            {
+                bucket.tokens = (uint32_t)tokens;
+                return false;
+            }
+
+            bucket.tokens = (uint32_t)(tokens - tokenUnit);
+            return true;
+        }
+
+        // An empty slot, or else the one left alone longest
+        if (victim == nullptr || (victim->stamp != 0 && (bucket.stamp == 0 ||
+                (uint32_t)(stamp - bucket.stamp) > (uint32_t)(stamp - victim->stamp))))
+            victim = &bucket;
+    }
+
+    // A new source starts with a full bucket
+    victim->high = high;
+    victim->low = low;
+    victim->tokens = capacity - tokenUnit;
+    victim->stamp = stamp;
+    return true;
+}
+
+
+/* Local Variables: ***
+ * mode: C++ ***
+ * tab-width: 8 ***
+ * c-basic-offset: 2 ***
+ * indent-tabs-mode: t ***
+ * End: ***
+ * ex: shiftwidth=2 tabstop=8
+ */
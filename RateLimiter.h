@@ -0,0 +1,86 @@
+/* bzflag
+ * Copyright (c) 1993-2023 Tim Riker
+ *
+ * This package is free software;  you can redistribute it and/or
+ * modify it under the terms of the license found in the file
+ * named COPYING that should have accompanied this file.
+ *
+ * THIS PACKAGE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __RATELIMITER_H__
+#define __RATELIMITER_H__
+
+/* common header */
+#include "common.h"
+
+#include <stdint.h>
+#include <vector>
+
+#include "PeerAddress.h"
+
+// Token bucket per source address.  Sources are IPv4 addresses, or IPv6
+// addresses cut down to a prefix, since a whole /64 costs an attacker
+// nothing to rotate through.  Buckets live in an open-addressing table of
+// fixed size: a source is looked for in a short run of slots, and a new one
+// takes an empty slot or the one seen longest ago.  A bucket left alone that
+// long would have refilled anyway, so forgetting it only matters while the
+// table is flooded with more sources than it holds.
+class RateLimiter {
+    public:
+        RateLimiter();
+
+        // perSecond events a second on average and burst at once (at most 65535); 0 turns it off
+        void setLimit(double perSecond, unsigned burst);
+
+        // How many sources are tracked, and how much of an IPv6 address makes a source
+        void setTable(size_t sources, int ipv6PrefixBits);
+
+        bool enabled() const;
+
+        // Take a token from the peer's bucket, false if it is empty.  The port doesn't matter, and
+        // a peer that isn't valid() is never limited.  now is in microseconds.
+        bool allow(const PeerAddress &peer, uint64_t now);
+    private:
+        // Slots looked at for one source
+        static const unsigned probeLength = 8;
+
+        // Tokens are kept in 1/65536ths
+        static const uint32_t tokenUnit = 65536;
+
+        struct Bucket
+        {
+            uint64_t high;
+            uint64_t low;
+            uint32_t tokens;
+
+            // Milliseconds, 0 for an empty slot
+            uint32_t stamp;
+        };
+
+        void allocate();
+        size_t slotFor(uint64_t high, uint64_t low) const;
+
+        uint32_t refillPerMs;
+        uint32_t capacity;
+        size_t sources;
+        int prefixBits;
+
+        // Keys the hash, so addresses can't be picked to land in one run of slots
+        uint64_t seed;
+
+        std::vector<Bucket> buckets;
+        size_t mask;
+};
+
+#endif
+
+// Local Variables: ***
+// mode: C++ ***
+// tab-width: 4 ***
+// c-basic-offset: 4 ***
+// indent-tabs-mode: nil ***
+// End: ***
+// ex: shiftwidth=4 tabstop=4
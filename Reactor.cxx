@@ -0,0 +1,363 @@
+/* bzflag
+ * Copyright (c) 1993-2023 Tim Riker
+ *
+ * This package is free software;  you can redistribute it and/or
+ * modify it under the terms of the license found in the file
+ * named COPYING that should have accompanied this file.
+ *
+ * THIS PACKAGE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* interface header */
+#include "Reactor.h"
+
+#include <new>
+
+// Frame sizes handed out by the pool, 256 bytes to 4k
+static const size_t smallestFrame = 256;
+static const int frameClasses = 5;
+static const size_t chunkSize = 64 * 1024;
+
+// A free frame, linked through its first bytes
+struct FreeFrame
+{
+    FreeFrame *next;
+};
+
+struct FrameLists
+{
+    FreeFrame *free[frameClasses];
+    std::vector<void *> chunks;
+    uint64_t frames;
+
+    FrameLists() : frames(0)
+    {
+        for (int i = 0; i < frameClasses; ++i)
+            free[i] = nullptr;
+    }
+
+    // Frames freed on another thread joined that thread's lists, so only let go of the chunks
+    // once none are in use anywhere near them
+    ~FrameLists()
+    {
+        if (frames != 0)
+            return;
+        for (void *chunk : chunks)
+            ::operator delete(chunk);
+    }
+};
+
+static thread_local FrameLists frameLists;
+
+static int frameClass(size_t size)
+{
+    size_t classSize = smallestFrame;
+    for (int i = 0; i < frameClasses; ++i, classSize <<= 1)
+    {
+        if (size <= classSize)
+            return i;
+    }
+    return -1;
+}
+
+void *FramePool::allocate(size_t size)
+{
+    const int index = frameClass(size);
+    if (index == -1)
+        return ::operator new(size);
+
+    FrameLists &lists = frameLists;
+    if (lists.free[index] == nullptr)
+    {
+        // Carve a new chunk into frames of this class
+        const size_t frameSize = smallestFrame << index;
+        char *chunk = (char *)::operator new(chunkSize);
+        lists.chunks.push_back(chunk);
+        for (size_t offset = chunkSize; offset >= frameSize; offset -= frameSize)
+        {
+            FreeFrame *frame = (FreeFrame *)(chunk + offset - frameSize);
+            frame->next = lists.free[index];
+            lists.free[index] = frame;
+        }
+    }
+
+    FreeFrame *frame = lists.free[index];
+    lists.free[index] = frame->next;
+    ++lists.frames;
+    return frame;
+}
+
+void FramePool::release(void *frame, size_t size)
+{
+    const int index = frameClass(size);
+    if (index == -1)
+    {
+        ::operator delete(frame);
+        return;
+    }
+
+    FrameLists &lists = frameLists;
+    FreeFrame *freed = (FreeFrame *)frame;
+    freed->next = lists.free[index];
+    lists.free[index] = freed;
+    --lists.frames;
+}
+
+FramePool::Stats FramePool::getStats()
+{
+    Stats stats;
+    stats.frames = frameLists.frames;
+    stats.reserved = frameLists.chunks.size() * chunkSize;
+    return stats;
+}
+
+Reactor::AcceptAwaiter::AcceptAwaiter(Reactor &reactor, PeerAddress &peer) : reactor(reactor), peer(peer), connection(0)
+{
+}
+
+bool Reactor::AcceptAwaiter::await_ready()
+{
+    if (reactor.pending.empty())
+        return false;
+
+    connection = reactor.pending.front().first;
+    peer = reactor.pending.front().second;
+    reactor.pending.pop_front();
+    return true;
+}
+
+void Reactor::AcceptAwaiter::await_suspend(std::coroutine_handle<> handle)
+{
+    waiting = handle;
+    reactor.acceptors.push_back(this);
+}
+
+NetManager::ConnectionId Reactor::AcceptAwaiter::await_resume()
+{
+    return connection;
+}
+
+Reactor::ReadAwaiter::ReadAwaiter(Reactor &reactor, NetManager::ConnectionId connection, NetManager::Message &message) :
+    reactor(reactor), connection(connection), message(message), result(false)
+{
+}
+
+bool Reactor::ReadAwaiter::await_ready()
+{
+    auto found = reactor.channels.find(connection);
+    if (found == reactor.channels.end())
+        return true;
+
+    Channel &channel = found->second;
+    if (!channel.queued.empty())
+    {
+        Queued &queued = channel.queued.front();
+        channel.current.swap(queued.data);
+        message = queued.message;
+        message.data = channel.current.data();
+        channel.queued.pop_front();
+        result = true;
+        return true;
+    }
+
+    // Gone, and everything it sent has been read
+    if (channel.closed)
+    {
+        reactor.channels.erase(found);
+        return true;
+    }
+
+    return false;
+}
+
+void Reactor::ReadAwaiter::await_suspend(std::coroutine_handle<> handle)
+{
+    waiting = handle;
+    reactor.channels[connection].reader = this;
+}
+
+bool Reactor::ReadAwaiter::await_resume()
+{
+    return result;
+}
+
+Reactor::WriteAwaiter::WriteAwaiter(Reactor &reactor, NetManager::ConnectionId connection, uint16_t code,
+                                    const char *data, size_t length) :
+    reactor(reactor), connection(connection), code(code), data(data), length(length)
+{
+}
+
+bool Reactor::WriteAwaiter::await_resume()
+{
+    return reactor.netManager.sendMessage(connection, code, data, length);
+}
+
+Reactor::SleepAwaiter::SleepAwaiter(Reactor &reactor, uint64_t delayUsec) : reactor(reactor), delayUsec(delayUsec)
+{
+}
+
+bool Reactor::SleepAwaiter::await_ready()
+{
+    return delayUsec == 0;
+}
+
+void Reactor::SleepAwaiter::await_suspend(std::coroutine_handle<> handle)
+{
+    Reactor &owner = reactor;
+    const NetManager::TimerId timer = owner.netManager.addTimer(delayUsec, [&owner, handle](uint64_t)
+    {
+        owner.sleepers.erase(handle.address());
+        handle.resume();
+    });
+    owner.sleepers[handle.address()] = timer;
+}
+
+Reactor::Reactor(NetManager &netManager) : netManager(netManager), self(std::make_shared<Reactor *>(this))
+{
+    std::shared_ptr<Reactor *> alive = self;
+    netManager.addAcceptCallback([alive](struct sockaddr *address, NetManager::ConnectionId connection)
+    {
+        if (*alive != nullptr)
+            (*alive)->accepted(address, connection);
+    });
+
+    netManager.setMessageReceivedCallback([this](const NetManager::Message &message)
+    {
+        received(message);
+    });
+
+    netManager.setDisconnectCallback([this](NetManager::ConnectionId connection)
+    {
+        disconnected(connection);
+    });
+}
+
+Reactor::~Reactor()
+{
+    *self = nullptr;
+    netManager.setMessageReceivedCallback(nullptr);
+    netManager.setDisconnectCallback(nullptr);
+
+    // Whatever is still waiting won't be resumed, free the frames.  Destroying one runs its
+    // destructors, which must not wait on anything.
+    std::vector<std::coroutine_handle<>> waiting;
+    for (AcceptAwaiter *acceptor : acceptors)
+        waiting.push_back(acceptor->waiting);
+    for (auto &channel : channels)
+    {
+        if (channel.second.reader != nullptr)
+            waiting.push_back(channel.second.reader->waiting);
+    }
+    for (auto &sleeper : sleepers)
+    {
+        netManager.cancelTimer(sleeper.second);
+        waiting.push_back(std::coroutine_handle<>::from_address(sleeper.first));
+    }
+
+    acceptors.clear();
+    channels.clear();
+    sleepers.clear();
+    for (std::coroutine_handle<> handle : waiting)
+        handle.destroy();
+}
+
+NetManager &Reactor::getNetManager()
+{
+    return netManager;
+}
+
+Reactor::AcceptAwaiter Reactor::accept(PeerAddress &peer)
+{
+    return AcceptAwaiter(*this, peer);
+}
+
+Reactor::ReadAwaiter Reactor::read(NetManager::ConnectionId connection, NetManager::Message &message)
+{
+    return ReadAwaiter(*this, connection, message);
+}
+
+Reactor::WriteAwaiter Reactor::write(NetManager::ConnectionId connection, uint16_t code, const char *data, size_t length)
+{
+    return WriteAwaiter(*this, connection, code, data, length);
+}
+
+Reactor::SleepAwaiter Reactor::sleepFor(uint64_t delayUsec)
+{
+    return SleepAwaiter(*this, delayUsec);
+}
+
+void Reactor::accepted(struct sockaddr *address, NetManager::ConnectionId connection)
+{
+    // Messages can come in before anyone takes the connection, they wait in its channel
+    channels[connection];
+
+    const PeerAddress peer(address);
+    if (acceptors.empty())
+    {
+        pending.push_back(std::make_pair(connection, peer));
+        return;
+    }
+
+    AcceptAwaiter *acceptor = acceptors.front();
+    acceptors.pop_front();
+    acceptor->connection = connection;
+    acceptor->peer = peer;
+    acceptor->waiting.resume();
+}
+
+void Reactor::received(const NetManager::Message &message)
+{
+    auto found = channels.find(message.connection);
+    if (found == channels.end())
+        return;
+
+    Channel &channel = found->second;
+    if (channel.reader == nullptr)
+    {
+        channel.queued.emplace_back();
+        Queued &queued = channel.queued.back();
+        queued.message = message;
+        queued.data.assign(message.data, message.data + message.length);
+        return;
+    }
+
+    // Straight to the reader, the payload stays where it is until the reader waits again
+    ReadAwaiter *reader = channel.reader;
+    channel.reader = nullptr;
+    reader->message = message;
+    reader->result = true;
+    reader->waiting.resume();
+}
+
+void Reactor::disconnected(NetManager::ConnectionId connection)
+{
+    auto found = channels.find(connection);
+    if (found == channels.end())
+        return;
+
+    ReadAwaiter *reader = found->second.reader;
+    if (reader == nullptr && !found->second.queued.empty())
+    {
+        found->second.closed = true;
+        return;
+    }
+
+    channels.erase(found);
+    if (reader != nullptr)
+    {
+        reader->result = false;
+        reader->waiting.resume();
+    }
+}
+
+
+/* Local Variables: ***
+ * mode: C++ ***
+ * tab-width: 8 ***
+ * c-basic-offset: 2 ***
+ * indent-tabs-mode: t ***
+ * End: ***
+ * ex: shiftwidth=2 tabstop=8
+ */
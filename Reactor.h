@@ -0,0 +1,202 @@
+/* bzflag
+ * Copyright (c) 1993-2023 Tim Riker
+ *
+ * This package is free software;  you can redistribute it and/or
+ * modify it under the terms of the license found in the file
+ * named COPYING that should have accompanied this file.
+ *
+ * THIS PACKAGE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __REACTOR_H__
+#define __REACTOR_H__
+
+/* common header */
+#include "common.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "NetManager.h"
+#include "PeerAddress.h"
+
+// Coroutine frames come from free lists kept per thread, one per size class,
+// carved out of 64k chunks that are never given back.  A suspended handler
+// costs its frame and nothing else.  Frames too big for the largest class
+// go to the heap.
+class FramePool {
+    public:
+        static void *allocate(size_t size);
+        static void release(void *frame, size_t size);
+
+        // This thread's frames in use and bytes held in chunks
+        struct Stats
+        {
+            uint64_t frames;
+            uint64_t reserved;
+        };
+        static Stats getStats();
+};
+
+// What a coroutine handler returns.  It starts running when called, until its
+// first co_await that has to wait, and its frame is freed when it returns.
+// Exceptions aren't used here, one escaping a handler terminates.
+class NetTask {
+    public:
+        struct promise_type
+        {
+            NetTask get_return_object() { return NetTask(); }
+            std::suspend_never initial_suspend() noexcept { return std::suspend_never(); }
+            std::suspend_never final_suspend() noexcept { return std::suspend_never(); }
+            void return_void() {}
+            void unhandled_exception() { std::terminate(); }
+
+            static void *operator new(size_t size) { return FramePool::allocate(size); }
+            static void operator delete(void *frame, size_t size) { FramePool::release(frame, size); }
+        };
+};
+
+// Awaitable accept(), read(), write() and sleepFor() on a NetManager's event
+// loop, so a protocol can be written as straight line code:
+//
+//     NetTask serve(Reactor &reactor, NetManager::ConnectionId connection)
+//     {
+//         NetManager::Message message;
+//         while (co_await reactor.read(connection, message))
+//             co_await reactor.write(connection, message.code, message.data, message.length);
+//     }
+//
+// Handlers are resumed from process(), on the thread running it, and are
+// never moved to another thread.  The Reactor takes over the NetManager's
+// message and disconnect callbacks, and doesn't see messages handed to a
+// worker pool.  Destroy it before the NetManager (and not while process()
+// runs); handlers still waiting are destroyed with it.
+class Reactor {
+    public:
+        explicit Reactor(NetManager &netManager);
+        ~Reactor();
+
+        NetManager &getNetManager();
+
+        class AcceptAwaiter {
+            public:
+                AcceptAwaiter(Reactor &reactor, PeerAddress &peer);
+                bool await_ready();
+                void await_suspend(std::coroutine_handle<> handle);
+                NetManager::ConnectionId await_resume();
+            private:
+                friend class Reactor;
+                Reactor &reactor;
+                PeerAddress &peer;
+                NetManager::ConnectionId connection;
+                std::coroutine_handle<> waiting;
+        };
+
+        class ReadAwaiter {
+            public:
+                ReadAwaiter(Reactor &reactor, NetManager::ConnectionId connection, NetManager::Message &message);
+                bool await_ready();
+                void await_suspend(std::coroutine_handle<> handle);
+                bool await_resume();
+            private:
+                friend class Reactor;
+                Reactor &reactor;
+                NetManager::ConnectionId connection;
+                NetManager::Message &message;
+                bool result;
+                std::coroutine_handle<> waiting;
+        };
+
+        class WriteAwaiter {
+            public:
+                WriteAwaiter(Reactor &reactor, NetManager::ConnectionId connection, uint16_t code, const char *data, size_t length);
+                bool await_ready() { return true; }
+                void await_suspend(std::coroutine_handle<>) {}
+                bool await_resume();
+            private:
+                Reactor &reactor;
+                NetManager::ConnectionId connection;
+                uint16_t code;
+                const char *data;
+                size_t length;
+        };
+
+        class SleepAwaiter {
+            public:
+                SleepAwaiter(Reactor &reactor, uint64_t delayUsec);
+                bool await_ready();
+                void await_suspend(std::coroutine_handle<> handle);
+                void await_resume() {}
+            private:
+                Reactor &reactor;
+                uint64_t delayUsec;
+        };
+
+        // The next new connection and its peer
+        AcceptAwaiter accept(PeerAddress &peer);
+
+        // The connection's next message, false once it is gone.  The payload is valid until the
+        // next co_await.  One handler reads a connection.
+        ReadAwaiter read(NetManager::ConnectionId connection, NetManager::Message &message);
+
+        // Queues the message and carries on, NetManager never makes a sender wait: false if the
+        // connection is gone or was dropped for falling too far behind
+        WriteAwaiter write(NetManager::ConnectionId connection, uint16_t code, const char *data, size_t length);
+
+        SleepAwaiter sleepFor(uint64_t delayUsec);
+    private:
+        // Messages that came in while nobody was reading, with their payloads copied
+        struct Queued
+        {
+            NetManager::Message message;
+            std::vector<char> data;
+        };
+
+        struct Channel
+        {
+            Channel() : reader(nullptr), closed(false) {}
+
+            ReadAwaiter *reader;
+            std::deque<Queued> queued;
+
+            // Payload of the last queued message handed to the reader
+            std::vector<char> current;
+
+            // Disconnected, with messages still to read
+            bool closed;
+        };
+
+        void accepted(struct sockaddr *address, NetManager::ConnectionId connection);
+        void received(const NetManager::Message &message);
+        void disconnected(NetManager::ConnectionId connection);
+
+        NetManager &netManager;
+
+        // Cleared when we go, the accept callback can't be taken back
+        std::shared_ptr<Reactor *> self;
+
+        std::deque<AcceptAwaiter *> acceptors;
+        std::deque<std::pair<NetManager::ConnectionId, PeerAddress>> pending;
+        std::unordered_map<NetManager::ConnectionId, Channel> channels;
+
+        // Timers of sleeping handlers, by frame
+        std::unordered_map<void *, NetManager::TimerId> sleepers;
+};
+
+#endif
+
+// Local Variables: ***
+// mode: C++ ***
+// tab-width: 4 ***
+// c-basic-offset: 4 ***
+// indent-tabs-mode: nil ***
+// End: ***
+// ex: shiftwidth=4 tabstop=4
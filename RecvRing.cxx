@@ -0,0 +1,131 @@
+/* bzflag
+ * Copyright (c) 1993-2023 Tim Riker
+ *
+ * This package is free software;  you can redistribute it and/or
+ * modify it under the terms of the license found in the file
+ * named COPYING that should have accompanied this file.
+ *
+ * THIS PACKAGE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* interface header */
+#include "RecvRing.h"
+
+#include <string.h>
+
+RecvRing::RecvRing() : buffer(nullptr), capacity(0), mask(0), readPos(0), writePos(0)
+{
+}
+
+void RecvRing::attach(char *memory, size_t bytes)
+{
+    buffer = memory;
+    capacity = bytes;
+    mask = capacity - 1;
+    readPos = writePos = 0;
+}
+
+char *RecvRing::detach()
+{
+    char *detached = buffer;
+    buffer = nullptr;
+    capacity = mask = 0;
+    readPos = writePos = 0;
+    return detached;
+}
+
+bool RecvRing::attached() const
+{
+    return buffer != nullptr;
+}
+
+size_t RecvRing::size() const
+{
+    return writePos - readPos;
+}
+
+size_t RecvRing::space() const
+{
+    return capacity - size();
+}
+
+int RecvRing::writableSpans(struct iovec iov[2])
+{
+    const size_t free = space();
+    if (free == 0)
+        return 0;
+
+    const size_t start = writePos & mask;
+    const size_t first = capacity - start < free ? capacity - start : free;
+
+    iov[0].iov_base = &buffer[start];
+    iov[0].iov_len = first;
+    if (first == free)
+        return 1;
+
+    iov[1].iov_base = &buffer[0];
+    iov[1].iov_len = free - first;
+    return 2;
+}
+
+void RecvRing::commit(size_t bytes)
+{
+    writePos += bytes;
+}
+
+size_t RecvRing::write(const char *data, size_t length)
+{
+    struct iovec iov[2];
+    const int spans = writableSpans(iov);
+
+    size_t written = 0;
+    for (int i = 0; i < spans && written < length; ++i)
+    {
+        const size_t n = length - written < iov[i].iov_len ? length - written : iov[i].iov_len;
+        memcpy(iov[i].iov_base, data + written, n);
+        written += n;
+    }
+
+    commit(written);
+    return written;
+}
+
+void RecvRing::peek(size_t offset, char *dest, size_t length) const
+{
+    const size_t start = (readPos + offset) & mask;
+    const size_t first = capacity - start < length ? capacity - start : length;
+
+    memcpy(dest, &buffer[start], first);
+    if (first < length)
+        memcpy(dest + first, &buffer[0], length - first);
+}
+
+const char *RecvRing::contiguous(size_t length) const
+{
+    const size_t start = readPos & mask;
+    if (start + length > capacity)
+        return nullptr;
+
+    return &buffer[start];
+}
+
+void RecvRing::consume(size_t length)
+{
+    readPos += length;
+
+    // Rewinding an empty ring keeps the next messages from straddling the end
+    if (readPos == writePos)
+        readPos = writePos = 0;
+}
+
+
+/* Local Variables: ***
+ * mode: C++ ***
+ * tab-width: 8 ***
+ * c-basic-offset: 2 ***
+ * indent-tabs-mode: t ***
+ * End: ***
+ * ex: shiftwidth=2 tabstop=8
+ */
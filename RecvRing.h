@@ -0,0 +1,71 @@
+/* bzflag
+ * Copyright (c) 1993-2023 Tim Riker
+ *
+ * This package is free software;  you can redistribute it and/or
+ * modify it under the terms of the license found in the file
+ * named COPYING that should have accompanied this file.
+ *
+ * THIS PACKAGE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __RECVRING_H__
+#define __RECVRING_H__
+
+/* common header */
+#include "common.h"
+
+#include <sys/uio.h>
+#include <stdint.h>
+
+// Byte ring a connection's stream is read into, so messages split across
+// reads can be put back together.  The capacity is a power of two and the
+// read and write positions only ever grow, wrapping through a mask.  The
+// memory is borrowed, so an idle connection can give it back.
+class RecvRing {
+    public:
+        RecvRing();
+
+        // Start using a buffer of the given size, which must be a power of two
+        void attach(char *memory, size_t bytes);
+
+        // Stop using the buffer and hand it back, only once the ring is empty
+        char *detach();
+
+        bool attached() const;
+
+        size_t size() const;
+        size_t space() const;
+
+        // Describe the free space as one or two spans for readv(), returns how many
+        int writableSpans(struct iovec iov[2]);
+        void commit(size_t bytes);
+
+        // Copy bytes in, returns how many fit
+        size_t write(const char *data, size_t length);
+
+        // Copy length bytes starting offset bytes past the read position
+        void peek(size_t offset, char *dest, size_t length) const;
+
+        // Pointer to the next length bytes if they don't wrap around the end, null if they do
+        const char *contiguous(size_t length) const;
+
+        void consume(size_t length);
+    private:
+        char *buffer;
+        size_t capacity;
+        size_t mask;
+        size_t readPos;
+        size_t writePos;
+};
+
+#endif
+
+// Local Variables: ***
+// mode: C++ ***
+// tab-width: 4 ***
+// c-basic-offset: 4 ***
+// indent-tabs-mode: nil ***
+// End: ***
+// ex: shiftwidth=4 tabstop=4
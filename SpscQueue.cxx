@@ -0,0 +1,128 @@
+/* bzflag
+ * Copyright (c) 1993-2023 Tim Riker
+ *
+ * This package is free software;  you can redistribute it and/or
+ * modify it under the terms of the license found in the file
+ * named COPYING that should have accompanied this file.
+ *
+ * THIS PACKAGE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* interface header */
+#include "SpscQueue.h"
+
+#include <string.h>
+
+// Every record starts with its length in an 8 byte header, so payloads stay 8 byte aligned
+static const size_t headerSize = 8;
+
+// Written where a record didn't fit before the end of the ring, the next one is at the start
+static const uint32_t wrapMarker = 0xffffffff;
+
+SpscQueue::SpscQueue(size_t bytes) : capacity(64), tail(0), cachedHead(0), pendingTail(0), head(0), cachedTail(0),
+    frontSize(0)
+{
+    while (capacity < bytes)
+        capacity <<= 1;
+    mask = capacity - 1;
+    buffer.resize(capacity);
+}
+
+size_t SpscQueue::recordSize(size_t length)
+{
+    return (headerSize + length + 7) & ~(size_t)7;
+}
+
+void *SpscQueue::reserve(size_t length)
+{
+    const size_t size = recordSize(length);
+    if (size > capacity || length >= wrapMarker)
+        return nullptr;
+
+    uint64_t pos = tail.load(std::memory_order_relaxed);
+    size_t offset = pos & mask;
+    const size_t skip = capacity - offset < size ? capacity - offset : 0;
+
+    if (pos + skip + size - cachedHead > capacity)
+    {
+        cachedHead = head.load(std::memory_order_acquire);
+        if (pos + skip + size - cachedHead > capacity)
+            return nullptr;
+    }
+
+    if (skip != 0)
+    {
+        const uint32_t marker = wrapMarker;
+        memcpy(&buffer[offset], &marker, sizeof marker);
+        pos += skip;
+        offset = 0;
+    }
+
+    const uint32_t recordLength = (uint32_t)length;
+    memcpy(&buffer[offset], &recordLength, sizeof recordLength);
+    pendingTail = pos + size;
+    return &buffer[offset + headerSize];
+}
+
+void SpscQueue::publish()
+{
+    tail.store(pendingTail, std::memory_order_release);
+}
+
+const void *SpscQueue::front(size_t &length)
+{
+    uint64_t pos = head.load(std::memory_order_relaxed);
+
+    while (true)
+    {
+        if (pos == cachedTail)
+        {
+            cachedTail = tail.load(std::memory_order_acquire);
+            if (pos == cachedTail)
+                return nullptr;
+        }
+
+        const size_t offset = pos & mask;
+        uint32_t recordLength;
+        memcpy(&recordLength, &buffer[offset], sizeof recordLength);
+
+        if (recordLength == wrapMarker)
+        {
+            pos += capacity - offset;
+            head.store(pos, std::memory_order_release);
+            continue;
+        }
+
+        frontSize = recordSize(recordLength);
+        length = recordLength;
+        return &buffer[offset + headerSize];
+    }
+}
+
+void SpscQueue::pop()
+{
+    head.store(head.load(std::memory_order_relaxed) + frontSize, std::memory_order_release);
+}
+
+size_t SpscQueue::size() const
+{
+    const uint64_t consumed = head.load(std::memory_order_acquire);
+    return tail.load(std::memory_order_acquire) - consumed;
+}
+
+size_t SpscQueue::getCapacity() const
+{
+    return capacity;
+}
+
+
+/* Local Variables: ***
+ * mode: C++ ***
+ * tab-width: 8 ***
+ * c-basic-offset: 2 ***
+ * indent-tabs-mode: t ***
+ * End: ***
+ * ex: shiftwidth=2 tabstop=8
+ */
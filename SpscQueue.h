@@ -0,0 +1,74 @@
+/* bzflag
+ * Copyright (c) 1993-2023 Tim Riker
+ *
+ * This package is free software;  you can redistribute it and/or
+ * modify it under the terms of the license found in the file
+ * named COPYING that should have accompanied this file.
+ *
+ * THIS PACKAGE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __SPSCQUEUE_H__
+#define __SPSCQUEUE_H__
+
+/* common header */
+#include "common.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+
+// A bounded queue of variable sized records between exactly one producer
+// thread and one consumer thread, without locks.  Records are laid out back
+// to back in a byte ring and read in place.  Each side keeps a copy of the
+// other side's position and only reloads it when the copy says the queue is
+// full (or empty), so the shared positions are rarely touched.
+class SpscQueue {
+    public:
+        // Capacity in bytes, rounded up to a power of two
+        explicit SpscQueue(size_t capacity);
+
+        // Producer: room for a record of length bytes, or null if the queue is too full.  Nothing
+        // is visible to the consumer until publish(); reserving again replaces an unpublished record.
+        void *reserve(size_t length);
+        void publish();
+
+        // Consumer: the oldest record, or null if there is none.  It stays valid until pop().
+        const void *front(size_t &length);
+        void pop();
+
+        // Bytes in use, counting headers and padding, from either side
+        size_t size() const;
+        size_t getCapacity() const;
+    private:
+        static size_t recordSize(size_t length);
+
+        std::vector<char> buffer;
+        size_t capacity;
+        size_t mask;
+
+        // Producer's cache line
+        std::atomic<uint64_t> tail;
+        uint64_t cachedHead;
+        uint64_t pendingTail;
+        char producerPadding[64];
+
+        // Consumer's cache line
+        std::atomic<uint64_t> head;
+        uint64_t cachedTail;
+        uint64_t frontSize;
+        char consumerPadding[64];
+};
+
+#endif
+
+// Local Variables: ***
+// mode: C++ ***
+// tab-width: 4 ***
+// c-basic-offset: 4 ***
+// indent-tabs-mode: nil ***
+// End: ***
+// ex: shiftwidth=4 tabstop=4
@@ -0,0 +1,158 @@
+/* bzflag
+ * Copyright (c) 1993-2023 Tim Riker
+ *
+ * This package is free software;  you can redistribute it and/or
+ * modify it under the terms of the license found in the file
+ * named COPYING that should have accompanied this file.
+ *
+ * THIS PACKAGE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* interface header */
+#include "TimingWheel.h"
+
+const unsigned TimingWheel::levelBits;
+const unsigned TimingWheel::levels;
+const uint64_t TimingWheel::slotCount;
+const uint64_t TimingWheel::slotMask;
+
+TimingWheel::Entry::Entry() : prev(nullptr), next(nullptr), expiry(0), data(0)
+{
+}
+
+bool TimingWheel::Entry::armed() const
+{
+    return next != nullptr;
+}
+
+TimingWheel::TimingWheel(uint64_t tickUsec, uint64_t startUsec) : tickUsec(tickUsec > 0 ? tickUsec : 1), count(0)
+{
+    current = startUsec / this->tickUsec;
+
+    for (unsigned level = 0; level < levels; ++level)
+    {
+        for (uint64_t i = 0; i < slotCount; ++i)
+            slots[level][i].prev = slots[level][i].next = &slots[level][i];
+    }
+}
+
+size_t TimingWheel::size() const
+{
+    return count;
+}
+
+void TimingWheel::arm(Entry &entry, uint64_t deadlineUsec)
+{
+    if (entry.armed())
+        cancel(entry);
+
+    // Round up, so it never fires early
+    entry.expiry = (deadlineUsec + tickUsec - 1) / tickUsec;
+    link(entry);
+    ++count;
+}
+
+void TimingWheel::cancel(Entry &entry)
+{
+    if (!entry.armed())
+        return;
+
+    entry.prev->next = entry.next;
+    entry.next->prev = entry.prev;
+    entry.prev = entry.next = nullptr;
+    --count;
+}
+
+void TimingWheel::link(Entry &entry)
+{
+    // Already due goes in the next tick to run, too far ahead waits in the last slot there is
+    const uint64_t maxAhead = (1ULL << (levelBits * levels)) - 1;
+    if (entry.expiry < current)
+        entry.expiry = current;
+    else if (entry.expiry - current > maxAhead)
+        entry.expiry = current + maxAhead;
+
+    // The coarsest level whose slots are still finer than the distance
+    const uint64_t ahead = entry.expiry - current;
+    unsigned level = 0;
+    while (level + 1 < levels && ahead >= (1ULL << (levelBits * (level + 1))))
+        ++level;
+
+    Entry &head = slots[level][(entry.expiry >> (levelBits * level)) & slotMask];
+    entry.prev = head.prev;
+    entry.next = &head;
+    head.prev->next = &entry;
+    head.prev = &entry;
+}
+
+void TimingWheel::cascade(unsigned level)
+{
+    // Everything in this slot is due within the next turn of the level below, spread it out there
+    Entry &head = slots[level][(current >> (levelBits * level)) & slotMask];
+    Entry *entry = head.next;
+    head.prev = head.next = &head;
+
+    while (entry != &head)
+    {
+        Entry *next = entry->next;
+        link(*entry);
+        entry = next;
+    }
+}
+
+void TimingWheel::advance(uint64_t nowUsec, const std::function<void(Entry &)> &expired)
+{
+    const uint64_t target = nowUsec / tickUsec;
+
+    while (current <= target)
+    {
+        // Nothing to fire on the way, skip straight there
+        if (count == 0)
+        {
+            current = target + 1;
+            return;
+        }
+
+        // Each time a level comes round, the next one up drops its current slot into it
+        for (unsigned level = 1; level < levels; ++level)
+        {
+            if (((current >> (levelBits * (level - 1))) & slotMask) != 0)
+                break;
+            cascade(level);
+        }
+
+        // Take the slot's list before running it, so entries armed meanwhile wait for the next tick
+        Entry &head = slots[0][current & slotMask];
+        Entry due;
+        if (head.next != &head)
+        {
+            due.next = head.next;
+            due.prev = head.prev;
+            due.next->prev = &due;
+            due.prev->next = &due;
+            head.prev = head.next = &head;
+        }
+        else
+            due.prev = due.next = &due;
+        ++current;
+
+        while (due.next != &due)
+        {
+            Entry &entry = *due.next;
+            cancel(entry);
+            expired(entry);
+        }
+    }
+}
+
+
+/* Local Variables: ***
+ * mode: C++ ***
+ * tab-width: 8 ***
+ * c-basic-offset: 2 ***
+ * indent-tabs-mode: t ***
+ * End: ***
+ * ex: shiftwidth=2 tabstop=8
+ */
@@ -0,0 +1,86 @@
+/* bzflag
+ * Copyright (c) 1993-2023 Tim Riker
+ *
+ * This package is free software;  you can redistribute it and/or
+ * modify it under the terms of the license found in the file
+ * named COPYING that should have accompanied this file.
+ *
+ * THIS PACKAGE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __TIMINGWHEEL_H__
+#define __TIMINGWHEEL_H__
+
+/* common header */
+#include "common.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <functional>
+
+// Hierarchical timing wheel for large numbers of timeouts that are mostly
+// re-armed or cancelled before they fire.  Time moves in ticks; each level
+// has 64 slots, a slot of level n covering 64^n ticks, so five levels reach
+// 2^30 ticks ahead.  A timeout goes into the coarsest slot it fits and drops
+// a level each time the wheel below it comes round.  Slots are intrusive
+// doubly linked lists through entries the caller owns, so arming, re-arming
+// and cancelling are O(1) and never allocate.
+class TimingWheel {
+    public:
+        // Embed one per timeout.  It must stay put while armed.
+        struct Entry
+        {
+            Entry();
+
+            bool armed() const;
+
+            Entry *prev;
+            Entry *next;
+            uint64_t expiry;
+
+            // For the caller, to find what timed out
+            uint64_t data;
+        };
+
+        // Ticks are tickUsec long, counted from startUsec
+        TimingWheel(uint64_t tickUsec, uint64_t startUsec);
+
+        // Fire at deadlineUsec or up to a tick after, never before.  Moves an armed entry.
+        void arm(Entry &entry, uint64_t deadlineUsec);
+        void cancel(Entry &entry);
+
+        size_t size() const;
+
+        // Fire everything due by nowUsec, oldest tick first.  Entries are disarmed before
+        // expired() sees them, so it may arm them again, or arm and cancel others.
+        void advance(uint64_t nowUsec, const std::function<void(Entry &)> &expired);
+    private:
+        static const unsigned levelBits = 6;
+        static const unsigned levels = 5;
+        static const uint64_t slotCount = 1 << levelBits;
+        static const uint64_t slotMask = slotCount - 1;
+
+        void link(Entry &entry);
+        void cascade(unsigned level);
+
+        uint64_t tickUsec;
+
+        // The next tick to be run
+        uint64_t current;
+        size_t count;
+
+        // List heads, an entry pointing back at a head is first in its slot
+        Entry slots[levels][slotCount];
+};
+
+#endif
+
+// Local Variables: ***
+// mode: C++ ***
+// tab-width: 4 ***
+// c-basic-offset: 4 ***
+// indent-tabs-mode: nil ***
+// End: ***
+// ex: shiftwidth=4 tabstop=4
@@ -0,0 +1,306 @@
+/* bzflag
+ * Copyright (c) 1993-2023 Tim Riker
+ *
+ * This package is free software;  you can redistribute it and/or
+ * modify it under the terms of the license found in the file
+ * named COPYING that should have accompanied this file.
+ *
+ * THIS PACKAGE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* interface header */
+#include "WorkerPool.h"
+
+#include <chrono>
+
+const int64_t WorkerPool::StealDeque::capacity;
+
+// Rounds of looking for work, yielding in between, before a worker goes to sleep
+static const unsigned idleRounds = 64;
+
+WorkerPool::Strand::Strand() : scheduled(false), references(1)
+{
+}
+
+WorkerPool::CompletionQueue::CompletionQueue(std::function<void()> wake) : signalled(false), wake(wake)
+{
+}
+
+void WorkerPool::CompletionQueue::push(Task *task)
+{
+    tasks.push(task);
+
+    // Only the first task back since the submitter last looked costs a wakeup
+    if (!signalled.exchange(true, std::memory_order_acq_rel))
+        wake();
+}
+
+bool WorkerPool::CompletionQueue::takeWakeup()
+{
+    if (!signalled.load(std::memory_order_relaxed))
+        return false;
+    return signalled.exchange(false, std::memory_order_acq_rel);
+}
+
+WorkerPool::Task *WorkerPool::CompletionQueue::pop()
+{
+    return static_cast<Task *>(tasks.pop());
+}
+
+WorkerPool::StealDeque::StealDeque() : top(0), bottom(0)
+{
+    for (int64_t i = 0; i < capacity; ++i)
+        slots[i].store(nullptr, std::memory_order_relaxed);
+}
+
+bool WorkerPool::StealDeque::push(Strand *strand)
+{
+    const int64_t b = bottom.load(std::memory_order_relaxed);
+    const int64_t t = top.load(std::memory_order_acquire);
+    if (b - t >= capacity)
+        return false;
+
+    slots[b & (capacity - 1)].store(strand, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom.store(b + 1, std::memory_order_relaxed);
+    return true;
+}
+
+WorkerPool::Strand *WorkerPool::StealDeque::pop()
+{
+    const int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top.load(std::memory_order_relaxed);
+
+    if (t > b)
+    {
+        bottom.store(b + 1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    Strand *strand = slots[b & (capacity - 1)].load(std::memory_order_relaxed);
+    if (t == b)
+    {
+        // The last one, a thief may be after it too
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            strand = nullptr;
+        bottom.store(b + 1, std::memory_order_relaxed);
+    }
+    return strand;
+}
+
+WorkerPool::Strand *WorkerPool::StealDeque::steal()
+{
+    int64_t t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const int64_t b = bottom.load(std::memory_order_acquire);
+
+    if (t >= b)
+        return nullptr;
+
+    Strand *strand = slots[t & (capacity - 1)].load(std::memory_order_relaxed);
+    if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+        return nullptr;
+    return strand;
+}
+
+bool WorkerPool::StealDeque::empty() const
+{
+    return bottom.load(std::memory_order_acquire) <= top.load(std::memory_order_acquire);
+}
+
+WorkerPool::WorkerPool(int threads) : nextWorker(0), stopping(false), sleepers(0)
+{
+    if (threads <= 0)
+    {
+        threads = (int)std::thread::hardware_concurrency() - 1;
+        if (threads < 1)
+            threads = 1;
+    }
+
+    for (int i = 0; i < threads; ++i)
+        workers.push_back(new Worker);
+    for (int i = 0; i < threads; ++i)
+        workers[i]->thread = std::thread(&WorkerPool::run, this, i);
+}
+
+WorkerPool::~WorkerPool()
+{
+    stopping.store(true);
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        sleepCondition.notify_all();
+    }
+
+    // The others may still be stealing from a worker that has stopped
+    for (Worker *worker : workers)
+        worker->thread.join();
+    for (Worker *worker : workers)
+        delete worker;
+}
+
+int WorkerPool::getThreadCount() const
+{
+    return (int)workers.size();
+}
+
+void WorkerPool::submit(Task *task)
+{
+    Strand *strand = task->strand;
+    strand->tasks.push(task);
+
+    // Whoever flips the strand to scheduled hands it to a worker, everyone else just queues
+    if (!strand->scheduled.exchange(true, std::memory_order_acq_rel))
+    {
+        strand->references.fetch_add(1, std::memory_order_relaxed);
+        schedule(strand);
+    }
+}
+
+void WorkerPool::release(Strand *strand)
+{
+    if (strand->references.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        delete strand;
+}
+
+void WorkerPool::schedule(Strand *strand)
+{
+    const unsigned index = nextWorker.fetch_add(1, std::memory_order_relaxed) % workers.size();
+    workers[index]->inbox.push(strand);
+
+    // Pairs with the fence in run(): either the worker sees the strand, or we see it asleep
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleepers.load(std::memory_order_relaxed) > 0)
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        sleepCondition.notify_all();
+    }
+}
+
+void WorkerPool::run(unsigned index)
+{
+    Worker &self = *workers[index];
+    unsigned idle = 0;
+
+    while (!stopping.load(std::memory_order_relaxed))
+    {
+        Strand *strand = findWork(index);
+        if (strand != nullptr)
+        {
+            runStrand(strand, self);
+            idle = 0;
+            continue;
+        }
+
+        if (++idle < idleRounds)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        sleepers.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!hasWork(index) && !stopping.load(std::memory_order_relaxed))
+        {
+            self.sleeps.add();
+            sleepCondition.wait_for(lock, std::chrono::milliseconds(100));
+        }
+        sleepers.fetch_sub(1, std::memory_order_relaxed);
+        idle = 0;
+    }
+}
+
+WorkerPool::Strand *WorkerPool::findWork(unsigned index)
+{
+    Worker &self = *workers[index];
+
+    // Move what was scheduled on us into the deque, where idle workers can steal it
+    MpscNode *node;
+    while ((node = self.inbox.pop()) != nullptr)
+    {
+        if (!self.deque.push(static_cast<Strand *>(node)))
+            return static_cast<Strand *>(node);
+    }
+
+    Strand *strand = self.deque.pop();
+    if (strand != nullptr)
+        return strand;
+
+    for (size_t i = 1; i < workers.size(); ++i)
+    {
+        strand = workers[(index + i) % workers.size()]->deque.steal();
+        if (strand != nullptr)
+        {
+            self.steals.add();
+            return strand;
+        }
+    }
+
+    return nullptr;
+}
+
+bool WorkerPool::hasWork(unsigned index) const
+{
+    if (!workers[index]->inbox.empty())
+        return true;
+
+    for (const Worker *worker : workers)
+    {
+        if (!worker->deque.empty())
+            return true;
+    }
+    return false;
+}
+
+void WorkerPool::runStrand(Strand *strand, Worker &worker)
+{
+    while (true)
+    {
+        // Tasks go back before the strand is let go of, so they come back in order even when the
+        // strand's next run is on another worker
+        MpscNode *node = strand->tasks.pop();
+        if (node != nullptr)
+        {
+            Task *task = static_cast<Task *>(node);
+            if (task->work)
+                task->work();
+            worker.tasks.add();
+            task->completions->push(task);
+            continue;
+        }
+
+        // Looks empty, let go of the strand, then make sure nothing slipped in meanwhile
+        strand->scheduled.store(false, std::memory_order_seq_cst);
+        if (strand->tasks.empty() || strand->scheduled.exchange(true, std::memory_order_acq_rel))
+            break;
+    }
+
+    release(strand);
+}
+
+WorkerPool::Stats WorkerPool::getStats() const
+{
+    Stats stats;
+    stats.tasks = stats.steals = stats.sleeps = 0;
+    for (const Worker *worker : workers)
+    {
+        stats.tasks += worker->tasks.get();
+        stats.steals += worker->steals.get();
+        stats.sleeps += worker->sleeps.get();
+    }
+    return stats;
+}
+
+
+/* Local Variables: ***
+ * mode: C++ ***
+ * tab-width: 8 ***
+ * c-basic-offset: 2 ***
+ * indent-tabs-mode: t ***
+ * End: ***
+ * ex: shiftwidth=2 tabstop=8
+ */
@@ -0,0 +1,160 @@
+/* bzflag
+ * Copyright (c) 1993-2023 Tim Riker
+ *
+ * This package is free software;  you can redistribute it and/or
+ * modify it under the terms of the license found in the file
+ * named COPYING that should have accompanied this file.
+ *
+ * THIS PACKAGE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __WORKERPOOL_H__
+#define __WORKERPOOL_H__
+
+/* common header */
+#include "common.h"
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Metrics.h"
+#include "MpscQueue.h"
+
+// Threads for work too heavy for an event loop.  Work is submitted to a
+// strand, and a strand's tasks run one at a time in submission order while
+// different strands run in parallel; NetManager keeps a strand per
+// connection.  Each thread takes scheduled strands from its own deque and
+// steals from the others' when it runs dry (Chase-Lev deques).  When a task
+// is done it is handed back through the submitter's CompletionQueue, a
+// lock-free queue the submitting thread drains itself.
+class WorkerPool {
+    public:
+        class Strand;
+        class CompletionQueue;
+
+        struct Task : MpscNode
+        {
+            std::function<void()> work;     // on a pool thread
+            std::function<void()> done;     // back on the submitting thread
+            Strand *strand;
+            CompletionQueue *completions;
+        };
+
+        // Tasks that must run in order, one at a time.  Made with new and let go of with
+        // release(); it is freed once a worker running it is done with it as well.
+        class Strand : public MpscNode {
+            public:
+                Strand();
+            private:
+                friend class WorkerPool;
+                ~Strand() {}
+
+                MpscQueue tasks;
+                std::atomic<bool> scheduled;
+
+                // The owner's, and one while it is scheduled
+                std::atomic<uint32_t> references;
+        };
+
+        // Finished tasks on their way back to one submitting thread, which is woken with wake()
+        // when the queue goes from empty to not
+        class CompletionQueue {
+            public:
+                explicit CompletionQueue(std::function<void()> wake);
+
+                // Any thread
+                void push(Task *task);
+
+                // Submitting thread: true if tasks came back since the last call, then pop them all
+                bool takeWakeup();
+                Task *pop();
+            private:
+                MpscQueue tasks;
+                std::atomic<bool> signalled;
+                std::function<void()> wake;
+        };
+
+        // 0 threads means one per core, less one for the event loop
+        explicit WorkerPool(int threads = 0);
+        ~WorkerPool();
+
+        int getThreadCount() const;
+
+        // Any thread; task->strand and task->completions must be set
+        void submit(Task *task);
+        static void release(Strand *strand);
+
+        // Safe to read from any thread
+        struct Stats
+        {
+            uint64_t tasks;
+            uint64_t steals;
+            uint64_t sleeps;
+        };
+        Stats getStats() const;
+    private:
+        // Chase-Lev work-stealing deque of scheduled strands: the owner pushes and pops at the
+        // bottom, thieves take from the top
+        class StealDeque {
+            public:
+                StealDeque();
+
+                bool push(Strand *strand);
+                Strand *pop();
+                Strand *steal();
+                bool empty() const;
+            private:
+                static const int64_t capacity = 4096;
+
+                std::atomic<int64_t> top;
+                char topPadding[64];
+                std::atomic<int64_t> bottom;
+                char bottomPadding[64];
+                std::atomic<Strand *> slots[capacity];
+        };
+
+        struct Worker
+        {
+            std::thread thread;
+
+            // Strands scheduled from outside the pool, moved to the deque by the worker
+            MpscQueue inbox;
+            StealDeque deque;
+
+            Counter tasks;
+            Counter steals;
+            Counter sleeps;
+        };
+
+        void schedule(Strand *strand);
+        void run(unsigned index);
+        Strand *findWork(unsigned index);
+        bool hasWork(unsigned index) const;
+        void runStrand(Strand *strand, Worker &worker);
+
+        std::vector<Worker *> workers;
+        std::atomic<unsigned> nextWorker;
+        std::atomic<bool> stopping;
+
+        // Only used to put idle workers to sleep and wake them
+        std::atomic<int> sleepers;
+        std::mutex sleepMutex;
+        std::condition_variable sleepCondition;
+};
+
+#endif
+
+// Local Variables: ***
+// mode: C++ ***
+// tab-width: 4 ***
+// c-basic-offset: 4 ***
+// indent-tabs-mode: nil ***
+// End: ***
+// ex: shiftwidth=4 tabstop=4
@@ -0,0 +1,597 @@
+/* bzflag
+ * Copyright (c) 1993-2023 Tim Riker
+ *
+ * This package is free software;  you can redistribute it and/or
+ * modify it under the terms of the license found in the file
+ * named COPYING that should have accompanied this file.
+ *
+ * THIS PACKAGE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/*
+ * Load generator for the server.  It opens TCP connections over IPv4 and
+ * IPv6 that send chat in bursts, UDP flows that send position updates at a
+ * fixed rate, and keeps closing and reopening connections.  Every message
+ * carries the time it was sent, so with the server echoing (server -e) the
+ * round trip of each one is measured.  Given the server's pid, the CPU time
+ * it used per message is reported as well.
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+// Payload sizes, a position update is small and a chat line a bit bigger
+const size_t positionSize = 32;
+const size_t chatSize = 64;
+const size_t headerSize = 4;
+
+struct Endpoint
+{
+    int fd;
+    bool udp;
+    bool v6;
+    bool connected;
+
+    // Stream data read so far and data waiting for the socket to drain
+    std::vector<char> in;
+    std::string out;
+
+    // When this endpoint next sends
+    uint64_t next;
+};
+
+struct Stats
+{
+    Stats() : sent(0), received(0) {}
+
+    uint64_t sent;
+    uint64_t received;
+    std::vector<uint32_t> latencies;
+};
+
+static uint64_t now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// User plus system CPU time of a process in microseconds, 0 if it can't be read
+static uint64_t processCpuUsec(int pid)
+{
+    char path[64];
+    snprintf(path, sizeof path, "/proc/%d/stat", pid);
+    FILE *file = fopen(path, "r");
+    if (file == nullptr)
+        return 0;
+
+    char line[1024];
+    const bool read = fgets(line, sizeof line, file) != nullptr;
+    fclose(file);
+    if (!read)
+        return 0;
+
+    // Fields after the command name, which is in parentheses and may contain spaces
+    const char *fields = strrchr(line, ')');
+    if (fields == nullptr)
+        return 0;
+
+    unsigned long utime = 0, stime = 0;
+    if (sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+        return 0;
+
+    return (uint64_t)(utime + stime) * 1000000 / sysconf(_SC_CLK_TCK);
+}
+
+static void putHeader(char *header, size_t length, char c0, char c1)
+{
+    header[0] = (char)(length >> 8);
+    header[1] = (char)length;
+    header[2] = c0;
+    header[3] = c1;
+}
+
+static void printLatency(const char *what, Stats &stats, double seconds)
+{
+    std::cout << what << ": " << stats.sent << " sent, " << stats.received << " echoed, "
+              << (uint64_t)(stats.received / seconds) << "/s";
+
+    std::vector<uint32_t> &samples = stats.latencies;
+    if (!samples.empty())
+    {
+        std::sort(samples.begin(), samples.end());
+        std::cout << ", round trip p50 " << samples[samples.size() * 50 / 100] << " us, p99 "
+                  << samples[samples.size() * 99 / 100] << " us, p999 " << samples[samples.size() * 999 / 1000]
+                  << " us";
+    }
+    std::cout << std::endl;
+}
+
+class NetBench {
+    public:
+        NetBench() : epollFd(-1), addr4Len(0), addr6Len(0), have4(false), have6(false), rate(30), burst(5),
+            chatInterval(2000000), connects(0), connectFailures(0) {}
+
+        bool resolve(const char *host4, const char *host6, const char *port);
+        bool open(int connections, int flows, int v6Percent, int rateHz, int burstSize, int chatIntervalMs);
+        void run(uint64_t duration, int churnPerSecond);
+        void report(double seconds, uint64_t serverCpuUsec);
+    private:
+        bool connectEndpoint(size_t index);
+        void closeEndpoint(size_t index);
+        void sendChat(size_t index, uint64_t time);
+        void sendPosition(size_t index, uint64_t time);
+        void flush(size_t index);
+        void readStream(size_t index, uint64_t time);
+        void readDatagrams(size_t index, uint64_t time);
+
+        int epollFd;
+        struct sockaddr_storage addr4, addr6;
+        socklen_t addr4Len, addr6Len;
+        bool have4, have6;
+
+        uint64_t rate;
+        int burst;
+        uint64_t chatInterval;
+
+        std::vector<Endpoint> endpoints;
+        std::vector<size_t> streams;
+        std::mt19937 rng;
+
+        Stats chat;
+        Stats positions;
+        uint64_t connects;
+        uint64_t connectFailures;
+};
+
+static bool lookup(const char *host, const char *port, struct sockaddr_storage &addr, socklen_t &len)
+{
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+
+    if (getaddrinfo(host, port, &hints, &res) != 0)
+        return false;
+
+    memcpy(&addr, res->ai_addr, res->ai_addrlen);
+    len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return true;
+}
+
+bool NetBench::resolve(const char *host4, const char *host6, const char *port)
+{
+    have4 = *host4 != '\0' && lookup(host4, port, addr4, addr4Len);
+    have6 = *host6 != '\0' && lookup(host6, port, addr6, addr6Len);
+    if (!have4 && !have6)
+    {
+        std::cerr << "no server address to connect to" << std::endl;
+        return false;
+    }
+
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd == -1)
+    {
+        perror("epoll_create1");
+        return false;
+    }
+    return true;
+}
+
+bool NetBench::open(int connections, int flows, int v6Percent, int rateHz, int burstSize, int chatIntervalMs)
+{
+    rate = rateHz;
+    burst = burstSize;
+    chatInterval = (uint64_t)chatIntervalMs * 1000;
+
+    const uint64_t start = now();
+    const int total = connections + flows;
+    endpoints.resize(total);
+
+    for (int i = 0; i < total; ++i)
+    {
+        Endpoint &endpoint = endpoints[i];
+        endpoint.fd = -1;
+        endpoint.udp = i >= connections;
+        endpoint.v6 = have6 && (!have4 || (int)(rng() % 100) < v6Percent);
+        endpoint.connected = false;
+
+        // Spread the first sends out so they don't all land in the same tick
+        endpoint.next = start + (endpoint.udp ? rng() % (1000000 / rate) : rng() % chatInterval);
+
+        if (!endpoint.udp)
+            streams.push_back(i);
+        if (!connectEndpoint(i))
+            return false;
+    }
+    return true;
+}
+
+bool NetBench::connectEndpoint(size_t index)
+{
+    Endpoint &endpoint = endpoints[index];
+    const struct sockaddr_storage &addr = endpoint.v6 ? addr6 : addr4;
+    const socklen_t addrLen = endpoint.v6 ? addr6Len : addr4Len;
+
+    endpoint.fd = socket(addr.ss_family, (endpoint.udp ? SOCK_DGRAM : SOCK_STREAM) | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (endpoint.fd == -1)
+    {
+        perror("socket");
+        return false;
+    }
+
+    if (connect(endpoint.fd, (const struct sockaddr *)&addr, addrLen) == -1 && errno != EINPROGRESS)
+    {
+        perror("connect");
+        ++connectFailures;
+        close(endpoint.fd);
+        endpoint.fd = -1;
+        return true;
+    }
+
+    // UDP is ready straight away, TCP once the socket turns writable
+    endpoint.connected = endpoint.udp;
+    endpoint.in.clear();
+    endpoint.out.clear();
+    ++connects;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof ev);
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.u64 = index;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, endpoint.fd, &ev) == -1)
+    {
+        perror("epoll_ctl");
+        return false;
+    }
+    return true;
+}
+
+void NetBench::closeEndpoint(size_t index)
+{
+    Endpoint &endpoint = endpoints[index];
+    if (endpoint.fd != -1)
+        close(endpoint.fd);
+    endpoint.fd = -1;
+    endpoint.connected = false;
+}
+
+void NetBench::sendChat(size_t index, uint64_t time)
+{
+    Endpoint &endpoint = endpoints[index];
+
+    char message[headerSize + chatSize];
+    memset(message, 'c', sizeof message);
+    putHeader(message, chatSize, 'm', 'c');
+    memcpy(message + headerSize, &time, sizeof time);
+
+    for (int i = 0; i < burst; ++i)
+        endpoint.out.append(message, sizeof message);
+    chat.sent += burst;
+
+    flush(index);
+}
+
+void NetBench::sendPosition(size_t index, uint64_t time)
+{
+    Endpoint &endpoint = endpoints[index];
+
+    char datagram[headerSize + positionSize];
+    memset(datagram, 'p', sizeof datagram);
+    putHeader(datagram, positionSize, 'u', 'p');
+    memcpy(datagram + headerSize, &time, sizeof time);
+
+    // A full socket buffer just loses the update, like it would on a real network
+    if (send(endpoint.fd, datagram, sizeof datagram, 0) == (ssize_t)sizeof datagram)
+        ++positions.sent;
+}
+
+void NetBench::flush(size_t index)
+{
+    Endpoint &endpoint = endpoints[index];
+    if (!endpoint.connected)
+        return;
+
+    while (!endpoint.out.empty())
+    {
+        ssize_t r = send(endpoint.fd, endpoint.out.data(), endpoint.out.size(), MSG_NOSIGNAL);
+        if (r == -1)
+        {
+            if (errno != EAGAIN && errno != EINTR)
+                closeEndpoint(index);
+            return;
+        }
+        endpoint.out.erase(0, r);
+    }
+}
+
+void NetBench::readStream(size_t index, uint64_t time)
+{
+    Endpoint &endpoint = endpoints[index];
+
+    char buffer[16384];
+    while (true)
+    {
+        ssize_t r = recv(endpoint.fd, buffer, sizeof buffer, 0);
+        if (r <= 0)
+        {
+            if (r == 0 || (errno != EAGAIN && errno != EINTR))
+                closeEndpoint(index);
+            break;
+        }
+        endpoint.in.insert(endpoint.in.end(), buffer, buffer + r);
+    }
+
+    // Pick the send time out of every whole message
+    size_t offset = 0;
+    while (endpoint.in.size() - offset >= headerSize)
+    {
+        const unsigned char *header = (const unsigned char *)&endpoint.in[offset];
+        const size_t length = (header[0] << 8) | header[1];
+        if (endpoint.in.size() - offset < headerSize + length)
+            break;
+
+        if (length >= sizeof(uint64_t))
+        {
+            uint64_t sent;
+            memcpy(&sent, &endpoint.in[offset + headerSize], sizeof sent);
+            chat.latencies.push_back((uint32_t)(time - sent));
+        }
+        ++chat.received;
+        offset += headerSize + length;
+    }
+    endpoint.in.erase(endpoint.in.begin(), endpoint.in.begin() + offset);
+}
+
+void NetBench::readDatagrams(size_t index, uint64_t time)
+{
+    Endpoint &endpoint = endpoints[index];
+
+    char datagram[2048];
+    while (true)
+    {
+        ssize_t r = recv(endpoint.fd, datagram, sizeof datagram, 0);
+        if (r == -1)
+            break;
+
+        if ((size_t)r >= headerSize + sizeof(uint64_t))
+        {
+            uint64_t sent;
+            memcpy(&sent, datagram + headerSize, sizeof sent);
+            positions.latencies.push_back((uint32_t)(time - sent));
+        }
+        ++positions.received;
+    }
+}
+
+void NetBench::run(uint64_t duration, int churnPerSecond)
+{
+    const uint64_t start = now();
+    const uint64_t end = start + duration;
+    const uint64_t period = 1000000 / rate;
+    const uint64_t churnPeriod = churnPerSecond > 0 ? 1000000 / churnPerSecond : 0;
+    uint64_t nextChurn = start + churnPeriod;
+
+    const int maxEvents = 256;
+    struct epoll_event events[maxEvents];
+
+    while (true)
+    {
+        const int count = epoll_wait(epollFd, events, maxEvents, 1);
+        const uint64_t time = now();
+        if (time >= end)
+            break;
+
+        for (int i = 0; i < count; ++i)
+        {
+            const size_t index = events[i].data.u64;
+            Endpoint &endpoint = endpoints[index];
+            if (endpoint.fd == -1)
+                continue;
+
+            if (endpoint.udp)
+            {
+                if (events[i].events & EPOLLIN)
+                    readDatagrams(index, time);
+                continue;
+            }
+
+            if ((events[i].events & EPOLLOUT) && !endpoint.connected)
+            {
+                int error = 0;
+                socklen_t errorLen = sizeof error;
+                getsockopt(endpoint.fd, SOL_SOCKET, SO_ERROR, &error, &errorLen);
+                if (error != 0)
+                {
+                    ++connectFailures;
+                    closeEndpoint(index);
+                    continue;
+                }
+                endpoint.connected = true;
+            }
+
+            if (events[i].events & EPOLLOUT)
+                flush(index);
+            if (endpoint.fd != -1 && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+                readStream(index, time);
+        }
+
+        // Whatever is due: position updates on a fixed grid, chat bursts at random intervals
+        for (size_t index = 0; index < endpoints.size(); ++index)
+        {
+            Endpoint &endpoint = endpoints[index];
+            if (endpoint.fd == -1 || !endpoint.connected || endpoint.next > time)
+                continue;
+
+            if (endpoint.udp)
+            {
+                sendPosition(index, time);
+                endpoint.next += period;
+                if (endpoint.next <= time)
+                    endpoint.next = time + period;
+            }
+            else
+            {
+                sendChat(index, time);
+                endpoint.next = time + rng() % (2 * chatInterval);
+            }
+        }
+
+        // Replace a random connection, and any that were lost
+        if (churnPeriod != 0 && time >= nextChurn && !streams.empty())
+        {
+            const size_t index = streams[rng() % streams.size()];
+            closeEndpoint(index);
+            nextChurn += churnPeriod;
+        }
+        for (size_t index : streams)
+        {
+            if (endpoints[index].fd == -1 && !connectEndpoint(index))
+                return;
+        }
+    }
+}
+
+void NetBench::report(double seconds, uint64_t serverCpuUsec)
+{
+    std::cout << "Ran for " << seconds << " s, " << connects << " connects, " << connectFailures << " failed" << std::endl;
+    printLatency("Chat (TCP)", chat, seconds);
+    printLatency("Positions (UDP)", positions, seconds);
+
+    const uint64_t messages = chat.received + positions.received;
+    if (serverCpuUsec > 0 && messages > 0)
+    {
+        std::cout << "Server CPU: " << serverCpuUsec / 1000000.0 << " s, " << serverCpuUsec * 1000.0 / messages
+                  << " ns per echoed message" << std::endl;
+    }
+}
+
+void usage(const char *name)
+{
+    std::cerr << "usage: " << name << " [-a address] [-A address] [-p port] [-c connections] [-f flows] [-6 percent]"
+              << std::endl << "       [-r hz] [-b burst] [-i ms] [-x churn] [-d seconds] [-P pid]" << std::endl;
+    std::cerr << "  -a  server IPv4 address, empty for none (default 127.0.0.1)" << std::endl;
+    std::cerr << "  -A  server IPv6 address, empty for none (default ::1)" << std::endl;
+    std::cerr << "  -p  server port (default 5154)" << std::endl;
+    std::cerr << "  -c  TCP connections sending chat (default 1000)" << std::endl;
+    std::cerr << "  -f  UDP flows sending position updates (default 1000)" << std::endl;
+    std::cerr << "  -6  percentage of connections and flows using IPv6 (default 50)" << std::endl;
+    std::cerr << "  -r  position updates per second per flow (default 30)" << std::endl;
+    std::cerr << "  -b  chat messages per burst (default 5)" << std::endl;
+    std::cerr << "  -i  average milliseconds between chat bursts (default 2000)" << std::endl;
+    std::cerr << "  -x  connections closed and reopened per second (default 10)" << std::endl;
+    std::cerr << "  -d  seconds to run (default 10)" << std::endl;
+    std::cerr << "  -P  server pid, to report its CPU time per message" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    const char *host4 = "127.0.0.1";
+    const char *host6 = "::1";
+    const char *port = "5154";
+    int connections = 1000;
+    int flows = 1000;
+    int v6Percent = 50;
+    int rate = 30;
+    int burst = 5;
+    int chatInterval = 2000;
+    int churn = 10;
+    int duration = 10;
+    int serverPid = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "a:A:p:c:f:6:r:b:i:x:d:P:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'a':
+            host4 = optarg;
+            break;
+        case 'A':
+            host6 = optarg;
+            break;
+        case 'p':
+            port = optarg;
+            break;
+        case 'c':
+            connections = atoi(optarg);
+            break;
+        case 'f':
+            flows = atoi(optarg);
+            break;
+        case '6':
+            v6Percent = atoi(optarg);
+            break;
+        case 'r':
+            rate = atoi(optarg);
+            break;
+        case 'b':
+            burst = atoi(optarg);
+            break;
+        case 'i':
+            chatInterval = atoi(optarg);
+            break;
+        case 'x':
+            churn = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'P':
+            serverPid = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (connections < 0 || flows < 0 || rate < 1 || burst < 1 || chatInterval < 1 || churn < 0 || duration < 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    NetBench bench;
+    if (!bench.resolve(host4, host6, port) || !bench.open(connections, flows, v6Percent, rate, burst, chatInterval))
+        return 1;
+
+    const uint64_t cpuBefore = serverPid != 0 ? processCpuUsec(serverPid) : 0;
+    const uint64_t start = now();
+
+    bench.run((uint64_t)duration * 1000000, churn);
+
+    const double seconds = (now() - start) / 1000000.0;
+    const uint64_t cpuAfter = serverPid != 0 ? processCpuUsec(serverPid) : 0;
+
+    bench.report(seconds, cpuAfter - cpuBefore);
+    return 0;
+}
+
+
+/* Local Variables: ***
+ * mode: C++ ***
+ * tab-width: 8 ***
+ * c-basic-offset: 2 ***
+ * indent-tabs-mode: t ***
+ * End: ***
+ * ex: shiftwidth=2 tabstop=8
+ */
@@ -19,7 +19,7 @@
 #include <string>
 
 //#include "ErrorHandler.h"
-#include <iostream>
+#include "Logger.h"
 
 #if !defined(WIN32)
 
@@ -36,38 +36,19 @@ extern "C" {
 
     void            nerror(const char* msg)
     {
-        //std::vector<std::string> args;
+        // Queued for the log writer thread, the event loops call this
         if (msg)
-        {
-            /*args.push_back(msg);
-            args.push_back(strerror(errno));
-            printError("{1}: {2}", &args);*/
-            std::cerr << msg << ": " << strerror(errno) << std::endl;
-        }
+            logErrno(LogError, "{1}", msg);
         else
-        {
-            //args.push_back(strerror(errno));
-            //printError("{1}", &args);
-            std::cerr << strerror(errno) << std::endl;
-        }
+            logErrno(LogError, "");
     }
 
     void            bzfherror(const char* msg)
     {
-        //std::vector<std::string> args;
         if (msg)
-        {
-            /*args.push_back(msg);
-            args.push_back(hstrerror(h_errno));
-            printError("{1}: {2}", &args);*/
-            std::cerr << msg << ": " << hstrerror(h_errno) << std::endl;
-        }
+            logMessage(LogError, "{1}: {2}", msg, hstrerror(h_errno));
         else
-        {
-            /*args.push_back(hstrerror(h_errno));
-            printError("{1}", &args);*/
-            std::cerr << hstrerror(h_errno) << std::endl;
-        }
+            logMessage(LogError, "{1}", hstrerror(h_errno));
     }
 
     int         getErrno()
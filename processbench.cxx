@@ -0,0 +1,200 @@
+/* bzflag
+ * Copyright (c) 1993-2023 Tim Riker
+ *
+ * This package is free software;  you can redistribute it and/or
+ * modify it under the terms of the license found in the file
+ * named COPYING that should have accompanied this file.
+ *
+ * THIS PACKAGE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/*
+ * Microbenchmark for NetManager::process().  Connections are socketpairs
+ * adopted by a NetManager, so nothing but the event loop itself is measured
+ * and it runs the same on any Linux machine, no network setup needed.  Each
+ * round writes a few messages into every connection and runs process() until
+ * they have all been delivered (and, with -e, echoed back and read).
+ */
+
+#include "NetManager.h"
+
+#include <iostream>
+#include <vector>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+void usage(const char *name)
+{
+    std::cerr << "usage: " << name << " [-u] [-e] [-c connections] [-m messages] [-s size] [-r rounds]" << std::endl;
+    std::cerr << "  -u  use the io_uring backend instead of epoll" << std::endl;
+    std::cerr << "  -e  echo every message back and read the replies" << std::endl;
+    std::cerr << "  -c  connections (default 256)" << std::endl;
+    std::cerr << "  -m  messages written to each connection per round (default 8)" << std::endl;
+    std::cerr << "  -s  message payload size in bytes (default 32)" << std::endl;
+    std::cerr << "  -r  rounds (default 1000)" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    NetManager::Backend backend = NetManager::EpollBackend;
+    bool echo = false;
+    int connections = 256;
+    int messages = 8;
+    int size = 32;
+    int rounds = 1000;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "uec:m:s:r:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'u':
+            backend = NetManager::IoUringBackend;
+            break;
+        case 'e':
+            echo = true;
+            break;
+        case 'c':
+            connections = atoi(optarg);
+            break;
+        case 'm':
+            messages = atoi(optarg);
+            break;
+        case 's':
+            size = atoi(optarg);
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (connections < 1 || messages < 1 || size < 0 || size > 0xffff || rounds < 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    NetManager netManager("0", backend);
+
+    uint64_t delivered = 0;
+    netManager.setMessageReceivedCallback([&](const NetManager::Message &message)
+    {
+        ++delivered;
+        if (echo)
+            netManager.sendMessage(message.connection, message.code, message.data, message.length);
+    });
+
+    // Our ends of the pairs, the other ends belong to the NetManager
+    std::vector<int> peers;
+    for (int i = 0; i < connections; ++i)
+    {
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1)
+        {
+            perror("socketpair");
+            return 1;
+        }
+
+        if (netManager.adoptConnection(pair[1]) == 0)
+            return 1;
+        peers.push_back(pair[0]);
+    }
+
+    // Every message written in a round, back to back
+    const size_t messageBytes = 4 + size;
+    std::vector<char> batch(messageBytes * messages, 'x');
+    for (int i = 0; i < messages; ++i)
+    {
+        char *header = &batch[i * messageBytes];
+        header[0] = (char)(size >> 8);
+        header[1] = (char)size;
+        header[2] = 'b';
+        header[3] = 'm';
+    }
+    std::vector<char> replies(batch.size());
+
+    uint64_t calls = 0;
+    uint64_t busyUsec = 0;
+    const uint64_t start = NetManager::now();
+
+    for (int round = 0; round < rounds; ++round)
+    {
+        for (int fd : peers)
+        {
+            if (write(fd, batch.data(), batch.size()) != (ssize_t)batch.size())
+            {
+                perror("write");
+                return 1;
+            }
+        }
+
+        // Only the time spent inside process() counts
+        const uint64_t expected = (uint64_t)(round + 1) * connections * messages;
+        while (delivered < expected)
+        {
+            const uint64_t before = NetManager::now();
+            if (!netManager.process(-1))
+                return 1;
+            busyUsec += NetManager::now() - before;
+            ++calls;
+        }
+
+        if (echo)
+        {
+            for (int fd : peers)
+            {
+                size_t got = 0;
+                while (got < replies.size())
+                {
+                    ssize_t r = recv(fd, replies.data() + got, replies.size() - got, MSG_DONTWAIT);
+                    if (r > 0)
+                        got += r;
+                    else if (r == -1 && errno == EAGAIN)
+                    {
+                        // Part of the reply is still queued on the other end
+                        if (!netManager.process(0))
+                            return 1;
+                    }
+                    else
+                    {
+                        perror("recv");
+                        return 1;
+                    }
+                }
+            }
+        }
+    }
+
+    const uint64_t elapsed = NetManager::now() - start;
+
+    std::cout << delivered << " messages of " << size << " bytes over " << connections << " connections, "
+              << (netManager.getBackend() == NetManager::IoUringBackend ? "io_uring" : "epoll")
+              << (echo ? ", echoed" : "") << std::endl;
+    std::cout << "  " << calls << " process() calls, " << (double)delivered / calls << " messages per call" << std::endl;
+    std::cout << "  " << busyUsec * 1000.0 / delivered << " ns per message in process()" << std::endl;
+    std::cout << "  " << delivered * 1000000.0 / elapsed << " messages/s overall" << std::endl;
+
+    for (int fd : peers)
+        close(fd);
+
+    return 0;
+}
+
+
+/* Local Variables: ***
+ * mode: C++ ***
+ * tab-width: 8 ***
+ * c-basic-offset: 2 ***
+ * indent-tabs-mode: t ***
+ * End: ***
+ * ex: shiftwidth=2 tabstop=8
+ */
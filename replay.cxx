@@ -0,0 +1,443 @@
+/* bzflag
+ * Copyright (c) 1993-2023 Tim Riker
+ *
+ * This package is free software;  you can redistribute it and/or
+ * modify it under the terms of the license found in the file
+ * named COPYING that should have accompanied this file.
+ *
+ * THIS PACKAGE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/*
+ * Plays captures written by NetManager::startCapture() (server -c) back
+ * into a server.  Every captured connection is opened again and sent the
+ * same bytes in the same reads, and every datagram is sent again from a
+ * socket standing in for its original sender, in capture order.  Records
+ * go out at the pace they were captured at, scaled by -s, or with -f as
+ * fast as possible.  Several captures, such as one per shard, are merged by
+ * time.  Whatever the server sends back is read and thrown away.
+ */
+
+#include "Capture.h"
+
+#include <iostream>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+static uint64_t now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+class Replay
+{
+    public:
+        Replay();
+        ~Replay();
+
+        bool resolve(const char *host, const char *port);
+        bool addCapture(const char *path);
+
+        // speed scales the captured pace, 0 plays as fast as possible
+        void run(double speed);
+        void report(double seconds) const;
+    private:
+        struct Source
+        {
+            CaptureReader reader;
+            CaptureReader::Record record;
+            bool pending;
+        };
+
+        bool nextRecord(size_t &source);
+        void play(size_t source, const CaptureReader::Record &record);
+        void sendAll(int fd, const char *data, size_t length);
+        int openTcp();
+        int udpFor(const CaptureReader::Record &record);
+        void watch(int fd);
+        void drain(int timeoutMs);
+
+        struct sockaddr_storage server;
+        socklen_t serverLen;
+        int epollFd;
+
+        std::vector<Source *> sources;
+
+        // Captured connections by capture and connection id, datagram senders by address
+        std::map<std::pair<size_t, uint64_t>, int> connections;
+        std::map<std::string, int> senders;
+
+        uint64_t firstTime;
+        uint64_t lastTime;
+        uint64_t records;
+        uint64_t accepts;
+        uint64_t tcpBytes;
+        uint64_t datagrams;
+        uint64_t skipped;
+        uint64_t failures;
+        uint64_t repliedBytes;
+};
+
+Replay::Replay() : serverLen(0), epollFd(-1), firstTime(0), lastTime(0), records(0), accepts(0), tcpBytes(0),
+    datagrams(0), skipped(0), failures(0), repliedBytes(0)
+{
+}
+
+Replay::~Replay()
+{
+    for (auto &connection : connections)
+    {
+        if (connection.second != -1)
+            close(connection.second);
+    }
+    for (auto &sender : senders)
+    {
+        if (sender.second != -1)
+            close(sender.second);
+    }
+    for (Source *source : sources)
+        delete source;
+    if (epollFd != -1)
+        close(epollFd);
+}
+
+bool Replay::resolve(const char *host, const char *port)
+{
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+
+    if (getaddrinfo(host, port, &hints, &res) != 0)
+    {
+        std::cerr << "bad server address " << host << " port " << port << std::endl;
+        return false;
+    }
+
+    memcpy(&server, res->ai_addr, res->ai_addrlen);
+    serverLen = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd == -1)
+    {
+        perror("epoll_create1");
+        return false;
+    }
+    return true;
+}
+
+bool Replay::addCapture(const char *path)
+{
+    Source *source = new Source;
+    if (!source->reader.open(path))
+    {
+        delete source;
+        return false;
+    }
+
+    source->pending = source->reader.next(source->record);
+    sources.push_back(source);
+    return true;
+}
+
+bool Replay::nextRecord(size_t &source)
+{
+    // The earliest record of all captures, the first capture wins a tie so the order is always the same
+    bool found = false;
+    for (size_t i = 0; i < sources.size(); ++i)
+    {
+        if (sources[i]->pending && (!found || sources[i]->record.time < sources[source]->record.time))
+        {
+            source = i;
+            found = true;
+        }
+    }
+    return found;
+}
+
+void Replay::run(double speed)
+{
+    const uint64_t start = now();
+
+    size_t source;
+    while (nextRecord(source))
+    {
+        CaptureReader::Record &record = sources[source]->record;
+        if (records == 0)
+            firstTime = record.time;
+        lastTime = record.time;
+
+        if (speed > 0)
+        {
+            // Read replies while waiting for the record's time to come
+            const uint64_t due = start + (uint64_t)((record.time - firstTime) / speed);
+            for (uint64_t t = now(); t < due; t = now())
+            {
+                if (due - t >= 1000)
+                    drain((int)((due - t) / 1000));
+                else
+                    usleep(due - t);
+            }
+        }
+        else if (records % 64 == 0)
+            drain(0);
+
+        play(source, record);
+        ++records;
+
+        sources[source]->pending = sources[source]->reader.next(record);
+    }
+
+    // Give the server a moment to answer the last of it
+    drain(100);
+}
+
+void Replay::play(size_t source, const CaptureReader::Record &record)
+{
+    const std::pair<size_t, uint64_t> key(source, record.connection);
+
+    switch (record.type)
+    {
+    case CaptureAccept:
+    {
+        int &fd = connections[key];
+        fd = openTcp();
+        ++accepts;
+        break;
+    }
+
+    case CaptureTcpData:
+    {
+        auto connection = connections.find(key);
+        if (connection == connections.end() || connection->second == -1)
+        {
+            // Connected before the capture started, or the connect failed
+            ++skipped;
+            break;
+        }
+        sendAll(connection->second, record.data, record.length);
+        tcpBytes += record.length;
+        break;
+    }
+
+    case CaptureDatagram:
+    {
+        int fd = udpFor(record);
+        if (fd == -1 || send(fd, record.data, record.length, 0) == -1)
+            ++failures;
+        else
+            ++datagrams;
+        break;
+    }
+
+    case CaptureDisconnect:
+    {
+        auto connection = connections.find(key);
+        if (connection == connections.end())
+            break;
+        if (connection->second != -1)
+            close(connection->second);
+        connections.erase(connection);
+        break;
+    }
+    }
+}
+
+void Replay::sendAll(int fd, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t r = send(fd, data, length, MSG_NOSIGNAL);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0)
+        {
+            ++failures;
+            return;
+        }
+        data += r;
+        length -= r;
+    }
+}
+
+int Replay::openTcp()
+{
+    int fd = socket(server.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        perror("socket");
+        ++failures;
+        return -1;
+    }
+
+    // Keep the captured reads as separate segments
+    const int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+
+    if (connect(fd, (struct sockaddr *)&server, serverLen) == -1)
+    {
+        perror("connect");
+        close(fd);
+        ++failures;
+        return -1;
+    }
+
+    watch(fd);
+    return fd;
+}
+
+int Replay::udpFor(const CaptureReader::Record &record)
+{
+    const std::string key((const char *)&record.address, record.addressLength);
+    auto sender = senders.find(key);
+    if (sender != senders.end())
+        return sender->second;
+
+    int fd = socket(server.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd != -1 && connect(fd, (struct sockaddr *)&server, serverLen) == -1)
+    {
+        perror("connect");
+        close(fd);
+        fd = -1;
+    }
+
+    if (fd != -1)
+        watch(fd);
+    senders[key] = fd;
+    return fd;
+}
+
+void Replay::watch(int fd)
+{
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+}
+
+void Replay::drain(int timeoutMs)
+{
+    struct epoll_event events[64];
+    int count = epoll_wait(epollFd, events, 64, timeoutMs);
+
+    char buffer[65536];
+    for (int i = 0; i < count; ++i)
+    {
+        while (true)
+        {
+            ssize_t r = recv(events[i].data.fd, buffer, sizeof buffer, MSG_DONTWAIT);
+            if (r > 0)
+            {
+                repliedBytes += r;
+                continue;
+            }
+
+            // Closed by the server, stop hearing about it; sends will fail and be counted
+            if (r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+                epoll_ctl(epollFd, EPOLL_CTL_DEL, events[i].data.fd, nullptr);
+            break;
+        }
+    }
+}
+
+void Replay::report(double seconds) const
+{
+    const double captured = (lastTime - firstTime) / 1000000.0;
+
+    std::cout << records << " records covering " << captured << " s replayed in " << seconds << " s" << std::endl;
+    std::cout << "  " << accepts << " connections, " << tcpBytes << " TCP bytes, " << datagrams << " datagrams" << std::endl;
+    std::cout << "  " << repliedBytes << " bytes back from the server" << std::endl;
+    if (skipped > 0 || failures > 0)
+        std::cout << "  " << skipped << " records for unknown connections skipped, " << failures << " sends or connects failed" << std::endl;
+}
+
+void usage(const char *name)
+{
+    std::cerr << "usage: " << name << " [-a address] [-p port] [-s speed] [-f] capture..." << std::endl;
+    std::cerr << "  -a  server address (default 127.0.0.1)" << std::endl;
+    std::cerr << "  -p  server port (default 5154)" << std::endl;
+    std::cerr << "  -s  play at this multiple of the captured pace (default 1)" << std::endl;
+    std::cerr << "  -f  play as fast as possible" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    const char *host = "127.0.0.1";
+    const char *port = "5154";
+    double speed = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "a:p:s:f")) != -1)
+    {
+        switch (opt)
+        {
+        case 'a':
+            host = optarg;
+            break;
+        case 'p':
+            port = optarg;
+            break;
+        case 's':
+            speed = atof(optarg);
+            break;
+        case 'f':
+            speed = 0;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind >= argc || speed < 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    Replay replay;
+    if (!replay.resolve(host, port))
+        return 1;
+
+    for (int i = optind; i < argc; ++i)
+    {
+        if (!replay.addCapture(argv[i]))
+            return 1;
+    }
+
+    const uint64_t start = now();
+    replay.run(speed);
+    replay.report((now() - start) / 1000000.0);
+
+    return 0;
+}
+
+
+/* Local Variables: ***
+ * mode: C++ ***
+ * tab-width: 8 ***
+ * c-basic-offset: 2 ***
+ * indent-tabs-mode: t ***
+ * End: ***
+ * ex: shiftwidth=2 tabstop=8
+ */
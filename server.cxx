@@ -22,12 +22,24 @@
 
 
 #include "NetManager.h"
+#include "NetShards.h"
+#include "IoThread.h"
+#include "WorkerPool.h"
+#include "BanList.h"
+#include "Metrics.h"
+#include "Logger.h"
+#include "PeerAddress.h"
+#ifdef HAVE_COROUTINES
+#include "Reactor.h"
+#endif
 
 #include <vector>
 #include <string>
 #include <iostream>
+#include <fstream>
 #include <signal.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <fcntl.h>
@@ -38,91 +50,525 @@
 #include <poll.h>
 
 bool running = true;
+volatile sig_atomic_t caughtSignal = 0;
+volatile sig_atomic_t reloadBans = 0;
 
+// Sent to connections that have gone quiet, BZFlag's MsgLagPing
+const uint16_t msgLagPing = 0x7069;
 
 
+
+// Logging isn't safe in a signal handler, the main loop reports the signal once it stops
 void terminate(int signum)
 {
-    if (signum == 2)
-        std::cout << std::endl;
-    std::cout << "Received signal " << signum << ", shutting down" << std::endl;
+    caughtSignal = signum;
     running = false;
 }
 
-// Get sockaddr, IPv4 or IPv6:
-void * get_in_addr(struct sockaddr *sa)
+void hangup(int UNUSED(signum))
+{
+    reloadBans = 1;
+}
+
+// Read a ban file, an address or CIDR range a line and # starting a comment, and swap it in
+bool loadBans(BanList &banList, const char *path)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        logErrno(LogError, "Couldn't open ban file {1}", path);
+        return false;
+    }
+
+    banList.clear();
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(file, line))
+    {
+        ++lineNumber;
+        line.erase(std::min(line.find('#'), line.size()));
+        line.erase(0, line.find_first_not_of(" \t\r"));
+        line.erase(line.find_last_not_of(" \t\r") + 1);
+        if (line.empty())
+            continue;
+
+        if (!banList.add(line.c_str()))
+            logMessage(LogWarning, "{1} line {2}: not an address or CIDR range", path, lineNumber);
+    }
+
+    banList.publish();
+    logMessage(LogInfo, "Banned {1} addresses and ranges from {2}", banList.size(), path);
+    return true;
+}
+
+// SIGHUP rereads the ban file
+void checkBanReload(BanList *banList, const char *path)
 {
-    if (sa->sa_family == AF_INET)
-        return &(((struct sockaddr_in*)sa)->sin_addr);
+    if (!reloadBans)
+        return;
 
-    return &(((struct sockaddr_in6*)sa)->sin6_addr);
+    reloadBans = 0;
+    if (banList != nullptr)
+        loadBans(*banList, path);
 }
 
-void acceptConnection(struct sockaddr* remoteIP, int socket)
+// Addresses are only turned into text if the line is written, by the logging thread
+void acceptConnection(struct sockaddr* remoteIP, NetManager::ConnectionId connection)
 {
-    char ipstr[INET6_ADDRSTRLEN];
-    inet_ntop(remoteIP->sa_family, get_in_addr(remoteIP), ipstr, INET_ADDRSTRLEN);
+    const PeerAddress peer(remoteIP);
 
-    if (remoteIP->sa_family == AF_INET)
-        std::cout << "Accepted IPv4 TCP connection from " << ipstr << " on socket " << socket << std::endl;
+    if (peer.isIPv4())
+        logMessage(LogInfo, "Accepted IPv4 TCP connection from {1} as connection {2}", peer, connection);
     else
-        std::cout << "Accepted IPv6 TCP connection from [" << ipstr << "] on socket " << socket << std::endl;
+        logMessage(LogInfo, "Accepted IPv6 TCP connection from {1} as connection {2}", peer, connection);
+}
+
+void gameTick(uint64_t UNUSED(deadline))
+{
+    // Game logic runs here, at a fixed rate
+}
+
+void handleMessageReceived(const NetManager::Message &message)
+{
+    logMessage(LogInfo, "Received message {1}{2} ({3} bytes) on connection {4}",
+               (char)(message.code >> 8), (char)(message.code & 0xff), message.length, message.connection);
+}
+
+// The same handler run on a worker thread, with nothing to do back on the event loop
+std::function<void()> handlePooledMessage(const NetManager::Message &message)
+{
+    handleMessageReceived(message);
+    return nullptr;
+}
+
+void reportLoad(NetShards &netShards, std::vector<NetManager::Stats> &lastLoad, int interval)
+{
+    lastLoad.resize(netShards.getShardCount());
+
+    for (int i = 0; i < netShards.getShardCount(); ++i)
+    {
+        NetManager::Stats load = netShards.getShard(i).getStats();
+        NetManager::Stats &last = lastLoad[i];
+        NetManager::BufferUsage buffers = netShards.getShard(i).getBufferUsage();
+
+        logMessage(LogInfo, "Shard {1}: {2} wakeups, {3} events, {4}% busy, {5} receive buffers in use (peak {6})",
+                   i, load.wakeups - last.wakeups, load.events - last.events,
+                   (load.busyUsec - last.busyUsec) / (interval * 10000.0), buffers.inUse, buffers.highWater);
+        last = load;
+    }
+}
+
+void handleDatagramReceived(const char *UNUSED(data), size_t length, const struct sockaddr_storage &from)
+{
+    logMessage(LogInfo, "Received {1} byte datagram from {2}", length, PeerAddress(from));
+}
+
+// Game thread side of the I/O thread, the same handlers as when they were called from the event loop
+void handleEvent(const IoThread::Event &event)
+{
+    switch (event.type)
+    {
+    case IoThread::AcceptEvent:
+        acceptConnection((struct sockaddr *)event.address, event.connection);
+        break;
+
+    case IoThread::MessageEvent:
+    {
+        NetManager::Message message;
+        message.connection = event.connection;
+        message.code = event.code;
+        message.data = event.data;
+        message.length = event.length;
+        message.received = event.received;
+        handleMessageReceived(message);
+        break;
+    }
+
+    case IoThread::DatagramEvent:
+        handleDatagramReceived(event.data, event.length, *event.address);
+        break;
+
+    case IoThread::DisconnectEvent:
+        // NetManager already logged it, there is no player state to clean up yet
+        break;
+    }
+}
+
+// Sleep until a NetManager::now() time, or until a signal arrives
+void sleepUntil(uint64_t deadline)
+{
+    struct timespec ts;
+    ts.tv_sec = deadline / 1000000;
+    ts.tv_nsec = (deadline % 1000000) * 1000;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr);
+}
+
+// Benchmark mode: send every message and datagram straight back, without logging anything
+void echoTo(NetManager &netManager)
+{
+    netManager.setMessageReceivedCallback([&netManager](const NetManager::Message &message)
+    {
+        netManager.sendMessage(message.connection, message.code, message.data, message.length);
+    });
+
+    // With a worker pool the echo goes through it, the reply is still sent from the event loop
+    netManager.setPooledMessageCallback([&netManager](const NetManager::Message &message)
+    {
+        return [&netManager, &message]()
+        {
+            netManager.sendMessage(message.connection, message.code, message.data, message.length);
+        };
+    });
+
+    netManager.setDatagramReceivedCallback([&netManager](const char *data, size_t length, const struct sockaddr_storage &from)
+    {
+        NetManager::Datagram datagram;
+        datagram.data = data;
+        datagram.length = length;
+        datagram.destination = &from;
+        netManager.sendDatagrams(&datagram, 1);
+    });
+}
+
+#ifdef HAVE_COROUTINES
+// Echo mode again, with a coroutine per connection reading its messages and answering them
+NetTask echoClient(Reactor &reactor, NetManager::ConnectionId connection)
+{
+    NetManager::Message message;
+    while (co_await reactor.read(connection, message))
+        co_await reactor.write(connection, message.code, message.data, message.length);
+}
+
+NetTask echoAccept(Reactor &reactor)
+{
+    while (true)
+    {
+        PeerAddress peer;
+        const NetManager::ConnectionId connection = co_await reactor.accept(peer);
+        echoClient(reactor, connection);
+    }
 }
+#endif
 
-void handleMessageReceived(const char *data)
+void usage(const char *name)
 {
-    std::cout << "Received data: " << data << std::endl;
+    std::cerr << "usage: " << name << " [-u] [-d] [-e] [-t threads] [-w workers] [-l rate] [-L rate] [-i seconds] [-b bans] [-m port] [-c capture]" << std::endl;
+    std::cerr << "  -u  use the io_uring backend instead of epoll" << std::endl;
+    std::cerr << "  -d  take IPv4 and IPv6 on one dual-stack \"::\" listener per thread" << std::endl;
+    std::cerr << "  -e  echo messages and datagrams back quietly, for netbench" << std::endl;
+    std::cerr << "  -t  run this many reactor threads, each pinned to a core" << std::endl;
+#ifdef HAVE_COROUTINES
+    std::cerr << "  -k  with -e, answer messages from a coroutine per connection instead of a callback" << std::endl;
+#endif
+    std::cerr << "  -w  with -e or -t, handle messages on a pool of this many worker threads (0 for one per core)" << std::endl;
+    std::cerr << "  -l  connections a second allowed from one address (IPv6 /64), per thread" << std::endl;
+    std::cerr << "  -L  datagrams and messages a second allowed from one address (IPv6 /64), per thread" << std::endl;
+    std::cerr << "  -i  close connections that haven't sent a message, or anything at all, for this many seconds" << std::endl;
+    std::cerr << "      (pinging them halfway there)" << std::endl;
+    std::cerr << "  -b  refuse addresses and CIDR ranges listed in this file, reread on SIGHUP" << std::endl;
+    std::cerr << "  -m  serve Prometheus metrics on this port on localhost" << std::endl;
+    std::cerr << "  -c  capture traffic to this file for replay (one file per thread, suffixed .0, .1, ...)" << std::endl;
 }
 
-int main()
+int main(int argc, char **argv)
 {
+    NetManager::Backend backend = NetManager::EpollBackend;
+    int threads = 0;
+    int workers = -1;
+    double connectionRate = 0;
+    double packetRate = 0;
+    int idleSeconds = 0;
+    const char *banPath = nullptr;
+    bool dualStack = false;
+    bool echo = false;
+#ifdef HAVE_COROUTINES
+    bool coroutines = false;
+#endif
+    const char *metricsPort = nullptr;
+    const char *capturePath = nullptr;
+
+    int opt;
+#ifdef HAVE_COROUTINES
+    const char *options = "udekt:w:l:L:i:b:m:c:";
+#else
+    const char *options = "udet:w:l:L:i:b:m:c:";
+#endif
+    while ((opt = getopt(argc, argv, options)) != -1)
+    {
+        switch (opt)
+        {
+        case 'u':
+            backend = NetManager::IoUringBackend;
+            break;
+        case 'd':
+            dualStack = true;
+            break;
+        case 'e':
+            echo = true;
+            break;
+#ifdef HAVE_COROUTINES
+        case 'k':
+            coroutines = true;
+            break;
+#endif
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'w':
+            workers = atoi(optarg);
+            break;
+        case 'l':
+            connectionRate = atof(optarg);
+            break;
+        case 'L':
+            packetRate = atof(optarg);
+            break;
+        case 'i':
+            idleSeconds = atoi(optarg);
+            break;
+        case 'b':
+            banPath = optarg;
+            break;
+        case 'm':
+            metricsPort = optarg;
+            break;
+        case 'c':
+            capturePath = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // Everything logged from here on is written by a thread of its own
+    Logger::start();
+
     // Set up signal handling
     struct sigaction action;
     memset(&action, 0, sizeof(action));
     action.sa_handler = terminate;
     sigaction(SIGTERM, &action, nullptr);
     sigaction(SIGINT, &action, nullptr);
+    action.sa_handler = hangup;
+    sigaction(SIGHUP, &action, nullptr);
 
     // Set up requested interfaces as string values
     std::vector<std::string> interfaces;
-    interfaces.push_back("0.0.0.0");
+    if (!dualStack)
+        interfaces.push_back("0.0.0.0");
     interfaces.push_back("::");
 
     // The port to use
     const char *port = "5154";
 
-    // Create a NetManager and bind each interface
-    NetManager *netManager = new NetManager(port);
+    // Handlers may run on a pool of threads, which has to outlive the NetManagers
+    WorkerPool *workerPool = nullptr;
+    if (workers >= 0)
+        workerPool = new WorkerPool(workers);
+
+    // Create a NetManager, or one per thread, and bind each interface
+    NetManager *netManager = nullptr;
+    NetShards *netShards = nullptr;
+    if (threads > 0)
+        netShards = new NetShards(port, threads, backend);
+    else
+        netManager = new NetManager(port, backend);
+
+    if (workerPool != nullptr)
+    {
+        if (netShards != nullptr)
+            netShards->setWorkerPool(workerPool);
+        else
+            netManager->setWorkerPool(workerPool);
+    }
+
+    // One ban list for every thread
+    BanList *banList = nullptr;
+    if (banPath != nullptr)
+    {
+        banList = new BanList;
+        loadBans(*banList, banPath);
+    }
+
+    // Settings for every thread, rate limits allow bursts of twice the rate
+    for (int i = 0; i < (netShards != nullptr ? netShards->getShardCount() : 1); ++i)
+    {
+        NetManager &shard = netShards != nullptr ? netShards->getShard(i) : *netManager;
+        shard.setDualStack(dualStack);
+        shard.setConnectionRateLimit(connectionRate, (unsigned)(connectionRate * 2) + 1);
+        shard.setPacketRateLimit(packetRate, (unsigned)(packetRate * 2) + 1);
+        if (banList != nullptr)
+            shard.setBanList(banList);
+
+        // The keepalive is an empty lag ping, which clients answer
+        if (idleSeconds > 0)
+        {
+            const uint64_t idleUsec = (uint64_t)idleSeconds * 1000000;
+            shard.setHandshakeTimeout(idleUsec);
+            shard.setIdleTimeout(idleUsec);
+            shard.setKeepalive(idleUsec / 2, [&shard](NetManager::ConnectionId connection)
+            {
+                shard.sendMessage(connection, msgLagPing, nullptr, 0);
+            });
+        }
+    }
+
     for (auto &interface : interfaces)
     {
-        if (netManager->bind(interface.c_str()))
+        if (netShards != nullptr ? netShards->bind(interface.c_str()) : netManager->bind(interface.c_str()))
         {
-            std::cout << "Listening on " << interface << " port " << port << std::endl;
+            logMessage(LogInfo, "Listening on {1} port {2}", interface, port);
         }
         else
         {
-            std::cerr << "Failed to bind to " << interface << " port " << port << ": ";
-            perror("");
+            logErrno(LogError, "Failed to bind to {1} port {2}", interface, port);
         }
     }
-    netManager->addAcceptCallback(acceptConnection);
-    netManager->setMessageReceivedCallback(handleMessageReceived);
 
-    // Game loop
-    while (running)
+    if (capturePath != nullptr)
     {
-        netManager->process();
+        if (netShards != nullptr ? netShards->startCapture(capturePath) : netManager->startCapture(capturePath))
+            logMessage(LogInfo, "Capturing traffic to {1}", capturePath);
+    }
+
+    // Unless benchmarking, a lone NetManager gets an I/O thread and the main thread runs the game
+    IoThread *ioThread = nullptr;
+    if (netManager != nullptr && !echo)
+        ioThread = new IoThread(*netManager);
+
+    // Scrapes are answered on a thread of their own, reading the counters each NetManager keeps
+    MetricsServer metricsServer;
+    if (metricsPort != nullptr)
+    {
+        if (netShards != nullptr)
+        {
+            for (int i = 0; i < netShards->getShardCount(); ++i)
+                metricsServer.addNetManager(netShards->getShard(i));
+        }
+        else
+            metricsServer.addNetManager(*netManager);
+        if (ioThread != nullptr)
+            metricsServer.addIoThread(*ioThread);
+        if (workerPool != nullptr)
+            metricsServer.addWorkerPool(*workerPool);
+
+        if (metricsServer.start("127.0.0.1", metricsPort))
+            logMessage(LogInfo, "Serving metrics on 127.0.0.1 port {1}", metricsPort);
+    }
+
+#ifdef HAVE_COROUTINES
+    // Coroutine handlers need a reactor per NetManager, gone before the NetManagers are
+    std::vector<Reactor *> reactors;
+#endif
+
+    // Benchmark mode answers straight from each event loop
+    if (echo)
+    {
+        for (int i = 0; i < (netShards != nullptr ? netShards->getShardCount() : 1); ++i)
+        {
+            NetManager &echoing = netShards != nullptr ? netShards->getShard(i) : *netManager;
+            echoTo(echoing);
+#ifdef HAVE_COROUTINES
+            if (coroutines)
+            {
+                reactors.push_back(new Reactor(echoing));
+                echoAccept(*reactors.back());
+            }
+#endif
+        }
+    }
+
+    if (netShards != nullptr)
+    {
+        if (!echo)
+        {
+            netShards->addAcceptCallback(acceptConnection);
+            netShards->setMessageReceivedCallback(handleMessageReceived);
+            netShards->setPooledMessageCallback(handlePooledMessage);
+            netShards->setDatagramReceivedCallback(handleDatagramReceived);
+        }
+
+        // The shards do the work, just report how busy they are every now and then
+        const int reportInterval = 10;
+        std::vector<NetManager::Stats> lastLoad;
+        int seconds = 0;
+
+        netShards->start();
+        while (running)
+        {
+            sleep(1);
+            checkBanReload(banList, banPath);
+            if (++seconds % reportInterval == 0)
+                reportLoad(*netShards, lastLoad, reportInterval);
+        }
+        logMessage(LogInfo, "Received signal {1}, shutting down", (int)caughtSignal);
+        netShards->stop();
+        metricsServer.stop();
+
+#ifdef HAVE_COROUTINES
+        for (Reactor *reactor : reactors)
+            delete reactor;
+#endif
+        delete netShards;
+        netShards = nullptr;
+    }
+    else if (echo)
+    {
+        // The event loop runs on this thread
+        while (running)
+        {
+            netManager->process();
+            checkBanReload(banList, banPath);
+        }
+        logMessage(LogInfo, "Received signal {1}, shutting down", (int)caughtSignal);
+
+        metricsServer.stop();
+#ifdef HAVE_COROUTINES
+        for (Reactor *reactor : reactors)
+            delete reactor;
+#endif
+        delete netManager;
+        netManager = nullptr;
+    }
+    else
+    {
+        ioThread->start();
+
+        // Game loop: take whatever the I/O thread queued since the last tick, run the tick, then
+        // hand it everything the tick sent.  Like a repeating timer it keeps to a fixed grid.
+        const int tickRate = 30;
+        const uint64_t tickPeriod = 1000000 / tickRate;
+        uint64_t deadline = NetManager::now();
+        while (running)
+        {
+            deadline += tickPeriod;
+            if (NetManager::now() > deadline + tickPeriod)
+                deadline = NetManager::now();
+            sleepUntil(deadline);
+            checkBanReload(banList, banPath);
+
+            ioThread->drain(handleEvent);
+            gameTick(deadline);
+            ioThread->flush();
+        }
+        logMessage(LogInfo, "Received signal {1}, shutting down", (int)caughtSignal);
 
-        // Sleep a bit
-        usleep(100000);
+        // Shut down the I/O thread before its NetManager
+        ioThread->stop();
+        metricsServer.stop();
+        delete ioThread;
+        ioThread = nullptr;
+        delete netManager;
+        netManager = nullptr;
     }
 
-    // Shut down NetManager
-    delete netManager;
-    netManager = nullptr;
+    delete workerPool;
+    delete banList;
 
     // Thanks for all the fish!
-    std::cout << "Goodbye!" << std::endl;
+    logMessage(LogInfo, "Goodbye!");
+    Logger::stop();
 
     return 0;
 }